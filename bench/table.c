@@ -0,0 +1,136 @@
+// Микрозамеры хэш-таблицы (make bench-table): вставка, поиск, удаление
+// и интернирование строк. Печатает наносекунды на операцию и качество хэша таблиц.
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "object.h"
+#include "table.h"
+#include "vm.h"
+
+#define KEYS 100000
+#define ROUNDS 20
+#define LONG_KEY 64
+
+static double now() {
+    struct timespec time;
+    timespec_get(&time, TIME_UTC);
+    return time.tv_sec * 1e9 + time.tv_nsec;
+}
+
+static void report(const char* name, double start, long operations) {
+    printf("%-22s %6.1f ns/op\n", name, (now() - start) / operations);
+}
+
+int main() {
+    initVM();
+    // Ключи живут до конца замера только потому, что сборка мусора не запускается
+    vm.nextGC = SIZE_MAX;
+
+    static char names[KEYS][16];
+    static ObjString* keys[KEYS];
+    for (int i = 0; i < KEYS; i++) {
+        int length = snprintf(names[i], sizeof(names[i]), "key%d", i);
+        keys[i] = copyString(names[i], length);
+    }
+
+    Table table;
+    initTable(&table);
+    double start = now();
+    for (int round = 0; round < ROUNDS; round++) {
+        freeTable(&table);
+        for (int i = 0; i < KEYS; i++) tableSet(&table, keys[i], NUMBER_VAL(i));
+    }
+    report("set (insert)", start, (long)ROUNDS * KEYS);
+
+    start = now();
+    for (int round = 0; round < ROUNDS; round++) {
+        for (int i = 0; i < KEYS; i++) tableSet(&table, keys[i], NUMBER_VAL(round));
+    }
+    report("set (overwrite)", start, (long)ROUNDS * KEYS);
+
+    Value value;
+    double sum = 0;
+    start = now();
+    for (int round = 0; round < ROUNDS; round++) {
+        for (int i = 0; i < KEYS; i++) {
+            if (tableGet(&table, keys[i], &value)) sum += AS_NUMBER(value);
+        }
+    }
+    report("get (hit)", start, (long)ROUNDS * KEYS);
+
+    // Промахи: половина ключей удалена, ищем удалённые
+    for (int i = 0; i < KEYS; i += 2) tableDelete(&table, keys[i]);
+    start = now();
+    for (int round = 0; round < ROUNDS; round++) {
+        for (int i = 0; i < KEYS; i += 2) {
+            if (tableGet(&table, keys[i], &value)) sum += AS_NUMBER(value);
+        }
+    }
+    report("get (miss)", start, (long)ROUNDS * KEYS / 2);
+
+    start = now();
+    for (int round = 0; round < ROUNDS; round++) {
+        for (int i = 0; i < KEYS; i++) tableSet(&table, keys[i], NIL_VAL);
+        for (int i = 0; i < KEYS; i++) tableDelete(&table, keys[i]);
+    }
+    report("set + delete", start, (long)ROUNDS * KEYS * 2);
+    freeTable(&table);
+
+    start = now();
+    for (int round = 0; round < ROUNDS; round++) {
+        for (int i = 0; i < KEYS; i++) {
+            ObjString* string = copyString(names[i], (int)strlen(names[i]));
+            if (string != keys[i]) sum++;
+        }
+    }
+    report("intern (existing)", start, (long)ROUNDS * KEYS);
+
+    // Тот же поиск в случайном порядке: при последовательных ключах соседние хэши
+    // могут попадать в соседние группы и выигрывать на кэше, а в реальных данных такого порядка нет
+    static int order[KEYS];
+    for (int i = 0; i < KEYS; i++) order[i] = i;
+    srand(1);
+    for (int i = KEYS - 1; i > 0; i--) {
+        int j = rand() % (i + 1);
+        int swap = order[i];
+        order[i] = order[j];
+        order[j] = swap;
+    }
+    start = now();
+    for (int round = 0; round < ROUNDS; round++) {
+        for (int i = 0; i < KEYS; i++) {
+            const char* name = names[order[i]];
+            if (copyString(name, (int)strlen(name)) != keys[order[i]]) sum++;
+        }
+    }
+    report("intern (shuffled)", start, (long)ROUNDS * KEYS);
+
+    static char fresh[KEYS][16];
+    for (int i = 0; i < KEYS; i++) snprintf(fresh[i], sizeof(fresh[i]), "new%d", i);
+    start = now();
+    for (int i = 0; i < KEYS; i++) copyString(fresh[i], (int)strlen(fresh[i]));
+    report("intern (new)", start, KEYS);
+
+    // Длинные ключи: здесь время уходит на хэширование и сравнение символов
+    static char paths[KEYS][LONG_KEY + 1];
+    for (int i = 0; i < KEYS; i++) {
+        snprintf(paths[i], sizeof(paths[i]), "/usr/share/lox/modules/library/%029d.lox", i);
+        copyString(paths[i], LONG_KEY);
+    }
+    start = now();
+    for (int round = 0; round < ROUNDS; round++) {
+        for (int i = 0; i < KEYS; i++) {
+            if (copyString(paths[i], LONG_KEY)->length != LONG_KEY) sum++;
+        }
+    }
+    report("intern (64-byte keys)", start, (long)ROUNDS * KEYS);
+
+    fflush(stdout);
+    printTableStats("vm.strings", &vm.strings);
+
+    if (sum < 0) printf("%f\n", sum);
+    freeVM();
+    return 0;
+}
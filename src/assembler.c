@@ -0,0 +1,232 @@
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include "assembler.h"
+
+#ifdef JIT
+
+#include "memory.h"
+
+void initAssembler(Assembler* as) {
+    as->code = NULL;
+    as->count = 0;
+    as->capacity = 0;
+    as->patches = NULL;
+    as->patchCount = 0;
+    as->patchCapacity = 0;
+}
+
+void freeAssembler(Assembler* as) {
+    FREE_ARRAY(uint8_t, as->code, as->capacity);
+    FREE_ARRAY(Patch, as->patches, as->patchCapacity);
+    initAssembler(as);
+}
+
+void emit(Assembler* as, uint8_t byte) {
+    if (as->capacity < as->count + 1) {
+        int oldCapacity = as->capacity;
+        as->capacity = GROW_CAPACITY(oldCapacity);
+        as->code = GROW_ARRAY(uint8_t, as->code, oldCapacity, as->capacity);
+    }
+    as->code[as->count++] = byte;
+}
+
+void emit32(Assembler* as, uint32_t value) {
+    for (int i = 0; i < 4; i++) emit(as, (uint8_t)(value >> (i * 8)));
+}
+
+void emit64(Assembler* as, uint64_t value) {
+    for (int i = 0; i < 8; i++) emit(as, (uint8_t)(value >> (i * 8)));
+}
+
+void patch32(Assembler* as, int position, int32_t value) {
+    memcpy(&as->code[position], &value, sizeof(value));
+}
+
+//* Префикс REX.W: 64-битный операнд, старшие биты номеров регистров
+void rex(Assembler* as, Register reg, Register rm) {
+    emit(as, 0x48 | ((reg & 8) ? 4 : 0) | ((rm & 8) ? 1 : 0));
+}
+
+//* Префикс REX без W — только если нужен регистр r8..r15
+static void rexOptional(Assembler* as, int reg, Register rm) {
+    if ((reg & 8) || (rm & 8)) emit(as, 0x40 | ((reg & 8) ? 4 : 0) | ((rm & 8) ? 1 : 0));
+}
+
+void modrmRegister(Assembler* as, int reg, Register rm) {
+    emit(as, 0xc0 | ((reg & 7) << 3) | (rm & 7));
+}
+
+//* Операнд [base + disp32]; для rsp и r12 нужен байт SIB
+void modrmMemory(Assembler* as, int reg, Register base, int32_t disp) {
+    emit(as, 0x80 | ((reg & 7) << 3) | (base & 7));
+    if ((base & 7) == RSP) emit(as, 0x24);
+    emit32(as, (uint32_t)disp);
+}
+
+void load(Assembler* as, Register dst, Register base, int32_t disp) {
+    rex(as, dst, base);
+    emit(as, 0x8b);
+    modrmMemory(as, dst, base, disp);
+}
+
+void store(Assembler* as, Register base, int32_t disp, Register src) {
+    rex(as, src, base);
+    emit(as, 0x89);
+    modrmMemory(as, src, base, disp);
+}
+
+void moveRegister(Assembler* as, Register dst, Register src) {
+    rex(as, src, dst);
+    emit(as, 0x89);
+    modrmRegister(as, src, dst);
+}
+
+void moveImmediate(Assembler* as, Register dst, uint64_t value) {
+    rex(as, 0, dst);
+    emit(as, 0xb8 + (dst & 7));
+    emit64(as, value);
+}
+
+void addImmediate(Assembler* as, Register reg, int32_t value) {
+    rex(as, 0, reg);
+    emit(as, 0x81);
+    modrmRegister(as, value < 0 ? 5 : 0, reg);
+    emit32(as, (uint32_t)(value < 0 ? -value : value));
+}
+
+//* Арифметика "op dst, src" с кодом операции вида 01 /r (add), 21 /r (and), 31 /r (xor), 39 /r (cmp)
+void aluRegister(Assembler* as, uint8_t opcode, Register dst, Register src) {
+    rex(as, src, dst);
+    emit(as, opcode);
+    modrmRegister(as, src, dst);
+}
+
+void push64(Assembler* as, Register reg) {
+    if (reg & 8) emit(as, 0x41);
+    emit(as, 0x50 + (reg & 7));
+}
+
+void pop64(Assembler* as, Register reg) {
+    if (reg & 8) emit(as, 0x41);
+    emit(as, 0x58 + (reg & 7));
+}
+
+void callHelper(Assembler* as, void* helper) {
+    moveImmediate(as, RAX, (uint64_t)(uintptr_t)helper);
+    emit(as, 0xff);
+    emit(as, 0xd0); // call rax
+}
+
+void testResult(Assembler* as) {
+    emit(as, 0x84);
+    emit(as, 0xc0); // test al, al
+}
+
+//* setcc al
+void setCondition(Assembler* as, Condition condition) {
+    emit(as, 0x0f);
+    emit(as, 0x90 | condition);
+    emit(as, 0xc0);
+}
+
+//* movsd xmm, [base + disp]
+void loadXmm(Assembler* as, XmmRegister dst, Register base, int32_t disp) {
+    emit(as, 0xf2);
+    rexOptional(as, dst, base);
+    emit(as, 0x0f);
+    emit(as, 0x10);
+    modrmMemory(as, dst, base, disp);
+}
+
+//* movsd [base + disp], xmm
+void storeXmm(Assembler* as, Register base, int32_t disp, XmmRegister src) {
+    emit(as, 0xf2);
+    rexOptional(as, src, base);
+    emit(as, 0x0f);
+    emit(as, 0x11);
+    modrmMemory(as, src, base, disp);
+}
+
+//* movq xmm, r64
+void moveToXmm(Assembler* as, XmmRegister dst, Register src) {
+    emit(as, 0x66);
+    rex(as, (Register)dst, src);
+    emit(as, 0x0f);
+    emit(as, 0x6e);
+    modrmRegister(as, dst, src);
+}
+
+//* movq r64, xmm
+void moveFromXmm(Assembler* as, Register dst, XmmRegister src) {
+    emit(as, 0x66);
+    rex(as, (Register)src, dst);
+    emit(as, 0x0f);
+    emit(as, 0x7e);
+    modrmRegister(as, src, dst);
+}
+
+void sseOp(Assembler* as, uint8_t prefix, uint8_t opcode, XmmRegister dst, XmmRegister src) {
+    emit(as, prefix);
+    emit(as, 0x0f);
+    emit(as, opcode);
+    modrmRegister(as, dst, (Register)src);
+}
+
+//* Переход с 32-битным смещением, которое пока не известно; возвращает позицию смещения
+int jumpForward(Assembler* as, int condition) {
+    if (condition == JUMP_ALWAYS) {
+        emit(as, 0xe9);
+    } else {
+        emit(as, 0x0f);
+        emit(as, 0x80 | condition);
+    }
+    emit32(as, 0);
+    return as->count - 4;
+}
+
+void patchHere(Assembler* as, int position) {
+    patch32(as, position, as->count - position - 4);
+}
+
+//* Переход к цели target, которая станет известна позже: вызывающий разрешит заплатку сам
+void jumpTo(Assembler* as, int condition, int target) {
+    int position = jumpForward(as, condition);
+    if (as->patchCapacity < as->patchCount + 1) {
+        int oldCapacity = as->patchCapacity;
+        as->patchCapacity = GROW_CAPACITY(oldCapacity);
+        as->patches = GROW_ARRAY(Patch, as->patches, oldCapacity, as->patchCapacity);
+    }
+    as->patches[as->patchCount].position = position;
+    as->patches[as->patchCount].target = target;
+    as->patchCount++;
+}
+
+//* Безусловный переход назад, на уже выданную метку
+void jumpBack(Assembler* as, int label) {
+    emit(as, 0xe9);
+    emit32(as, (uint32_t)(label - (as->count + 4)));
+}
+
+/*
+ * Копирует собранный код в отдельно отображённые страницы и делает их исполняемыми.
+ * Возвращает NULL, если память получить не удалось; в size — размер отображения для unmapCode.
+ */
+void* mapCode(Assembler* as, size_t* size) {
+    size_t pageSize = (size_t)sysconf(_SC_PAGESIZE);
+    *size = ((size_t)as->count + pageSize - 1) / pageSize * pageSize;
+    void* memory = mmap(NULL, *size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (memory == MAP_FAILED) return NULL;
+
+    memcpy(memory, as->code, as->count);
+    //* Код не бывает одновременно доступен на запись и на исполнение
+    mprotect(memory, *size, PROT_READ | PROT_EXEC);
+    return memory;
+}
+
+void unmapCode(void* code, size_t size) {
+    munmap(code, size);
+}
+
+#endif
@@ -0,0 +1,105 @@
+#ifndef clox_assembler_h
+#define clox_assembler_h
+
+#include "common.h"
+
+#ifdef JIT
+
+/*
+ * Кодировщик команд x86-64, общий для базового (jit.c) и трассирующего (trace.c) JIT.
+ * Код собирается в растущий буфер, а переходы вперёд запоминаются как заплатки
+ * с целью, смысл которой задаёт вызывающий (смещение в байт-коде, номер выхода и т. п.).
+ */
+
+typedef enum {
+    RAX, RCX, RDX, RBX, RSP, RBP, RSI, RDI,
+    R8, R9, R10, R11, R12, R13, R14, R15,
+} Register;
+
+//* Регистры SSE для чисел: хватает двух
+typedef enum {
+    XMM0, XMM1,
+} XmmRegister;
+
+typedef enum {
+    CC_B = 0x2,
+    CC_E = 0x4,
+    CC_NE = 0x5,
+    CC_BE = 0x6,
+    CC_A = 0x7,
+    CC_P = 0xa,
+    CC_NP = 0xb,
+} Condition;
+
+//* Безусловный переход для jumpForward и jumpTo
+#define JUMP_ALWAYS -1
+
+typedef struct {
+    int position; // Смещение 32-битного операнда перехода в машинном коде
+    int target; // Цель перехода; что она означает, решает вызывающий
+} Patch;
+
+typedef struct {
+    uint8_t* code;
+    int count;
+    int capacity;
+    Patch* patches;
+    int patchCount;
+    int patchCapacity;
+} Assembler;
+
+void initAssembler(Assembler* as);
+void freeAssembler(Assembler* as);
+
+void emit(Assembler* as, uint8_t byte);
+void emit32(Assembler* as, uint32_t value);
+void emit64(Assembler* as, uint64_t value);
+void patch32(Assembler* as, int position, int32_t value);
+
+void rex(Assembler* as, Register reg, Register rm);
+void modrmRegister(Assembler* as, int reg, Register rm);
+void modrmMemory(Assembler* as, int reg, Register base, int32_t disp);
+
+void load(Assembler* as, Register dst, Register base, int32_t disp);
+void store(Assembler* as, Register base, int32_t disp, Register src);
+void moveRegister(Assembler* as, Register dst, Register src);
+void moveImmediate(Assembler* as, Register dst, uint64_t value);
+void addImmediate(Assembler* as, Register reg, int32_t value);
+void aluRegister(Assembler* as, uint8_t opcode, Register dst, Register src);
+
+#define ADD_REGISTER 0x01
+#define AND_REGISTER 0x21
+#define XOR_REGISTER 0x31
+#define CMP_REGISTER 0x39
+
+void push64(Assembler* as, Register reg);
+void pop64(Assembler* as, Register reg);
+void callHelper(Assembler* as, void* helper);
+void testResult(Assembler* as);
+void setCondition(Assembler* as, Condition condition);
+
+void loadXmm(Assembler* as, XmmRegister dst, Register base, int32_t disp);
+void storeXmm(Assembler* as, Register base, int32_t disp, XmmRegister src);
+void moveToXmm(Assembler* as, XmmRegister dst, Register src);
+void moveFromXmm(Assembler* as, Register dst, XmmRegister src);
+void sseOp(Assembler* as, uint8_t prefix, uint8_t opcode, XmmRegister dst, XmmRegister src);
+
+//* Скалярные операции над double: prefix 0xf2 для addsd/subsd/mulsd/divsd/movsd, 0x66 для ucomisd/movapd
+#define SSE_ADD 0x58
+#define SSE_MULTIPLY 0x59
+#define SSE_SUBTRACT 0x5c
+#define SSE_DIVIDE 0x5e
+#define SSE_COMPARE 0x2e
+#define SSE_MOVE 0x28
+
+int jumpForward(Assembler* as, int condition);
+void patchHere(Assembler* as, int position);
+void jumpTo(Assembler* as, int condition, int target);
+void jumpBack(Assembler* as, int label);
+
+void* mapCode(Assembler* as, size_t* size);
+void unmapCode(void* code, size_t size);
+
+#endif
+
+#endif
@@ -1,6 +1,9 @@
 #include <stdlib.h>
+#include <string.h>
 #include "memory.h"
 #include "chunk.h"
+#include "object.h"
+#include "vm.h"
 
 void initChunk(Chunk* chunk) {
     chunk-> count = 0;
@@ -8,6 +11,7 @@ void initChunk(Chunk* chunk) {
     chunk->code = NULL;
     chunk->lines = NULL;
     initValueArray(&chunk->constants);
+    chunk->arena = NULL;
 }
 
 void freeChunk(Chunk* chunk) {
@@ -22,8 +26,13 @@ void writeChunk(Chunk* chunk, uint8_t byte, int line) {
     if (chunk->capacity < chunk-> count + 1) {
         int oldCapacity = chunk->capacity;
         chunk->capacity = GROW_CAPACITY(oldCapacity);
-        chunk->code = GROW_ARRAY(uint8_t, chunk->code, oldCapacity, chunk->capacity);
-        chunk->lines = GROW_ARRAY(int, chunk->lines, oldCapacity, chunk->capacity);
+        if (chunk->arena != NULL) {
+            chunk->code = ARENA_GROW_ARRAY(chunk->arena, uint8_t, chunk->code, oldCapacity, chunk->capacity);
+            chunk->lines = ARENA_GROW_ARRAY(chunk->arena, int, chunk->lines, oldCapacity, chunk->capacity);
+        } else {
+            chunk->code = GROW_ARRAY(uint8_t, chunk->code, oldCapacity, chunk->capacity);
+            chunk->lines = GROW_ARRAY(int, chunk->lines, oldCapacity, chunk->capacity);
+        }
     }
 
     chunk->code[chunk->count] = byte;
@@ -32,6 +41,118 @@ void writeChunk(Chunk* chunk, uint8_t byte, int line) {
 }
 
 int addConstant(Chunk* chunk, Value value) {
-    writeValueArray(&chunk->constants, value);
+    //* Пока массив констант растёт, значение держит стек: иначе сборщик мусора его не видит
+    push(value);
+    ValueArray* constants = &chunk->constants;
+    if (chunk->arena != NULL && constants->capacity < constants->count + 1) {
+        int oldCapacity = constants->capacity;
+        constants->values = ARENA_GROW_ARRAY(chunk->arena, Value, constants->values,
+                                             oldCapacity, GROW_CAPACITY(oldCapacity));
+        constants->capacity = GROW_CAPACITY(oldCapacity);
+    }
+    writeValueArray(constants, value);
+    pop();
     return chunk->constants.count - 1;
-}
\ No newline at end of file
+}
+
+//* Выделяет массив count элементов по size байт и копирует в него from
+static void* copyExact(const void* from, size_t size, int count) {
+    void* to = reallocate(NULL, 0, size * count);
+    if (count > 0) memcpy(to, from, size * count);
+    return to;
+}
+
+/*
+ * Функция скомпилирована: код, номера строк и константы переносятся из арены в буферы точного размера,
+ * без запаса ёмкости. Сборщик мусора, запущенный выделением, видит константы ещё в арене
+ */
+void finishChunk(Chunk* chunk) {
+    if (chunk->arena == NULL) return;
+    uint8_t* code = (uint8_t*)copyExact(chunk->code, sizeof(uint8_t), chunk->count);
+    int* lines = (int*)copyExact(chunk->lines, sizeof(int), chunk->count);
+    Value* constants = (Value*)copyExact(chunk->constants.values, sizeof(Value), chunk->constants.count);
+    chunk->code = code;
+    chunk->lines = lines;
+    chunk->capacity = chunk->count;
+    chunk->constants.values = constants;
+    chunk->constants.capacity = chunk->constants.count;
+    chunk->arena = NULL;
+}
+
+/*
+ * Возвращает длину в байтах инструкции, начинающейся со смещения offset (опкод вместе с операндами).
+ * У OP_CLOSURE длина переменная: за индексом константы идёт по паре байтов на каждый upvalue.
+ */
+int instructionLength(Chunk* chunk, int offset) {
+    return opcodeLength(chunk, offset, chunk->code[offset]);
+}
+
+/*
+ * То же для инструкции по смещению offset, прочитанной как opcode
+ * (например, суперинструкции, разобранной обратно на исходные инструкции через genericOpcode).
+ */
+int opcodeLength(Chunk* chunk, int offset, uint8_t opcode) {
+    switch (opcode) {
+        case OP_CONSTANT:
+        case OP_GET_LOCAL:
+        case OP_SET_LOCAL:
+        case OP_GET_UPVALUE:
+        case OP_SET_UPVALUE:
+        case OP_CALL:
+        case OP_TAIL_CALL:
+            return 2;
+        case OP_GET_GLOBAL:
+        case OP_DEFINE_GLOBAL:
+        case OP_SET_GLOBAL:
+        case OP_JUMP:
+        case OP_JUMP_IF_FALSE:
+        case OP_LOOP:
+            return 3;
+        case OP_SET_LOCAL_POP:
+            return 3;
+        case OP_GET_LOCAL_GET_LOCAL:
+        case OP_GET_LOCAL_CONSTANT:
+        case OP_SET_GLOBAL_POP:
+        case OP_ADD_SET_LOCAL_POP:
+        case OP_JUMP_IF_FALSE_POP:
+        case OP_POP_LOOP:
+            return 4;
+        case OP_LESS_JUMP_IF_FALSE_POP:
+            return 5;
+        case OP_CLOSURE: {
+            ObjFunction* function = AS_FUNCTION(chunk->constants.values[chunk->code[offset + 1]]);
+            return 2 + function->upvalueCount * 2;
+        }
+        default:
+            return 1;
+    }
+}
+
+/*
+ * Исходный опкод, который компилятор выдал на месте ускоренной инструкции или суперинструкции.
+ * Остальные байты суперинструкции лежат нетронутыми, так что после этого опкода
+ * код можно разбирать дальше как обычные инструкции.
+ */
+uint8_t genericOpcode(uint8_t instruction) {
+    switch (instruction) {
+        case OP_GREATER_NUMBER: return OP_GREATER;
+        case OP_LESS_NUMBER: return OP_LESS;
+        case OP_ADD_NUMBER:
+        case OP_ADD_STRING:
+            return OP_ADD;
+        case OP_SUBTRACT_NUMBER: return OP_SUBTRACT;
+        case OP_MULTIPLY_NUMBER: return OP_MULTIPLY;
+        case OP_DIVIDE_NUMBER: return OP_DIVIDE;
+        case OP_GET_LOCAL_GET_LOCAL:
+        case OP_GET_LOCAL_CONSTANT:
+            return OP_GET_LOCAL;
+        case OP_SET_LOCAL_POP: return OP_SET_LOCAL;
+        case OP_SET_GLOBAL_POP: return OP_SET_GLOBAL;
+        case OP_ADD_SET_LOCAL_POP: return OP_ADD;
+        case OP_LESS_JUMP_IF_FALSE_POP: return OP_LESS;
+        case OP_JUMP_IF_FALSE_POP: return OP_JUMP_IF_FALSE;
+        case OP_POP_LOOP: return OP_POP;
+        default:
+            return instruction;
+    }
+}
@@ -12,9 +12,9 @@ typedef enum {
     OP_POP, // Оператор выражения, извлекает верхнее значение и забывает о нём
     OP_GET_LOCAL, // Оператор выражения, извлекает значение локальной переменной из стека
     OP_SET_LOCAL,   // Оператор выражения, сохраняет значение локальной переменной в стеке
-    OP_GET_GLOBAL, // Оператор выражения, извлекает значение глобальной переменной из таблицы глобальных переменных
-    OP_DEFINE_GLOBAL, // Оператор выражения, сохраняет значение глобальной переменной в таблице глобальных переменных
-    OP_SET_GLOBAL,
+    OP_GET_GLOBAL, // Оператор выражения, извлекает значение глобальной переменной из её слота (16-битный индекс)
+    OP_DEFINE_GLOBAL, // Оператор выражения, сохраняет значение глобальной переменной в её слот (16-битный индекс)
+    OP_SET_GLOBAL, // Присваивает значение уже определённой глобальной переменной (16-битный индекс)
     OP_GET_UPVALUE,
     OP_SET_UPVALUE,
     OP_EQUAL,
@@ -31,22 +31,59 @@ typedef enum {
     OP_JUMP_IF_FALSE,
     OP_LOOP,
     OP_CALL,
+    OP_TAIL_CALL, // Вызов в хвостовой позиции (return f(...)): вызываемая функция занимает фрейм вызывающей
     OP_CLOSURE,
     OP_CLOSE_UPVALUE,
     OP_RETURN,
+    //* Специализированные ("ускоренные") варианты инструкций.
+    //* Компилятор их не выдаёт: обобщённая инструкция переписывает себя в байт-коде
+    //* при первом выполнении, а при несовпадении типов вариант откатывается обратно.
+    OP_GREATER_NUMBER,
+    OP_LESS_NUMBER,
+    OP_ADD_NUMBER,
+    OP_ADD_STRING,
+    OP_SUBTRACT_NUMBER,
+    OP_MULTIPLY_NUMBER,
+    OP_DIVIDE_NUMBER,
+    //* Суперинструкции: частые цепочки инструкций, слитые в одну (выбраны по профилю n-грамм, make profile).
+    //* Слияние делается на месте: опкод первой инструкции цепочки заменяется суперинструкцией,
+    //* остальные байты цепочки не трогаются, и суперинструкция читает операнды прямо из них.
+    //* Поэтому смещения переходов не меняются, а переход в середину цепочки выполняет исходные инструкции.
+    OP_GET_LOCAL_GET_LOCAL, // GET_LOCAL a; GET_LOCAL b
+    OP_GET_LOCAL_CONSTANT, // GET_LOCAL a; CONSTANT k
+    OP_SET_LOCAL_POP, // SET_LOCAL a; POP
+    OP_SET_GLOBAL_POP, // SET_GLOBAL a; POP
+    OP_ADD_SET_LOCAL_POP, // ADD; SET_LOCAL a; POP
+    OP_LESS_JUMP_IF_FALSE_POP, // LESS; JUMP_IF_FALSE; POP
+    OP_JUMP_IF_FALSE_POP, // JUMP_IF_FALSE; POP
+    OP_POP_LOOP, // POP; LOOP
 } OpCode;
 
+//* Первый байт каждой пары операндов OP_CLOSURE: откуда замыкание берёт upvalue
+typedef enum {
+    CAPTURE_UPVALUE, // upvalue объемлющего замыкания
+    CAPTURE_LOCAL,   // открытое upvalue, общее для всех, кто захватил слот фрейма
+    CAPTURE_VALUE,   // копия значения слота: переменную после объявления не присваивают (см. finishCaptures)
+} CaptureKind;
+
 typedef struct {
     int count;
     int capacity;
     uint8_t* code;
     int* lines;
     ValueArray constants;
+    //* Пока функция компилируется, code, lines и constants растут в арене компилятора,
+    //* а finishChunk переносит их в буферы точного размера
+    struct Arena* arena;
 } Chunk;
 
 void initChunk(Chunk* chunk);
 void freeChunk(Chunk* chunk);
 void writeChunk(Chunk* chunk, uint8_t byte, int line);
+void finishChunk(Chunk* chunk);
 int addConstant(Chunk* chunk, Value value);
+int instructionLength(Chunk* chunk, int offset);
+int opcodeLength(Chunk* chunk, int offset, uint8_t opcode);
+uint8_t genericOpcode(uint8_t instruction);
 
 #endif
\ No newline at end of file
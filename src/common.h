@@ -5,8 +5,69 @@
 #include <stddef.h>
 #include <stdint.h>
 
+// Отладочный вывод отключается в релизной сборке (make release)
+#ifndef NDEBUG
 #define DEBUG_PRINT_CODE
 #define DEBUG_TRACE_EXECUTION
+#endif
+
+// Шитый интерпретатор на computed goto (расширение GCC/Clang "labels as values").
+// На других компиляторах, или с -DNO_COMPUTED_GOTO, используется обычный switch.
+#if defined(__GNUC__) && !defined(NO_COMPUTED_GOTO)
+#define COMPUTED_GOTO
+#endif
+
+// Упаковка Value в 8 байт (NaN-boxing): числа хранятся как есть, а nil, bool и Obj*
+// кодируются внутри "тихого" NaN. Требует 64-битных указателей; отключается -DNO_NAN_BOXING.
+#if UINTPTR_MAX == UINT64_MAX && !defined(NO_NAN_BOXING)
+#define NAN_BOXING
+#endif
+
+// Слияние частых последовательностей опкодов в суперинструкции после компиляции функции.
+// В профилирующей сборке (-DPROFILE_OPCODES) отключено, чтобы профиль видел исходный байт-код.
+#if !defined(NO_SUPERINSTRUCTIONS) && !defined(PROFILE_OPCODES)
+#define SUPERINSTRUCTIONS
+#endif
+
+// Базовый JIT: часто вызываемые функции переводятся в машинный код x86-64 (см. jit.c).
+// Нужны System V ABI и NaN-boxing; в регистровой машине (--register) не используется. Отключается -DNO_JIT.
+#if defined(__x86_64__) && defined(__unix__) && defined(NAN_BOXING) && !defined(NO_JIT)
+#define JIT
+#endif
+
+// Параллельная пометка (clox --concurrent) в отдельном потоке POSIX. Нужен NaN-boxing:
+// поток пометки читает изменяемые поля объектов атомарно, одним словом. Отключается -DNO_CONCURRENT_GC.
+#if defined(__unix__) && defined(NAN_BOXING) && !defined(NO_CONCURRENT_GC)
+#define CONCURRENT_GC
+#endif
+
+// Мелкие блоки памяти VM выдаёт slab-аллокатор с классами размеров (см. reallocate в memory.c).
+// -DNO_SLAB_ALLOCATOR возвращает malloc на каждый блок — для поиска ошибок памяти (ASan, Valgrind).
+#if !defined(NO_SLAB_ALLOCATOR)
+#define SLAB_ALLOCATOR
+#endif
+
+// Ленивое интернирование: строки, полученные конкатенацией во время выполнения, не хэшируются
+// и не попадают в vm.strings, а сравниваются по символам (см. valuesEqual). Отключается -DNO_LAZY_INTERNING.
+#if !defined(NO_LAZY_INTERNING)
+#define LAZY_INTERNING
+#endif
+
+// Хэш строк читает ключ по 8 байт за шаг (см. hashString в object.c).
+// -DFNV_HASH возвращает побайтовый FNV-1a — например, чтобы сравнить качество хэша (clox --stats).
+#if !defined(FNV_HASH)
+#define WORD_HASH
+#endif
+
+// Заголовок объекта в 8 байт: тип и биты сборщика хранятся в старших битах указателя next (см. struct Obj).
+// Как и NaN-boxing, требует, чтобы адреса помещались в 48 бит. Отключается -DNO_COMPACT_HEADER.
+#if UINTPTR_MAX == UINT64_MAX && !defined(NO_COMPACT_HEADER)
+#define COMPACT_HEADER
+#endif
+
+// Отладка сборщика мусора: -DDEBUG_STRESS_GC запускает сборку (с --incremental — её шаг) при каждом выделении памяти,
+// -DDEBUG_LOG_GC печатает пометку и освобождение каждого объекта.
+
 #define UINT8_COUNT (UINT8_MAX + 1)
 
-#endif
\ No newline at end of file
+#endif
@@ -4,7 +4,10 @@
 
 #include "common.h"
 #include "compiler.h"
+#include "memory.h"
+#include "regchunk.h"
 #include "scanner.h"
+#include "vm.h"
 
 #ifdef DEBUG_PRINT_CODE
 #include "debug.h"
@@ -44,6 +47,8 @@ typedef struct {
     Token name;
     int depth; //* Записывает глубину области видимости блока, в котором была объявлена локальная переменная
     bool isCaptured; //* Для определения, захвачена ли данна локальная переменная замыканием
+    bool isAssigned; //* Переменной что-то присваивали после объявления (в том числе из замыканий)
+    int loopDepth; //* Сколько циклов окружало объявление
 } Local; //* Структура Local используется для хранения информации о локальной переменной
 
 //* Upvalue используется для хранения информации о внешней переменной
@@ -54,6 +59,13 @@ typedef struct {
     bool isLocal;
 } Upvalue;
 
+//* Байт вида захвата в OP_CLOSURE, который finishCaptures может переписать на CAPTURE_VALUE
+typedef struct {
+    int offset; //* Смещение байта в коде функции
+    uint8_t slot; //* Слот захваченной локальной переменной
+    int loopDepth; //* Сколько циклов окружало OP_CLOSURE
+} CaptureSite;
+
 typedef enum {
     TYPE_FUNCTION,
     TYPE_SCRIPT
@@ -83,6 +95,13 @@ typedef struct Compiler {
     //* как она будет удалена из стека.
     Upvalue upvalues[UINT8_COUNT];
     int scopeDepth; //* количество блоков, окружающих текущий фрагмент кода, который мы компилируем
+    int lastCall; //* смещение последней выданной инструкции OP_CALL (-1 — ещё не было): по нему return узнаёт хвостовой вызов
+    ArenaMark arenaMark; //* Арена до начала функции: endCompiler освобождает всё, что функция выделила в ней
+    //* Захваты локальных переменных, чья область видимости ещё не закончилась (массив в арене)
+    CaptureSite* captures;
+    int captureCount;
+    int captureCapacity;
+    int loopDepth; //* Сколько циклов окружает компилируемый код
 } Compiler;
 
 //* Compiler->locals связан со стеком
@@ -101,6 +120,8 @@ typedef struct Compiler {
 Parser parser;
 
 Compiler* current = NULL;
+//* Арена компилятора: в ней растут код, номера строк и константы компилируемых функций (см. finishChunk)
+static Arena arena;
 
 static Chunk* currentChunk() {
     //* Текущий фрагмент — это всегда фрагмент, принадлежащий функции, которую мы компилируем
@@ -176,6 +197,22 @@ static void emitBytes(uint8_t byte1, uint8_t byte2) {
     emitByte(byte2);
 }
 
+static void emitGlobalOp(uint8_t instruction, uint16_t slot) {
+    //* Индекс слота глобальной переменной записывается двумя байтами: старший, затем младший
+    emitByte(instruction);
+    emitByte((slot >> 8) & 0xff);
+    emitByte(slot & 0xff);
+}
+
+static void emitVariableOp(uint8_t instruction, int arg) {
+    //* У инструкций глобальных переменных операнд 16-битный, у локальных и upvalue — однобайтовый
+    if (instruction == OP_GET_GLOBAL || instruction == OP_SET_GLOBAL) {
+        emitGlobalOp(instruction, (uint16_t)arg);
+    } else {
+        emitBytes(instruction, (uint8_t)arg);
+    }
+}
+
 static void emitLoop(int loopStart) {
     emitByte(OP_LOOP);
 
@@ -218,7 +255,14 @@ static void initCompiler(Compiler* compiler, FunctionType type) {
     compiler->type = type;
     compiler->localCount = 0;
     compiler->scopeDepth = 0;
+    compiler->lastCall = -1;
+    compiler->captures = NULL;
+    compiler->captureCount = 0;
+    compiler->captureCapacity = 0;
+    compiler->loopDepth = 0;
     compiler->function = newFunction();
+    compiler->arenaMark = arenaMark(&arena);
+    compiler->function->chunk.arena = &arena;
     current = compiler;
     if (type != TYPE_SCRIPT) {
         current->function->name = copyString(parser.previous.start, parser.previous.length);
@@ -228,6 +272,8 @@ static void initCompiler(Compiler* compiler, FunctionType type) {
     Local* local = &current->locals[current->localCount++];
     local->depth = 0;
     local->isCaptured = false;
+    local->isAssigned = false;
+    local->loopDepth = 0;
     local->name.start = "";
     local->name.length = 0;
 }
@@ -252,12 +298,211 @@ static void patchJump(int offset) {
     currentChunk()->code[offset + 1] = jump & 0xff;
 }
 
+//* На сколько инструкция по смещению offset меняет глубину стека
+static int stackEffect(Chunk* chunk, int offset) {
+    switch (chunk->code[offset]) {
+        case OP_CONSTANT:
+        case OP_NIL:
+        case OP_TRUE:
+        case OP_FALSE:
+        case OP_GET_LOCAL:
+        case OP_GET_GLOBAL:
+        case OP_GET_UPVALUE:
+        case OP_CLOSURE:
+            return 1;
+        case OP_POP:
+        case OP_DEFINE_GLOBAL:
+        case OP_EQUAL:
+        case OP_GREATER:
+        case OP_LESS:
+        case OP_ADD:
+        case OP_SUBTRACT:
+        case OP_MULTIPLY:
+        case OP_DIVIDE:
+        case OP_PRINT:
+        case OP_CLOSE_UPVALUE:
+        case OP_RETURN:
+            return -1;
+        case OP_CALL:
+        case OP_TAIL_CALL:
+            return -chunk->code[offset + 1];
+        default:
+            return 0;
+    }
+}
+
+/*
+ * Наибольшая глубина стека значений во фрейме функции. call() резервирует под фрейм
+ * столько слотов сразу, поэтому push() внутри фрейма границу стека не проверяет.
+ * Компилятор выдаёт код так, что глубина в каждой точке одна и та же на всех путях,
+ * и её можно посчитать одним проходом: на цели перехода после безусловного перехода
+ * глубина берётся из уже встреченного перехода на неё.
+ */
+static int maxStackDepth(ObjFunction* function) {
+    Chunk* chunk = &function->chunk;
+    int* targetDepth = ARENA_ALLOCATE(&arena, int, chunk->count + 1);
+    for (int i = 0; i <= chunk->count; i++) targetDepth[i] = -1;
+
+    //* При входе в функцию в слоте 0 лежит само замыкание, за ним — параметры
+    int depth = function->arity + 1;
+    int maxDepth = depth;
+    bool reachable = true;
+    for (int offset = 0; offset < chunk->count; offset += instructionLength(chunk, offset)) {
+        if (!reachable && targetDepth[offset] != -1) {
+            depth = targetDepth[offset];
+            reachable = true;
+        }
+        depth += stackEffect(chunk, offset);
+        if (depth > maxDepth) maxDepth = depth;
+
+        uint8_t instruction = chunk->code[offset];
+        if (instruction == OP_JUMP || instruction == OP_JUMP_IF_FALSE) {
+            int target = offset + 3 + ((chunk->code[offset + 1] << 8) | chunk->code[offset + 2]);
+            if (targetDepth[target] == -1) targetDepth[target] = depth;
+        }
+        //* Код за безусловным переходом либо недостижим, либо (цель OP_LOOP ниже по коду)
+        //* начинается с той же глубины, так что счёт продолжается без изменений
+        if (instruction == OP_JUMP || instruction == OP_LOOP || instruction == OP_RETURN) reachable = false;
+    }
+
+    return maxDepth;
+}
+
+#ifdef SUPERINSTRUCTIONS
+/*
+ * Цепочка инструкций, которую можно слить в одну суперинструкцию.
+ * Набор выбран по профилю n-грамм (make profile) на замерах из bench/.
+ */
+typedef struct {
+    uint8_t fused;
+    int count;
+    uint8_t opcodes[3];
+} Superinstruction;
+
+//* Более длинные цепочки проверяются раньше
+static const Superinstruction superinstructions[] = {
+    {OP_LESS_JUMP_IF_FALSE_POP, 3, {OP_LESS, OP_JUMP_IF_FALSE, OP_POP}},
+    {OP_ADD_SET_LOCAL_POP, 3, {OP_ADD, OP_SET_LOCAL, OP_POP}},
+    {OP_GET_LOCAL_GET_LOCAL, 2, {OP_GET_LOCAL, OP_GET_LOCAL}},
+    {OP_GET_LOCAL_CONSTANT, 2, {OP_GET_LOCAL, OP_CONSTANT}},
+    {OP_SET_LOCAL_POP, 2, {OP_SET_LOCAL, OP_POP}},
+    {OP_SET_GLOBAL_POP, 2, {OP_SET_GLOBAL, OP_POP}},
+    {OP_JUMP_IF_FALSE_POP, 2, {OP_JUMP_IF_FALSE, OP_POP}},
+    {OP_POP_LOOP, 2, {OP_POP, OP_LOOP}},
+};
+
+//* Возвращает длину цепочки в байтах, если она начинается со смещения offset, иначе 0
+static int matchSuperinstruction(Chunk* chunk, int offset, const Superinstruction* super) {
+    int start = offset;
+    for (int i = 0; i < super->count; i++) {
+        if (offset >= chunk->count || chunk->code[offset] != super->opcodes[i]) return 0;
+        offset += instructionLength(chunk, offset);
+    }
+    return offset - start;
+}
+
+/*
+ * Проход по готовому байт-коду функции: сливает частые цепочки инструкций в суперинструкции.
+ * Заменяется только опкод первой инструкции цепочки, поэтому длина кода и все смещения переходов сохраняются.
+ */
+static void fuseSuperinstructions(Chunk* chunk) {
+    int offset = 0;
+    while (offset < chunk->count) {
+        int length = 0;
+        for (size_t i = 0; i < sizeof(superinstructions) / sizeof(superinstructions[0]); i++) {
+            length = matchSuperinstruction(chunk, offset, &superinstructions[i]);
+            if (length > 0) {
+                chunk->code[offset] = superinstructions[i].fused;
+                break;
+            }
+        }
+        offset += length > 0 ? length : instructionLength(chunk, offset);
+    }
+}
+#endif
+
+/*
+ * Функция дописывается, пока инкрементальная пометка уже могла сделать её чёрной,
+ * и записи компилятора барьер не проходят: такую функцию снова делаем серой
+ */
+static void markAgain(ObjFunction* function) {
+    if (vm.gcPhase != GC_MARKING) return;
+    setMarked((Obj*)function, false);
+    markObject((Obj*)function);
+}
+
+/*
+ * Запоминает байт вида захвата, который сейчас будет выдан для слота slot.
+ * Окончательный вид захвата станет известен, только когда переменная покинет область видимости
+ */
+static void addCaptureSite(uint8_t slot) {
+    if (current->captureCount == current->captureCapacity) {
+        int oldCapacity = current->captureCapacity;
+        current->captureCapacity = GROW_CAPACITY(oldCapacity);
+        current->captures = ARENA_GROW_ARRAY(&arena, CaptureSite, current->captures,
+                                             oldCapacity, current->captureCapacity);
+    }
+    current->captures[current->captureCount].offset = currentChunk()->count;
+    current->captures[current->captureCount].slot = slot;
+    current->captures[current->captureCount].loopDepth = current->loopDepth;
+    current->captureCount++;
+}
+
+/*
+ * Захваченная переменная slot покидает область видимости, и все замыкания, захватившие её, уже выданы.
+ * Если после объявления её ни разу не присваивали, замыкание не может увидеть другого значения,
+ * и захват переписывается на CAPTURE_VALUE: upvalue сразу закрыто и не попадает в список открытых.
+ * Копия выделяется на каждое выполнение OP_CLOSURE, а общее upvalue — одно на переменную,
+ * поэтому копируем, только когда OP_CLOSURE один и выполняется не чаще объявления (не во вложенном цикле).
+ * Возвращает true, если захват стал копией и закрывать upvalue не нужно
+ */
+static bool finishCaptures(int slot) {
+    Local* local = &current->locals[slot];
+    int sites = 0;
+    int count = 0;
+    CaptureSite* only = NULL;
+    for (int i = 0; i < current->captureCount; i++) {
+        if (current->captures[i].slot == slot) {
+            sites++;
+            only = &current->captures[i];
+        }
+    }
+    bool byValue = !local->isAssigned && sites == 1 && only->loopDepth == local->loopDepth;
+    if (byValue) currentChunk()->code[only->offset] = CAPTURE_VALUE;
+    for (int i = 0; i < current->captureCount; i++) {
+        if (current->captures[i].slot != slot) current->captures[count++] = current->captures[i];
+    }
+    current->captureCount = count;
+    return byValue;
+}
+
 static ObjFunction* endCompiler() {
     emitReturn();
+    //* Параметры и локальные переменные тела функции живут до её конца
+    for (int slot = current->localCount - 1; slot > 0; slot--) {
+        if (current->locals[slot].isCaptured) finishCaptures(slot);
+    }
     ObjFunction* function = current->function;
+    markAgain(function);
+    function->stackSlots = maxStackDepth(function);
+    //* Регистровый бэкенд переводит стековый код до слияния суперинструкций
+    function->registerChunk.arena = &arena;
+    if (!parser.hadError && vm.registerMode && !compileRegisters(function)) {
+        error("Function too large for the register backend.");
+    }
+    #ifdef SUPERINSTRUCTIONS
+        if (!parser.hadError) fuseSuperinstructions(currentChunk());
+    #endif
+    finishChunk(&function->chunk);
+    finishChunk(&function->registerChunk);
+    //* Вложенные функции компилируются целиком внутри объемлющей, так что арена освобождается как стек
+    arenaRelease(&arena, current->arenaMark);
     #ifdef DEBUG_PRINT_CODE
         if (!parser.hadError) {
             disassembleChunk(currentChunk(), function->name != NULL ? function->name->chars : "<script>");
+            if (vm.registerMode) {
+                disassembleRegisterChunk(function, function->name != NULL ? function->name->chars : "<script>");
+            }
         }
     #endif
     current = current->enclosing;
@@ -277,7 +522,8 @@ static void endScope() {
     //* объявленных на той глубине области видимости, которую мы только что покинули. 
     //* Мы удаляем их, просто уменьшая длину массива.
     while (current->localCount > 0 && current->locals[current->localCount - 1].depth > current->scopeDepth) {
-        if (current->locals[current->localCount - 1].isCaptured) {
+        Local* local = &current->locals[current->localCount - 1];
+        if (local->isCaptured && !finishCaptures(current->localCount - 1)) {
             emitByte(OP_CLOSE_UPVALUE);
         } else {
             emitByte(OP_POP);
@@ -288,7 +534,7 @@ static void endScope() {
 
 static void expression();
 static void statement();
-static uint8_t identifierConstant(Token* name);
+static uint16_t globalVariable(Token* name);
 static void declaration();
 static ParseRule* getRule(TokenType type);
 static void parsePrecedence(Precedence precedence);
@@ -320,6 +566,7 @@ static void binary(bool canAssign) {
 
 static void call(bool canAssign) {
     uint8_t argCount = argumentList();
+    current->lastCall = currentChunk()->count;
     emitBytes(OP_CALL, argCount);
 }
 
@@ -360,6 +607,16 @@ static void string(bool canAssign) {
     emitConstant(OBJ_VAL((Obj*)copyString(parser.previous.start + 1, parser.previous.length - 2)));
 }
 
+//* Присваивание через upvalue: помечаем переменную той функции, где она объявлена
+static void markAssignedUpvalue(Compiler* compiler, int index) {
+    Upvalue* upvalue = &compiler->upvalues[index];
+    if (upvalue->isLocal) {
+        compiler->enclosing->locals[upvalue->index].isAssigned = true;
+    } else {
+        markAssignedUpvalue(compiler->enclosing, upvalue->index);
+    }
+}
+
 /*
  * Generates code to access a named variable. If canAssign is true and the
  * next token is an =, then generates code to assign to the variable.
@@ -382,15 +639,21 @@ static void namedVariable(Token name, bool canAssign) {
         getOp = OP_GET_UPVALUE;
         setOp = OP_SET_UPVALUE;
     } else {
-        arg = identifierConstant(&name);
+        //* Глобальная переменная адресуется индексом слота, а не именем из таблицы констант
+        arg = globalVariable(&name);
         getOp = OP_GET_GLOBAL;
         setOp = OP_SET_GLOBAL;
     }
     if (canAssign && match(TOKEN_EQUAL)) {
+        if (setOp == OP_SET_LOCAL) {
+            current->locals[arg].isAssigned = true;
+        } else if (setOp == OP_SET_UPVALUE) {
+            markAssignedUpvalue(current, arg);
+        }
         expression();
-        emitBytes(setOp, (uint8_t)arg);
+        emitVariableOp(setOp, arg);
     } else {
-        emitBytes(getOp, (uint8_t)arg);
+        emitVariableOp(getOp, arg);
     }
 }
 
@@ -481,9 +744,14 @@ static void parsePrecedence(Precedence precedence) {
     }
 }
 
-static uint8_t identifierConstant(Token* name) {
-    //* Принимает заданный токен и добавляет его лексему в таблицу констант и возвращает индекс
-    return makeConstant(OBJ_VAL((Obj*)copyString(name->start, name->length)));
+static uint16_t globalVariable(Token* name) {
+    //* Разрешает имя глобальной переменной в индекс её слота в vm.globalValues
+    int slot = globalSlot(copyString(name->start, name->length));
+    if (slot > UINT16_MAX) {
+        error("Too many global variables.");
+        return 0;
+    }
+    return (uint16_t)slot;
 }
 
 static bool identifiersEqual(Token* a, Token* b) {
@@ -578,6 +846,9 @@ static void addLocal(Token name) {
     //* Это позволяет компилятору определить, что переменная еще не инициализирована, 
     //* и выдать ошибку, если она будет использована до инициализации.
     local->depth = -1; 
+    local->isCaptured = false;
+    local->isAssigned = false;
+    local->loopDepth = current->loopDepth;
 }
 
 static void declareVariable() {
@@ -604,14 +875,14 @@ static void declareVariable() {
     addLocal(*name);
 }
 
-static uint8_t parseVariable(const char* errorMessage) {
+static uint16_t parseVariable(const char* errorMessage) {
     consume(TOKEN_IDENTIFIER, errorMessage);
     declareVariable();
     //* выходим из функции, если находимся в локальной области видимости
     //* Во время выполнения программы локальные переменные не ищутся по имени
-    //* если объявление находится в локальной области видимости, мы возвращаем фиктивный индекс таблицы.
+    //* если объявление находится в локальной области видимости, мы возвращаем фиктивный индекс слота.
     if (current->scopeDepth > 0) return 0;
-    return identifierConstant(&parser.previous);
+    return globalVariable(&parser.previous);
 }
 
 static void markInitialized() {
@@ -621,13 +892,13 @@ static void markInitialized() {
     current->locals[current->localCount - 1].depth = current->scopeDepth;
 }
 
-static void defineVariable(uint8_t global) {
+static void defineVariable(uint16_t global) {
     //* Выводит инструкцию байт-кода, которая определяет новую переменную и сохраняет её начальное значение
     if (current->scopeDepth > 0) {
         markInitialized();
         return;
     }
-    emitBytes(OP_DEFINE_GLOBAL, global);
+    emitGlobalOp(OP_DEFINE_GLOBAL, global);
 }
 
 static uint8_t argumentList() {
@@ -685,7 +956,7 @@ static void function(FunctionType type) {
             if (current->function->arity > 255) {
                 errorAtCurrent("Can't have more than 255 parameters.");
             }
-            uint8_t constant = parseVariable("Expect parameter name.");
+            uint16_t constant = parseVariable("Expect parameter name.");
             defineVariable(constant);
         } while (match(TOKEN_COMMA));
     }
@@ -697,13 +968,18 @@ static void function(FunctionType type) {
     ObjFunction* function = endCompiler();
     emitBytes(OP_CLOSURE, makeConstant(OBJ_VAL((Obj*)function))); 
     for (int i = 0; i < function->upvalueCount; i++) {
-        emitByte(compiler.upvalues[i].isLocal ? 1 : 0);
+        if (compiler.upvalues[i].isLocal) {
+            addCaptureSite(compiler.upvalues[i].index);
+            emitByte(CAPTURE_LOCAL);
+        } else {
+            emitByte(CAPTURE_UPVALUE);
+        }
         emitByte(compiler.upvalues[i].index);
     }
 }
 
 static void funDeclaration() {
-    uint8_t global = parseVariable("Expect function name."); // Индекс в таблице констант
+    uint16_t global = parseVariable("Expect function name."); // Индекс слота глобальной переменной
     markInitialized();
     function(TYPE_FUNCTION);
     defineVariable(global);
@@ -711,7 +987,7 @@ static void funDeclaration() {
 
 static void varDeclaration() {
     //* Объявление переменных   
-    uint8_t global = parseVariable("Ecpect variable name."); // Индекс в таблице констант
+    uint16_t global = parseVariable("Ecpect variable name."); // Индекс слота глобальной переменной
 
     if (match(TOKEN_EQUAL)) {
         expression();
@@ -749,6 +1025,7 @@ static void forStatement() {
 
     // Запомнить начало цикла
     int loopStart = currentChunk()->count;
+    current->loopDepth++;
     int exitJump = -1; // Метка выхода из цикла
     
     // Обработка условия цикла
@@ -785,6 +1062,7 @@ static void forStatement() {
 
     //* Перейти к приращению
     emitLoop(loopStart);
+    current->loopDepth--;
 
     // Если есть условие, то выйти из цикла
     if (exitJump != -1) {
@@ -832,12 +1110,22 @@ static void returnStatement() {
     } else {
         expression();
         consume(TOKEN_SEMICOLON, "Expect ';' after value.");
+        /*
+        * Если выражение закончилось вызовом, это хвостовой вызов: его результат сразу возвращается,
+        * и вызываемая функция может занять фрейм текущей. OP_RETURN всё равно выдаётся:
+        * на него ведут переходы из выражений вроде "return a and f();", минующие вызов,
+        * а после вызова нативной функции он возвращает её результат.
+        */
+        if (current->lastCall == currentChunk()->count - 2) {
+            currentChunk()->code[current->lastCall] = OP_TAIL_CALL;
+        }
         emitByte(OP_RETURN);
     }
 }
 
 static void whileStatement() {
     int loopStart = currentChunk()->count;
+    current->loopDepth++;
     consume(TOKEN_LEFT_PAREN, "Expect '(' after 'while'.");
     expression();
     consume(TOKEN_RIGHT_PAREN, "Expect ')' after condition.");
@@ -847,6 +1135,7 @@ static void whileStatement() {
     statement();
 
     emitLoop(loopStart); //* 
+    current->loopDepth--;
 
     patchJump(exitJump);
     emitByte(OP_POP);
@@ -911,6 +1200,11 @@ static void statement() {
 }
 
 ObjFunction* compile(const char* source) {
+    //* Функции и их константы живут долго, а трассы вшивают их адреса в машинный код:
+    //* всё, что выделяет компилятор, сразу попадает в старую кучу
+    //* Компилятор перевыделяет массивы констант, а их читает поток параллельной пометки
+    finishConcurrentMarking();
+    vm.pretenure = true;
     initScanner(source);
     Compiler compiler;
     initCompiler(&compiler, TYPE_SCRIPT);
@@ -921,5 +1215,18 @@ ObjFunction* compile(const char* source) {
         declaration();
     }
     ObjFunction* function = endCompiler();
+    //* Блоки арены не переживают компиляцию
+    freeArena(&arena);
+    vm.pretenure = false;
     return parser.hadError ? NULL : function;
-}
\ No newline at end of file
+}
+
+//* Функции, которые сейчас компилируются, ещё ниоткуда не достижимы: сборщик мусора берёт их отсюда
+void markCompilerRoots() {
+    Compiler* compiler = current;
+    while (compiler != NULL) {
+        markAgain(compiler->function);
+        markObject((Obj*)compiler->function);
+        compiler = compiler->enclosing;
+    }
+}
@@ -2,7 +2,67 @@
 
 #include "debug.h"
 #include "object.h"
+#include "regchunk.h"
 #include "value.h"
+#include "vm.h"
+
+static const char* opcodeNames[UINT8_COUNT] = {
+    [OP_CONSTANT] = "OP_CONSTANT",
+    [OP_NIL] = "OP_NIL",
+    [OP_TRUE] = "OP_TRUE",
+    [OP_FALSE] = "OP_FALSE",
+    [OP_POP] = "OP_POP",
+    [OP_GET_LOCAL] = "OP_GET_LOCAL",
+    [OP_SET_LOCAL] = "OP_SET_LOCAL",
+    [OP_GET_GLOBAL] = "OP_GET_GLOBAL",
+    [OP_DEFINE_GLOBAL] = "OP_DEFINE_GLOBAL",
+    [OP_SET_GLOBAL] = "OP_SET_GLOBAL",
+    [OP_GET_UPVALUE] = "OP_GET_UPVALUE",
+    [OP_SET_UPVALUE] = "OP_SET_UPVALUE",
+    [OP_EQUAL] = "OP_EQUAL",
+    [OP_GREATER] = "OP_GREATER",
+    [OP_LESS] = "OP_LESS",
+    [OP_ADD] = "OP_ADD",
+    [OP_SUBTRACT] = "OP_SUBTRACT",
+    [OP_MULTIPLY] = "OP_MULTIPLY",
+    [OP_DIVIDE] = "OP_DIVIDE",
+    [OP_NOT] = "OP_NOT",
+    [OP_NEGATE] = "OP_NEGATE",
+    [OP_PRINT] = "OP_PRINT",
+    [OP_JUMP] = "OP_JUMP",
+    [OP_JUMP_IF_FALSE] = "OP_JUMP_IF_FALSE",
+    [OP_LOOP] = "OP_LOOP",
+    [OP_CALL] = "OP_CALL",
+    [OP_TAIL_CALL] = "OP_TAIL_CALL",
+    [OP_CLOSURE] = "OP_CLOSURE",
+    [OP_CLOSE_UPVALUE] = "OP_CLOSE_UPVALUE",
+    [OP_RETURN] = "OP_RETURN",
+    [OP_GREATER_NUMBER] = "OP_GREATER_NUMBER",
+    [OP_LESS_NUMBER] = "OP_LESS_NUMBER",
+    [OP_ADD_NUMBER] = "OP_ADD_NUMBER",
+    [OP_ADD_STRING] = "OP_ADD_STRING",
+    [OP_SUBTRACT_NUMBER] = "OP_SUBTRACT_NUMBER",
+    [OP_MULTIPLY_NUMBER] = "OP_MULTIPLY_NUMBER",
+    [OP_DIVIDE_NUMBER] = "OP_DIVIDE_NUMBER",
+    [OP_GET_LOCAL_GET_LOCAL] = "OP_GET_LOCAL_GET_LOCAL",
+    [OP_GET_LOCAL_CONSTANT] = "OP_GET_LOCAL_CONSTANT",
+    [OP_SET_LOCAL_POP] = "OP_SET_LOCAL_POP",
+    [OP_SET_GLOBAL_POP] = "OP_SET_GLOBAL_POP",
+    [OP_ADD_SET_LOCAL_POP] = "OP_ADD_SET_LOCAL_POP",
+    [OP_LESS_JUMP_IF_FALSE_POP] = "OP_LESS_JUMP_IF_FALSE_POP",
+    [OP_JUMP_IF_FALSE_POP] = "OP_JUMP_IF_FALSE_POP",
+    [OP_POP_LOOP] = "OP_POP_LOOP",
+};
+
+static const char* captureNames[] = {
+    [CAPTURE_UPVALUE] = "upvalue",
+    [CAPTURE_LOCAL] = "local",
+    [CAPTURE_VALUE] = "value",
+};
+
+const char* opcodeName(uint8_t instruction) {
+    return opcodeNames[instruction] != NULL ? opcodeNames[instruction] : "OP_UNKNOWN";
+}
 
 void disassembleChunk(Chunk* chunk, const char* name) {
     printf("== %s ==\n", name);
@@ -20,6 +80,15 @@ static int constantInstruction(const char* name, Chunk* chunk, int offset) {
     return offset + 2;
 }
 
+static int globalInstruction(const char* name, Chunk* chunk, int offset) {
+    uint16_t slot = (uint16_t)(chunk->code[offset + 1] << 8);
+    slot |= chunk->code[offset + 2];
+    printf("%-16s %4d '", name, slot);
+    printValue(vm.globalNames.values[slot]);
+    printf("'\n");
+    return offset + 3;
+}
+
 static int simpleInstruction(const char* name, int offset) {
     printf("%s\n", name);
     return offset + 1;
@@ -61,15 +130,15 @@ int disassembleInstruction(Chunk* chunk, int offset) {
         case OP_POP:
             return simpleInstruction("OP_POP", offset);
         case OP_GET_GLOBAL:
-            return constantInstruction("OP_GET_GLOBAL", chunk, offset);
+            return globalInstruction("OP_GET_GLOBAL", chunk, offset);
         case OP_DEFINE_GLOBAL:
-            return constantInstruction("OP_DEFINE_GLOBAL", chunk, offset);
+            return globalInstruction("OP_DEFINE_GLOBAL", chunk, offset);
         case OP_GET_LOCAL:
             return byteInstruction("OP_GET_LOCAL", chunk, offset);
         case OP_SET_LOCAL:
             return byteInstruction("OP_SET_LOCAL", chunk, offset);
         case OP_SET_GLOBAL:
-            return constantInstruction("OP_SET_GLOBAL", chunk, offset);
+            return globalInstruction("OP_SET_GLOBAL", chunk, offset);
         case OP_GET_UPVALUE:
             return byteInstruction("OP_GET_UPVALUE", chunk, offset);
         case OP_SET_UPVALUE:
@@ -84,6 +153,20 @@ int disassembleInstruction(Chunk* chunk, int offset) {
             return simpleInstruction("OP_ADD", offset);
         case OP_SUBTRACT:
             return simpleInstruction("OP_SUBTRACT", offset);
+        case OP_GREATER_NUMBER:
+            return simpleInstruction("OP_GREATER_NUMBER", offset);
+        case OP_LESS_NUMBER:
+            return simpleInstruction("OP_LESS_NUMBER", offset);
+        case OP_ADD_NUMBER:
+            return simpleInstruction("OP_ADD_NUMBER", offset);
+        case OP_ADD_STRING:
+            return simpleInstruction("OP_ADD_STRING", offset);
+        case OP_SUBTRACT_NUMBER:
+            return simpleInstruction("OP_SUBTRACT_NUMBER", offset);
+        case OP_MULTIPLY_NUMBER:
+            return simpleInstruction("OP_MULTIPLY_NUMBER", offset);
+        case OP_DIVIDE_NUMBER:
+            return simpleInstruction("OP_DIVIDE_NUMBER", offset);
         case OP_MULTIPLY:
             return simpleInstruction("OP_MULTIPLY", offset);
         case OP_DIVIDE:
@@ -106,6 +189,35 @@ int disassembleInstruction(Chunk* chunk, int offset) {
             return simpleInstruction("OP_RETURN", offset);
         case OP_CALL:
             return byteInstruction("OP_CALL", chunk, offset);
+        case OP_TAIL_CALL:
+            return byteInstruction("OP_TAIL_CALL", chunk, offset);
+        case OP_GET_LOCAL_GET_LOCAL:
+            printf("%-16s %4d %4d\n", "OP_GET_LOCAL_GET_LOCAL", chunk->code[offset + 1], chunk->code[offset + 3]);
+            return offset + 4;
+        case OP_GET_LOCAL_CONSTANT: {
+            uint8_t constant = chunk->code[offset + 3];
+            printf("%-16s %4d %4d '", "OP_GET_LOCAL_CONSTANT", chunk->code[offset + 1], constant);
+            printValue(chunk->constants.values[constant]);
+            printf("'\n");
+            return offset + 4;
+        }
+        case OP_SET_LOCAL_POP:
+            printf("%-16s %4d\n", "OP_SET_LOCAL_POP", chunk->code[offset + 1]);
+            return offset + 3;
+        case OP_SET_GLOBAL_POP:
+            return globalInstruction("OP_SET_GLOBAL_POP", chunk, offset) + 1;
+        case OP_ADD_SET_LOCAL_POP:
+            printf("%-16s %4d\n", "OP_ADD_SET_LOCAL_POP", chunk->code[offset + 2]);
+            return offset + 4;
+        case OP_LESS_JUMP_IF_FALSE_POP:
+            jumpInstruction("OP_LESS_JUMP_IF_FALSE_POP", 1, chunk, offset + 1);
+            return offset + 5;
+        case OP_JUMP_IF_FALSE_POP:
+            jumpInstruction("OP_JUMP_IF_FALSE_POP", 1, chunk, offset);
+            return offset + 4;
+        case OP_POP_LOOP:
+            jumpInstruction("OP_POP_LOOP", -1, chunk, offset + 1);
+            return offset + 4;
         case OP_CLOSURE: {
             offset++;
             uint8_t constant = chunk->code[offset++];
@@ -114,9 +226,9 @@ int disassembleInstruction(Chunk* chunk, int offset) {
             printf("\n");
             ObjFunction* function = AS_FUNCTION(chunk->constants.values[constant]);
             for (int j = 0; j < function->upvalueCount; j++) {
-                int isLocal = chunk->code[offset++];
+                int capture = chunk->code[offset++];
                 int index = chunk->code[offset++];
-                printf("%04d    | %s %d\n", offset - 2, isLocal ? "local" : "upvalue", index);
+                printf("%04d    | %s %d\n", offset - 2, captureNames[capture], index);
             }
             return offset;
         }
@@ -124,4 +236,137 @@ int disassembleInstruction(Chunk* chunk, int offset) {
             printf("Unknown opcode %d\n", instruction);
             return offset + 1;
     }
-}
\ No newline at end of file
+}
+//* Дизассемблер регистрового кода (clox --register). Константы лежат в пуле стекового чанка функции
+
+void disassembleRegisterChunk(ObjFunction* function, const char* name) {
+    printf("== %s (registers: %d) ==\n", name, function->registerCount);
+
+    for (int offset = 0; offset < function->registerChunk.count;) {
+        offset = disassembleRegisterInstruction(function, offset);
+    }
+}
+
+static void printConstant(ObjFunction* function, uint8_t constant) {
+    printf("'");
+    printValue(function->chunk.constants.values[constant]);
+    printf("'");
+}
+
+//* Инструкции вида "R[A] = R[B] op R[C]" и "R[A] = R[B] op K[k]"
+static int registerInstruction(const char* name, ObjFunction* function, int offset, int registers, bool constant) {
+    uint8_t* code = &function->registerChunk.code[offset];
+    printf("%-32s", name);
+    for (int i = 1; i <= registers; i++) printf(" r%d", code[i]);
+    if (constant) {
+        printf(" ");
+        printConstant(function, code[registers + 1]);
+    }
+    printf("\n");
+    return offset + 1 + registers + (constant ? 1 : 0);
+}
+
+static int registerGlobalInstruction(const char* name, ObjFunction* function, int offset) {
+    uint8_t* code = &function->registerChunk.code[offset];
+    uint16_t slot = (uint16_t)((code[2] << 8) | code[3]);
+    printf("%-32s r%d g%d '", name, code[1], slot);
+    printValue(vm.globalNames.values[slot]);
+    printf("'\n");
+    return offset + 4;
+}
+
+//* Условный и безусловный переходы: operands байтов операндов перед 16-битным смещением
+static int registerJumpInstruction(const char* name, int sign, ObjFunction* function, int offset, int registers, bool constant) {
+    uint8_t* code = &function->registerChunk.code[offset];
+    int operands = registers + (constant ? 1 : 0);
+    uint16_t jump = (uint16_t)((code[operands + 1] << 8) | code[operands + 2]);
+    int next = offset + operands + 3;
+    printf("%-32s", name);
+    for (int i = 1; i <= registers; i++) printf(" r%d", code[i]);
+    if (constant) {
+        printf(" ");
+        printConstant(function, code[operands]);
+    }
+    printf(" -> %d\n", next + sign * jump);
+    return next;
+}
+
+int disassembleRegisterInstruction(ObjFunction* function, int offset) {
+    Chunk* chunk = &function->registerChunk;
+    printf("%04d ", offset);
+    if (offset > 0 && chunk->lines[offset] == chunk->lines[offset - 1]) {
+        printf("   | ");
+    } else {
+        printf("%4d ", chunk->lines[offset]);
+    }
+
+    uint8_t instruction = chunk->code[offset];
+    switch (instruction) {
+        case ROP_MOVE: return registerInstruction("ROP_MOVE", function, offset, 2, false);
+        case ROP_LOAD_CONSTANT: return registerInstruction("ROP_LOAD_CONSTANT", function, offset, 1, true);
+        case ROP_LOAD_NIL: return registerInstruction("ROP_LOAD_NIL", function, offset, 1, false);
+        case ROP_LOAD_TRUE: return registerInstruction("ROP_LOAD_TRUE", function, offset, 1, false);
+        case ROP_LOAD_FALSE: return registerInstruction("ROP_LOAD_FALSE", function, offset, 1, false);
+        case ROP_GET_GLOBAL: return registerGlobalInstruction("ROP_GET_GLOBAL", function, offset);
+        case ROP_DEFINE_GLOBAL: return registerGlobalInstruction("ROP_DEFINE_GLOBAL", function, offset);
+        case ROP_SET_GLOBAL: return registerGlobalInstruction("ROP_SET_GLOBAL", function, offset);
+        case ROP_GET_UPVALUE:
+            printf("%-32s r%d u%d\n", "ROP_GET_UPVALUE", chunk->code[offset + 1], chunk->code[offset + 2]);
+            return offset + 3;
+        case ROP_SET_UPVALUE:
+            printf("%-32s r%d u%d\n", "ROP_SET_UPVALUE", chunk->code[offset + 1], chunk->code[offset + 2]);
+            return offset + 3;
+        case ROP_EQUAL: return registerInstruction("ROP_EQUAL", function, offset, 3, false);
+        case ROP_GREATER: return registerInstruction("ROP_GREATER", function, offset, 3, false);
+        case ROP_LESS: return registerInstruction("ROP_LESS", function, offset, 3, false);
+        case ROP_ADD: return registerInstruction("ROP_ADD", function, offset, 3, false);
+        case ROP_SUBTRACT: return registerInstruction("ROP_SUBTRACT", function, offset, 3, false);
+        case ROP_MULTIPLY: return registerInstruction("ROP_MULTIPLY", function, offset, 3, false);
+        case ROP_DIVIDE: return registerInstruction("ROP_DIVIDE", function, offset, 3, false);
+        case ROP_EQUAL_CONSTANT: return registerInstruction("ROP_EQUAL_CONSTANT", function, offset, 2, true);
+        case ROP_GREATER_CONSTANT: return registerInstruction("ROP_GREATER_CONSTANT", function, offset, 2, true);
+        case ROP_LESS_CONSTANT: return registerInstruction("ROP_LESS_CONSTANT", function, offset, 2, true);
+        case ROP_ADD_CONSTANT: return registerInstruction("ROP_ADD_CONSTANT", function, offset, 2, true);
+        case ROP_SUBTRACT_CONSTANT: return registerInstruction("ROP_SUBTRACT_CONSTANT", function, offset, 2, true);
+        case ROP_MULTIPLY_CONSTANT: return registerInstruction("ROP_MULTIPLY_CONSTANT", function, offset, 2, true);
+        case ROP_DIVIDE_CONSTANT: return registerInstruction("ROP_DIVIDE_CONSTANT", function, offset, 2, true);
+        case ROP_NOT: return registerInstruction("ROP_NOT", function, offset, 2, false);
+        case ROP_NEGATE: return registerInstruction("ROP_NEGATE", function, offset, 2, false);
+        case ROP_PRINT: return registerInstruction("ROP_PRINT", function, offset, 1, false);
+        case ROP_JUMP: return registerJumpInstruction("ROP_JUMP", 1, function, offset, 0, false);
+        case ROP_JUMP_IF_FALSE: return registerJumpInstruction("ROP_JUMP_IF_FALSE", 1, function, offset, 1, false);
+        case ROP_JUMP_IF_NOT_LESS:
+            return registerJumpInstruction("ROP_JUMP_IF_NOT_LESS", 1, function, offset, 2, false);
+        case ROP_JUMP_IF_NOT_LESS_CONSTANT:
+            return registerJumpInstruction("ROP_JUMP_IF_NOT_LESS_CONSTANT", 1, function, offset, 1, true);
+        case ROP_JUMP_IF_NOT_GREATER:
+            return registerJumpInstruction("ROP_JUMP_IF_NOT_GREATER", 1, function, offset, 2, false);
+        case ROP_JUMP_IF_NOT_GREATER_CONSTANT:
+            return registerJumpInstruction("ROP_JUMP_IF_NOT_GREATER_CONSTANT", 1, function, offset, 1, true);
+        case ROP_LOOP: return registerJumpInstruction("ROP_LOOP", -1, function, offset, 0, false);
+        case ROP_CALL:
+        case ROP_TAIL_CALL:
+            printf("%-32s r%d (%d args)\n", chunk->code[offset] == ROP_CALL ? "ROP_CALL" : "ROP_TAIL_CALL",
+                   chunk->code[offset + 1], chunk->code[offset + 2]);
+            return offset + 3;
+        case ROP_CLOSURE: {
+            uint8_t constant = chunk->code[offset + 2];
+            printf("%-32s r%d ", "ROP_CLOSURE", chunk->code[offset + 1]);
+            printConstant(function, constant);
+            printf("\n");
+            ObjFunction* closure = AS_FUNCTION(function->chunk.constants.values[constant]);
+            offset += 3;
+            for (int j = 0; j < closure->upvalueCount; j++) {
+                int capture = chunk->code[offset++];
+                int index = chunk->code[offset++];
+                printf("%04d    | %s %d\n", offset - 2, captureNames[capture], index);
+            }
+            return offset;
+        }
+        case ROP_CLOSE_UPVALUE: return registerInstruction("ROP_CLOSE_UPVALUE", function, offset, 1, false);
+        case ROP_RETURN: return registerInstruction("ROP_RETURN", function, offset, 1, false);
+        default:
+            printf("Unknown opcode %d\n", instruction);
+            return offset + 1;
+    }
+}
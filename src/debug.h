@@ -2,8 +2,12 @@
 #define clox_debug_h
 
 #include "chunk.h"
+#include "object.h"
 
 void disassembleChunk(Chunk* chunk, const char* name);
 int disassembleInstruction(Chunk* chunk, int offset);
+const char* opcodeName(uint8_t instruction);
+void disassembleRegisterChunk(ObjFunction* function, const char* name);
+int disassembleRegisterInstruction(ObjFunction* function, int offset);
 
 #endif
\ No newline at end of file
@@ -0,0 +1,584 @@
+#include <stddef.h>
+#include <stdio.h>
+
+#include "common.h"
+#include "jit.h"
+
+#ifdef JIT
+
+#include "assembler.h"
+#include "memory.h"
+
+/*
+ * Базовый (шаблонный) JIT для x86-64 System V.
+ *
+ * Байт-код функции переводится в машинный код по одной инструкции: для каждого опкода
+ * выдаётся свой фиксированный шаблон, переходы байт-кода становятся переходами машинного кода.
+ * Стек значений остаётся тем же vm.stack, так что формат фрейма не меняется,
+ * а медленные пути (конкатенация, вызовы, ошибки) вызывают обычные функции виртуальной машины.
+ *
+ * Во время работы машинного кода регистры закреплены так:
+ *   rbx — frame->slots (перечитывается после вызовов: стек мог переехать при росте),
+ *   r12 — вершина стека (копия vm.stackTop), r13 — CallFrame*,
+ *   r14 — пул констант функции, r15 — маска QNAN для проверки IS_NUMBER.
+ * Все они сохраняются вызываемой функцией, так что переживают вызовы помощников.
+ * Перед каждым вызовом, который может закончиться ошибкой, в frame->ip пишется адрес
+ * текущей инструкции байт-кода: так runtimeError печатает правильные строки и для машинных фреймов.
+ */
+
+//* Особая цель перехода, помимо смещений в байт-коде: выход с ошибкой
+#define TARGET_FAIL -1
+
+static void pushValue(Assembler* as, Register reg) {
+    store(as, R12, 0, reg);
+    addImmediate(as, R12, 8);
+}
+
+//* frame->ip указывает за опкод текущей инструкции, как у интерпретатора при ошибке
+static void saveIp(Assembler* as, uint8_t* ip) {
+    moveImmediate(as, RAX, (uint64_t)(uintptr_t)ip);
+    store(as, R13, offsetof(CallFrame, ip), RAX);
+}
+
+static void syncStack(Assembler* as) {
+    moveImmediate(as, RAX, (uint64_t)(uintptr_t)&vm.stackTop);
+    store(as, RAX, 0, R12);
+}
+
+static void reloadStack(Assembler* as) {
+    moveImmediate(as, RAX, (uint64_t)(uintptr_t)&vm.stackTop);
+    load(as, R12, RAX, 0);
+}
+
+//* Переход на slow, если в reg не число: (value & QNAN) == QNAN
+static int jumpIfNotNumber(Assembler* as, Register reg) {
+    moveRegister(as, RDX, reg);
+    aluRegister(as, AND_REGISTER, RDX, R15);
+    aluRegister(as, CMP_REGISTER, RDX, R15);
+    return jumpForward(as, CC_E);
+}
+
+//* Выход с ошибкой времени выполнения после вызова помощника, который её сообщает
+static void failWith(Assembler* as, uint8_t* ip, void* helper) {
+    saveIp(as, ip);
+    callHelper(as, helper);
+    jumpTo(as, JUMP_ALWAYS, TARGET_FAIL);
+}
+
+//* Помощники, которые вызывает машинный код
+
+static void jitNumbersError() {
+    runtimeError("Operands must be numbers.");
+}
+
+static void jitNumberError() {
+    runtimeError("Operand must be a number.");
+}
+
+static void jitUndefinedVariable(int slot) {
+    runtimeError("Undefined variable '%s'.", AS_STRING(vm.globalNames.values[slot])->chars);
+}
+
+static bool jitAdd() {
+    if (IS_STRING(peek(0)) && IS_STRING(peek(1))) {
+        concatenate();
+        return true;
+    }
+    runtimeError("Operands must be two numbers or two strings.");
+    return false;
+}
+
+static void jitEqual() {
+    Value b = pop();
+    Value a = pop();
+    push(BOOL_VAL(valuesEqual(a, b)));
+}
+
+static void jitPrint() {
+    printValue(pop());
+    printf("\n");
+}
+
+//* Вызываемая функция выполнена машинным кодом; после хвостового вызова её фрейм мог достаться интерпретатору
+static bool finishCall(NativeResult result) {
+    if (result == NATIVE_TAIL_CALL) return run() == INTERPRET_OK;
+    return result == NATIVE_RETURN;
+}
+
+static bool jitCall(int argCount) {
+    safepoint();
+    Value callee = peek(argCount);
+    if (IS_CLOSURE(callee)) {
+        //* Быстрый путь: вызов из машинного кода в машинный код без callValue и call()
+        ObjClosure* closure = AS_CLOSURE(callee);
+        ObjFunction* function = closure->function;
+        //* Если не хватает места на стеке, ошибку сообщит медленный путь
+        if (function->jitCode != NULL && function->arity == argCount && vm.frameCount < vm.maxFrames &&
+            nativeStackAvailable() && reserveStack(function->stackSlots - argCount - 1)) {
+            CallFrame* frame = pushFrame();
+            frame->closure = closure;
+            frame->ip = function->chunk.code;
+            frame->slots = vm.stackTop - argCount - 1;
+            frame->native = true;
+            return finishCall(runNative(frame));
+        }
+    }
+
+    int frameCount = vm.frameCount;
+    if (!callValue(peek(argCount), argCount)) return false;
+    if (vm.frameCount == frameCount) return true;
+
+    CallFrame* frame = vm.frame;
+    if (frame->native) return finishCall(runNative(frame));
+    //* Вызванную функцию выполняет интерпретатор: run() вернётся сюда на её OP_RETURN
+    return run() == INTERPRET_OK;
+}
+
+/*
+ * OP_TAIL_CALL в машинном коде. Если фрейм занят вызванной функцией, машинный код текущей
+ * должен сразу вернуть NATIVE_TAIL_CALL: продолжит runNative, не углубляя стек C.
+ * Иначе (нативная функция) результат уже на стеке, и машинный код переходит к OP_RETURN.
+ */
+static NativeResult jitTailCall(int argCount) {
+    safepoint();
+    bool reuse = IS_CLOSURE(peek(argCount));
+    if (!tailCallValue(peek(argCount), argCount)) return NATIVE_ERROR;
+    return reuse ? NATIVE_TAIL_CALL : NATIVE_RETURN;
+}
+
+static void jitClosure(uint8_t* ip) {
+    CallFrame* frame = vm.frame;
+    ObjFunction* function = AS_FUNCTION(frame->closure->function->chunk.constants.values[*ip++]);
+    ObjClosure* closure = newClosure(function);
+    push(OBJ_VAL((Obj*)closure));
+    for (int i = 0; i < closure->upvalueCount; i++) {
+        uint8_t capture = *ip++;
+        uint8_t index = *ip++;
+        if (capture == CAPTURE_LOCAL) {
+            closure->upvalues[i] = captureUpvalue(frame->slots + index);
+        } else if (capture == CAPTURE_VALUE) {
+            closure->upvalues[i] = copyUpvalue(frame->slots + index);
+        } else {
+            closure->upvalues[i] = frame->closure->upvalues[index];
+        }
+        writeBarrier((Obj*)closure, OBJ_VAL((Obj*)closure->upvalues[i]));
+    }
+}
+
+static void jitWriteBarrier(Obj* owner, Value value) {
+    writeBarrier(owner, value);
+}
+
+static void jitOverwriteUpvalue(int index) {
+    deletionBarrier(*vm.frame->closure->upvalues[index]->location);
+}
+
+//* Барьер удаления (см. deletionBarrier) перед записью в upvalue index текущего фрейма.
+//* Помощник вызывается только во время параллельной пометки и портит вызываемой функцией не сохраняемые регистры
+void emitDeletionBarrier(Assembler* as, int index) {
+    moveImmediate(as, RSI, (uint64_t)(uintptr_t)&vm.gcPhase);
+    emit(as, 0x83); emit(as, 0x3e); emit(as, GC_CONCURRENT_MARKING); // cmp dword [rsi], GC_CONCURRENT_MARKING
+    int idle = jumpForward(as, CC_NE);
+    moveImmediate(as, RDI, (uint64_t)index);
+    callHelper(as, jitOverwriteUpvalue);
+    patchHere(as, idle);
+}
+
+/*
+ * Барьер записи (см. writeBarrier) после того, как в объект owner записано значение value.
+ * Помощник вызывается, только если идёт инкрементальная пометка или ссылка ведёт в питомник;
+ * вторая проверка встроена: value - (тег объекта | начало питомника) < NURSERY_SIZE.
+ * Портит rsi, rdi, а при вызове помощника — все регистры, которые не сохраняет вызываемая функция
+ */
+void emitWriteBarrier(Assembler* as, Register owner, Register value) {
+    moveImmediate(as, RSI, (uint64_t)(uintptr_t)&vm.gcPhase);
+    emit(as, 0x83); emit(as, 0x3e); emit(as, GC_MARKING); // cmp dword [rsi], GC_MARKING
+    int marking = jumpForward(as, CC_E);
+    moveImmediate(as, RSI, -(SIGN_BIT | QNAN | (uint64_t)(uintptr_t)vm.nursery));
+    aluRegister(as, ADD_REGISTER, RSI, value);
+    moveImmediate(as, RDI, NURSERY_SIZE);
+    aluRegister(as, CMP_REGISTER, RDI, RSI);
+    int old = jumpForward(as, CC_BE);
+    patchHere(as, marking);
+    moveRegister(as, RDI, owner);
+    moveRegister(as, RSI, value);
+    callHelper(as, jitWriteBarrier);
+    patchHere(as, old);
+}
+
+//* Шаблоны инструкций
+
+//* Загружает a = [r12-16] в rax и b = [r12-8] в rcx, а при нечисловых операндах переходит на медленный путь
+static void loadNumbers(Assembler* as, int* slowA, int* slowB) {
+    load(as, RAX, R12, -16);
+    load(as, RCX, R12, -8);
+    *slowA = jumpIfNotNumber(as, RAX);
+    *slowB = jumpIfNotNumber(as, RCX);
+    moveToXmm(as, XMM0, RAX);
+    moveToXmm(as, XMM1, RCX);
+}
+
+//* Результат сравнения (флаги ucomisd) как логическое Value поверх a
+static void storeCondition(Assembler* as, Condition condition) {
+    setCondition(as, condition);
+    emit(as, 0x0f); emit(as, 0xb6); emit(as, 0xc0); // movzx eax, al
+    moveImmediate(as, RCX, FALSE_VAL);
+    aluRegister(as, ADD_REGISTER, RAX, RCX);
+    store(as, R12, -16, RAX);
+    addImmediate(as, R12, -8);
+}
+
+static void numberOp(Assembler* as, uint8_t* ip, uint8_t sseOpcode) {
+    int slowA, slowB;
+    loadNumbers(as, &slowA, &slowB);
+    sseOp(as, 0xf2, sseOpcode, XMM0, XMM1);
+    moveFromXmm(as, RAX, XMM0);
+    store(as, R12, -16, RAX);
+    addImmediate(as, R12, -8);
+    int done = jumpForward(as, JUMP_ALWAYS);
+    patchHere(as, slowA);
+    patchHere(as, slowB);
+    failWith(as, ip, jitNumbersError);
+    patchHere(as, done);
+}
+
+static void compareOp(Assembler* as, uint8_t* ip, bool less) {
+    int slowA, slowB;
+    loadNumbers(as, &slowA, &slowB);
+    //* a < b вычисляется как b > a: ucomisd xmm1, xmm0; для a > b — ucomisd xmm0, xmm1
+    sseOp(as, 0x66, SSE_COMPARE, less ? XMM1 : XMM0, less ? XMM0 : XMM1);
+    storeCondition(as, CC_A);
+    int done = jumpForward(as, JUMP_ALWAYS);
+    patchHere(as, slowA);
+    patchHere(as, slowB);
+    failWith(as, ip, jitNumbersError);
+    patchHere(as, done);
+}
+
+static void addOp(Assembler* as, uint8_t* ip) {
+    int slowA, slowB;
+    loadNumbers(as, &slowA, &slowB);
+    sseOp(as, 0xf2, SSE_ADD, XMM0, XMM1);
+    moveFromXmm(as, RAX, XMM0);
+    store(as, R12, -16, RAX);
+    addImmediate(as, R12, -8);
+    int done = jumpForward(as, JUMP_ALWAYS);
+    //* Не числа: строки склеивает concatenate(), остальное — ошибка
+    patchHere(as, slowA);
+    patchHere(as, slowB);
+    saveIp(as, ip);
+    syncStack(as);
+    callHelper(as, jitAdd);
+    testResult(as);
+    jumpTo(as, CC_E, TARGET_FAIL);
+    reloadStack(as);
+    patchHere(as, done);
+}
+
+static void jumpIfFalsey(Assembler* as, int target) {
+    load(as, RAX, R12, -8);
+    moveImmediate(as, RCX, NIL_VAL);
+    aluRegister(as, CMP_REGISTER, RAX, RCX);
+    jumpTo(as, CC_E, target);
+    moveImmediate(as, RCX, FALSE_VAL);
+    aluRegister(as, CMP_REGISTER, RAX, RCX);
+    jumpTo(as, CC_E, target);
+}
+
+static void loadGlobals(Assembler* as, Register reg) {
+    moveImmediate(as, reg, (uint64_t)(uintptr_t)&vm.globalValues.values);
+    load(as, reg, reg, 0);
+}
+
+//* Ошибка, если в rax лежит UNDEFINED_VAL
+static void checkDefined(Assembler* as, uint8_t* ip, int slot) {
+    moveImmediate(as, RDX, UNDEFINED_VAL);
+    aluRegister(as, CMP_REGISTER, RAX, RDX);
+    int defined = jumpForward(as, CC_NE);
+    moveImmediate(as, RDI, (uint64_t)slot);
+    failWith(as, ip, jitUndefinedVariable);
+    patchHere(as, defined);
+}
+
+static void loadUpvalue(Assembler* as, Register reg, int index) {
+    load(as, reg, R13, offsetof(CallFrame, closure));
+    load(as, reg, reg, (int)offsetof(ObjClosure, upvalues) + index * (int)sizeof(ObjUpvalue*));
+}
+
+static void loadUpvalueLocation(Assembler* as, Register reg, int index) {
+    loadUpvalue(as, reg, index);
+    load(as, reg, reg, offsetof(ObjUpvalue, location));
+}
+
+static bool translate(Assembler* as, Chunk* chunk, int offset, uint8_t instruction) {
+    //* Операнды инструкции; этот же адрес сохраняется в frame->ip перед ошибками и вызовами
+    uint8_t* operands = &chunk->code[offset + 1];
+    switch (instruction) {
+        case OP_CONSTANT:
+            load(as, RAX, R14, operands[0] * (int)sizeof(Value));
+            pushValue(as, RAX);
+            break;
+        case OP_NIL: moveImmediate(as, RAX, NIL_VAL); pushValue(as, RAX); break;
+        case OP_TRUE: moveImmediate(as, RAX, TRUE_VAL); pushValue(as, RAX); break;
+        case OP_FALSE: moveImmediate(as, RAX, FALSE_VAL); pushValue(as, RAX); break;
+        case OP_POP: addImmediate(as, R12, -8); break;
+        case OP_GET_LOCAL:
+            load(as, RAX, RBX, operands[0] * (int)sizeof(Value));
+            pushValue(as, RAX);
+            break;
+        case OP_SET_LOCAL:
+            load(as, RAX, R12, -8);
+            store(as, RBX, operands[0] * (int)sizeof(Value), RAX);
+            break;
+        case OP_GET_GLOBAL: {
+            int slot = (operands[0] << 8) | operands[1];
+            loadGlobals(as, RCX);
+            load(as, RAX, RCX, slot * (int)sizeof(Value));
+            checkDefined(as, operands, slot);
+            pushValue(as, RAX);
+            break;
+        }
+        case OP_DEFINE_GLOBAL: {
+            int slot = (operands[0] << 8) | operands[1];
+            loadGlobals(as, RCX);
+            load(as, RAX, R12, -8);
+            store(as, RCX, slot * (int)sizeof(Value), RAX);
+            addImmediate(as, R12, -8);
+            break;
+        }
+        case OP_SET_GLOBAL: {
+            int slot = (operands[0] << 8) | operands[1];
+            loadGlobals(as, RCX);
+            load(as, RAX, RCX, slot * (int)sizeof(Value));
+            checkDefined(as, operands, slot);
+            loadGlobals(as, RCX);
+            load(as, RAX, R12, -8);
+            store(as, RCX, slot * (int)sizeof(Value), RAX);
+            break;
+        }
+        case OP_GET_UPVALUE:
+            loadUpvalueLocation(as, RAX, operands[0]);
+            load(as, RAX, RAX, 0);
+            pushValue(as, RAX);
+            break;
+        case OP_SET_UPVALUE:
+            emitDeletionBarrier(as, operands[0]);
+            loadUpvalue(as, RDX, operands[0]);
+            load(as, RCX, RDX, offsetof(ObjUpvalue, location));
+            load(as, RAX, R12, -8);
+            store(as, RCX, 0, RAX);
+            emitWriteBarrier(as, RDX, RAX);
+            break;
+        case OP_EQUAL:
+            syncStack(as);
+            callHelper(as, jitEqual);
+            reloadStack(as);
+            break;
+        case OP_GREATER: compareOp(as, operands, false); break;
+        case OP_LESS: compareOp(as, operands, true); break;
+        case OP_ADD: addOp(as, operands); break;
+        case OP_SUBTRACT: numberOp(as, operands, SSE_SUBTRACT); break;
+        case OP_MULTIPLY: numberOp(as, operands, SSE_MULTIPLY); break;
+        case OP_DIVIDE: numberOp(as, operands, SSE_DIVIDE); break;
+        case OP_NOT: {
+            //* isFalsey: nil или false
+            load(as, RAX, R12, -8);
+            moveImmediate(as, RCX, NIL_VAL);
+            aluRegister(as, CMP_REGISTER, RAX, RCX);
+            emit(as, 0x0f); emit(as, 0x94); emit(as, 0xc1); // sete cl
+            moveImmediate(as, RDX, FALSE_VAL);
+            aluRegister(as, CMP_REGISTER, RAX, RDX);
+            emit(as, 0x0f); emit(as, 0x94); emit(as, 0xc0); // sete al
+            emit(as, 0x08); emit(as, 0xc8); // or al, cl
+            emit(as, 0x0f); emit(as, 0xb6); emit(as, 0xc0); // movzx eax, al
+            aluRegister(as, ADD_REGISTER, RAX, RDX);
+            store(as, R12, -8, RAX);
+            break;
+        }
+        case OP_NEGATE: {
+            load(as, RAX, R12, -8);
+            int slow = jumpIfNotNumber(as, RAX);
+            rex(as, 0, RAX); emit(as, 0x0f); emit(as, 0xba); emit(as, 0xf8); emit(as, 63); // btc rax, 63
+            store(as, R12, -8, RAX);
+            int done = jumpForward(as, JUMP_ALWAYS);
+            patchHere(as, slow);
+            failWith(as, operands, jitNumberError);
+            patchHere(as, done);
+            break;
+        }
+        case OP_PRINT:
+            syncStack(as);
+            callHelper(as, jitPrint);
+            reloadStack(as);
+            break;
+        case OP_JUMP:
+        case OP_JUMP_IF_FALSE:
+        case OP_LOOP: {
+            int jump = (operands[0] << 8) | operands[1];
+            int target = instruction == OP_LOOP ? offset + 3 - jump : offset + 3 + jump;
+            if (instruction == OP_LOOP) {
+                //* Обратный переход — безопасная точка: заполненный питомник освобождает малая сборка
+                moveImmediate(as, RAX, (uint64_t)(uintptr_t)&vm.nurseryFull);
+                emit(as, 0x80); emit(as, 0x38); emit(as, 0x00); // cmp byte [rax], 0
+                int empty = jumpForward(as, CC_E);
+                syncStack(as);
+                callHelper(as, collectNursery);
+                patchHere(as, empty);
+            }
+            if (instruction == OP_JUMP_IF_FALSE) {
+                jumpIfFalsey(as, target);
+            } else {
+                jumpTo(as, JUMP_ALWAYS, target);
+            }
+            break;
+        }
+        case OP_CALL:
+            saveIp(as, operands);
+            syncStack(as);
+            moveImmediate(as, RDI, operands[0]);
+            callHelper(as, jitCall);
+            testResult(as);
+            jumpTo(as, CC_E, TARGET_FAIL);
+            //* Вызов мог расширить стек значений и перенести его: слоты фрейма перечитываем
+            load(as, RBX, R13, offsetof(CallFrame, slots));
+            reloadStack(as);
+            break;
+        case OP_TAIL_CALL:
+            saveIp(as, operands);
+            syncStack(as);
+            moveImmediate(as, RDI, operands[0]);
+            callHelper(as, jitTailCall);
+            testResult(as);
+            jumpTo(as, CC_E, TARGET_FAIL);
+            //* Фрейм занят другой функцией: в eax уже NATIVE_TAIL_CALL, уходим в эпилог
+            emit(as, 0x3c); emit(as, NATIVE_TAIL_CALL); // cmp al, NATIVE_TAIL_CALL
+            jumpTo(as, CC_E, chunk->count);
+            reloadStack(as);
+            break;
+        case OP_CLOSURE:
+            saveIp(as, operands);
+            syncStack(as);
+            moveImmediate(as, RDI, (uint64_t)(uintptr_t)operands);
+            callHelper(as, jitClosure);
+            reloadStack(as);
+            break;
+        case OP_CLOSE_UPVALUE:
+            moveRegister(as, RDI, R12);
+            addImmediate(as, RDI, -8);
+            callHelper(as, closedUpvalues);
+            addImmediate(as, R12, -8);
+            break;
+        case OP_RETURN: {
+            moveRegister(as, RDI, RBX);
+            callHelper(as, closedUpvalues);
+            load(as, RAX, R12, -8);
+            store(as, RBX, 0, RAX);
+            emit(as, 0xb8); emit32(as, NATIVE_RETURN); // mov eax, NATIVE_RETURN
+            //* Эпилог общий с выходом по ошибке; на него ведёт переход с целью за концом байт-кода
+            jumpTo(as, JUMP_ALWAYS, chunk->count);
+            break;
+        }
+        default:
+            return false;
+    }
+    return true;
+}
+
+/*
+ * Переводит байт-код функции в машинный код. Ускоренные инструкции и суперинструкции
+ * разбираются обратно на исходные (genericOpcode), так что каждая инструкция байт-кода,
+ * в том числе цель любого перехода, получает свою метку в машинном коде.
+ */
+bool jitCompile(ObjFunction* function) {
+    Chunk* chunk = &function->chunk;
+    Assembler as;
+    initAssembler(&as);
+    int* labels = ALLOCATE(int, chunk->count + 1);
+
+    //* Пролог: сохраняем регистры, закреплённые за состоянием фрейма, и выравниваем стек по 16 байт
+    push64(&as, RBP);
+    moveRegister(&as, RBP, RSP);
+    push64(&as, RBX);
+    push64(&as, R12);
+    push64(&as, R13);
+    push64(&as, R14);
+    push64(&as, R15);
+    addImmediate(&as, RSP, -8);
+    moveRegister(&as, R13, RDI);
+    load(&as, RBX, R13, offsetof(CallFrame, slots));
+    reloadStack(&as);
+    moveImmediate(&as, R14, (uint64_t)(uintptr_t)chunk->constants.values);
+    moveImmediate(&as, R15, QNAN);
+
+    bool supported = true;
+    for (int offset = 0; offset < chunk->count && supported;) {
+        uint8_t instruction = genericOpcode(chunk->code[offset]);
+        labels[offset] = as.count;
+        supported = translate(&as, chunk, offset, instruction);
+        offset += opcodeLength(chunk, offset, instruction);
+    }
+
+    //* Выход с ошибкой, затем общий эпилог
+    int failLabel = as.count;
+    emit(&as, 0x31); emit(&as, 0xc0); // xor eax, eax: NATIVE_ERROR
+    labels[chunk->count] = as.count;
+    addImmediate(&as, RSP, 8);
+    pop64(&as, R15);
+    pop64(&as, R14);
+    pop64(&as, R13);
+    pop64(&as, R12);
+    pop64(&as, RBX);
+    pop64(&as, RBP);
+    emit(&as, 0xc3);
+
+    for (int i = 0; i < as.patchCount && supported; i++) {
+        Patch* patch = &as.patches[i];
+        int label = patch->target == TARGET_FAIL ? failLabel : labels[patch->target];
+        patch32(&as, patch->position, label - patch->position - 4);
+    }
+
+    if (supported) {
+        function->jitCode = mapCode(&as, &function->jitSize);
+        supported = function->jitCode != NULL;
+    }
+    if (supported) {
+        vm.jitFunctions++;
+#ifdef DEBUG_PRINT_CODE
+        printf("== jit %s: %d bytes ==\n", function->name != NULL ? function->name->chars : "<script>", as.count);
+#endif
+    }
+
+    freeAssembler(&as);
+    FREE_ARRAY(int, labels, chunk->count + 1);
+    return supported;
+}
+
+/*
+ * Выполняет машинный код только что вызванной функции (фрейм уже создан call())
+ * и снимает её фрейм, оставляя результат на вершине стека, как OP_RETURN.
+ * Хвостовые вызовы функций с машинным кодом выполняются здесь же, в том же фрейме.
+ * NATIVE_TAIL_CALL возвращается, только если фрейм перешёл к функции без машинного кода:
+ * тогда он остаётся на стеке фреймов, и его с начала выполняет интерпретатор.
+ */
+NativeResult runNative(CallFrame* frame) {
+    NativeResult result;
+    do {
+        JitCode code = (JitCode)frame->closure->function->jitCode;
+        result = code(frame);
+    } while (result == NATIVE_TAIL_CALL && frame->native);
+    if (result != NATIVE_RETURN) return result;
+
+    vm.frameCount--;
+    vm.frame = frame->previous;
+    vm.stackTop = frame->slots + 1;
+    return NATIVE_RETURN;
+}
+
+void freeJitCode(ObjFunction* function) {
+    if (function->jitCode == NULL) return;
+    unmapCode(function->jitCode, function->jitSize);
+    function->jitCode = NULL;
+    function->jitSize = 0;
+}
+
+#endif
@@ -0,0 +1,35 @@
+#ifndef clox_jit_h
+#define clox_jit_h
+
+#include "common.h"
+#include "object.h"
+#include "vm.h"
+
+#ifdef JIT
+
+#include "assembler.h"
+
+//* Сколько раз функция должна быть вызвана, прежде чем её байт-код будет переведён в машинный код
+#ifndef JIT_THRESHOLD
+#define JIT_THRESHOLD 1000
+#endif
+
+//* Чем закончилось выполнение машинного кода фрейма
+typedef enum {
+    NATIVE_ERROR, // Ошибка времени выполнения (она уже выведена runtimeError)
+    NATIVE_RETURN, // OP_RETURN: результат в frame->slots[0]
+    NATIVE_TAIL_CALL, // OP_TAIL_CALL: фрейм занят вызванной функцией и выполняется с её начала
+} NativeResult;
+
+//* Машинный код функции: выполняет фрейм frame до OP_RETURN или хвостового вызова
+typedef NativeResult (*JitCode)(CallFrame* frame);
+
+bool jitCompile(ObjFunction* function);
+NativeResult runNative(CallFrame* frame);
+void freeJitCode(ObjFunction* function);
+void emitWriteBarrier(Assembler* as, Register owner, Register value);
+void emitDeletionBarrier(Assembler* as, int index);
+
+#endif
+
+#endif
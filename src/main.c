@@ -3,6 +3,7 @@
 #include <string.h>
 
 #include "common.h"
+#include "trace.h"
 #include "vm.h"
 
 #define FILE_EXTENSION ".lox"
@@ -48,6 +49,8 @@ static char* readFile(const char* path) {
     return buffer;
 }
 
+static bool showStats = false; // --stats: вывести счётчики виртуальной машины после выполнения
+
 static void runFile(const char* path) {
     const char* extension = strstr(path, FILE_EXTENSION);
     if (!extension || strcmp(extension, FILE_EXTENSION) != 0) {
@@ -58,23 +61,74 @@ static void runFile(const char* path) {
     char* source = readFile(path);
     InterpretResult result = interpret(source);
     free(source);
+    if (showStats) printVMStats();
+#ifdef JIT
+    if (vm.dumpTraces) printTraces();
+#endif
 
     if (result == INTERPRET_COMPILE_ERROR) exit(65);
     if (result == INTERPRET_RUNTIME_ERROR) exit(70);
 }
 
+static void usage() {
+    fprintf(stderr, "Usage: clox [--stats] [--register] [--traces] [--max-frames N] [--max-stack N] [--incremental] [--max-pause US] [--concurrent] [--compact RATIO] [--heap-limit BYTES] [path]\n");
+    exit(64);
+}
+
 int main(int argc, const char* argv[]) {
+    const char* path = NULL;
     initVM();
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--stats") == 0) {
+            showStats = true;
+        } else if (strcmp(argv[i], "--register") == 0) {
+            //* Регистровый бэкенд: флаг должен быть выставлен до компиляции
+            vm.registerMode = true;
+        } else if (strcmp(argv[i], "--traces") == 0) {
+            //* Отладка трассирующего JIT: трассы печатаются при записи, счётчики выходов — в конце
+            vm.dumpTraces = true;
+        } else if (strcmp(argv[i], "--max-frames") == 0 && i + 1 < argc) {
+            //* Предел глубины вызовов; при превышении — ошибка "Stack overflow."
+            vm.maxFrames = atoi(argv[++i]);
+            if (vm.maxFrames < 1) usage();
+        } else if (strcmp(argv[i], "--max-stack") == 0 && i + 1 < argc) {
+            //* Предел размера стека значений (в значениях)
+            vm.maxStack = atoi(argv[++i]);
+            if (vm.maxStack < STACK_INITIAL) usage();
+        } else if (strcmp(argv[i], "--incremental") == 0) {
+            //* Полная сборка мусора шагами, а не одной паузой
+            vm.incrementalGC = true;
+        } else if (strcmp(argv[i], "--max-pause") == 0 && i + 1 < argc) {
+            //* Целевая длительность шага инкрементальной сборки в микросекундах; включает --incremental
+            vm.maxPause = atof(argv[++i]);
+            if (vm.maxPause <= 0) usage();
+            vm.incrementalGC = true;
+        } else if (strcmp(argv[i], "--concurrent") == 0) {
+            //* Пометка старой кучи в отдельном потоке; без поддержки потоков — инкрементальная сборка
+            vm.concurrentGC = true;
+        } else if (strcmp(argv[i], "--compact") == 0 && i + 1 < argc) {
+            //* Уплотнять старую кучу, когда дыры в ней составят такую долю (от 0 до 1)
+            vm.compactRatio = atof(argv[++i]);
+            if (vm.compactRatio <= 0 || vm.compactRatio > 1) usage();
+        } else if (strcmp(argv[i], "--heap-limit") == 0 && i + 1 < argc) {
+            //* Предел памяти скрипта; при превышении — ошибка времени выполнения "Out of memory"
+            char* end;
+            vm.heapLimit = strtoull(argv[++i], &end, 10);
+            if (*end != '\0' || vm.heapLimit == 0) usage();
+        } else if (argv[i][0] == '-' || path != NULL) {
+            usage();
+        } else {
+            path = argv[i];
+        }
+    }
 
-    if (argc == 1) {
+    if (path == NULL) {
         repl();
-    } else if (argc == 2) {
-        runFile(argv[1]);
+        if (showStats) printVMStats();
     } else {
-        fprintf(stderr, "Usage: clox [path]\n");
-        exit(64);
+        runFile(path);
     }
 
     freeVM();
     return 0;
-}
\ No newline at end of file
+}
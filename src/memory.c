@@ -1,52 +1,1228 @@
+#include <float.h>
+#include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "compiler.h"
+#include "jit.h"
+#include "trace.h"
 #include "memory.h"
 #include "vm.h"
 
+#ifdef CONCURRENT_GC
+#include <pthread.h>
+#endif
+
+//* Идёт сборка или освобождение объектов. Они сами могут выделять память (перенос из питомника,
+//* forgetTraces перестраивает кэш трасс), но запускать в это время новую сборку нельзя
+static bool collecting = false;
+
+//* Объекты в питомнике выровнены по 8 байт
+#define ALIGN(size) (((size) + 7) & ~(size_t)7)
+
+static void incrementalStep();
+static void concurrentStep();
+
+/*
+ * Порог превышен — полная сборка целиком или, в инкрементальном и параллельном режимах, её первый шаг.
+ * Пока сборка идёт, следующий шаг выполняется, когда накопилось GC_STEP_SIZE байт долга
+ */
+static void collectIfNeeded() {
+    if (vm.gcPhase != GC_IDLE) {
+        if (vm.gcDebt < GC_STEP_SIZE) return;
+        if (vm.gcPhase == GC_CONCURRENT_MARKING) {
+            concurrentStep();
+        } else {
+            incrementalStep();
+        }
+    } else if (vm.bytesAllocated > vm.nextGC) {
+        vm.gcDebt = 0;
+        if (vm.concurrentGC && !vm.pretenure) {
+            concurrentStep();
+        } else if (vm.incrementalGC) {
+            incrementalStep();
+        } else {
+            collectGarbage();
+        }
+    }
+}
+
+//* Монотонное время в микросекундах, для замера пауз сборщика
+static double now() {
+    struct timespec time;
+    timespec_get(&time, TIME_UTC);
+    return time.tv_sec * 1e6 + time.tv_nsec / 1e3;
+}
+
+static void recordPause(double start) {
+    double pause = now() - start;
+    if (pause > vm.longestPause) vm.longestPause = pause;
+    vm.totalPause += pause;
+    int bucket = 0;
+    while (bucket < GC_PAUSE_BUCKETS - 1 && pause >= (double)(1 << bucket)) bucket++;
+    vm.pauseHistogram[bucket]++;
+}
+
+/*
+ * Через reallocate проходит вся память VM, поэтому здесь же считаются выделенные байты
+ * и запускается сборка мусора. Сборка возможна при любом выделении (росте) памяти:
+ * все объекты, которые ещё понадобятся, в этот момент должны быть достижимы из корней (см. markRoots).
+ */
+static void countAllocation(size_t oldSize, size_t newSize) {
+    vm.bytesAllocated += newSize - oldSize;
+    if (vm.bytesAllocated > vm.peakBytes) vm.peakBytes = vm.bytesAllocated;
+    if (newSize > oldSize && vm.gcPhase != GC_IDLE) vm.gcDebt += newSize - oldSize;
+    if (newSize > oldSize && !collecting) {
+#ifdef DEBUG_STRESS_GC
+        if (vm.concurrentGC && !vm.pretenure && vm.gcPhase != GC_SWEEPING) {
+            concurrentStep();
+        } else if (vm.incrementalGC || vm.gcPhase != GC_IDLE) {
+            incrementalStep();
+        } else {
+            collectGarbage();
+        }
+#else
+        collectIfNeeded();
+#endif
+    }
+}
+
+/*
+ * Система не дала памяти под блок, который reallocate уже учёл. Во время выполнения это
+ * ошибка времени выполнения: управление возвращается вызывающему interpret (см. vm.errorJump).
+ * При компиляции и во время сборки вернуться некуда, и процесс завершается, как раньше
+ */
+static void outOfMemory(size_t oldSize, size_t newSize) {
+    vm.bytesAllocated -= newSize - oldSize;
+    if (vm.errorJump == NULL || collecting) exit(1);
+    runtimeError("Out of memory.");
+    longjmp(*vm.errorJump, 1);
+}
+
+/*
+ * Новый объект не помещается в предел кучи. Сначала полная сборка: возможно, большая часть кучи — мусор.
+ * Вызывается только перед выделением объекта, когда ни одна структура VM не изменена наполовину
+ */
+void heapLimitExceeded() {
+    if (vm.errorJump == NULL || collecting) return;
+    collectGarbage();
+    if (vm.bytesAllocated <= vm.heapLimit) return;
+    runtimeError("Out of memory: heap limit of %zu bytes exceeded.", vm.heapLimit);
+    longjmp(*vm.errorJump, 1);
+}
+
+#ifdef SLAB_ALLOCATOR
+/*
+ * Slab-аллокатор для мелких блоков. Блок до SLAB_MAX_BLOCK байт выдаёт класс размеров с шагом SLAB_GRANULE:
+ * класс режет свои слабы (по SLAB_SIZE байт от malloc) на блоки одного размера, а освобождённые блоки
+ * держит в списке свободных. Старый размер reallocate знает всегда, поэтому заголовков у блоков нет.
+ * Слабы возвращаются системе только в freeVM. Блоки крупнее SLAB_MAX_BLOCK выделяет malloc
+ */
+#define SLAB_SIZE (64 * 1024)
+#define SLAB_GRANULE 16
+#define SLAB_MAX_BLOCK 256
+#define SLAB_CLASSES (SLAB_MAX_BLOCK / SLAB_GRANULE)
+#define SLAB_HEADER SLAB_GRANULE // Начало слаба занимает ссылка на следующий слаб класса; блоки выровнены по SLAB_GRANULE
+
+typedef struct FreeBlock {
+    struct FreeBlock* next;
+} FreeBlock;
+
+typedef struct Slab {
+    struct Slab* next;
+} Slab;
+
+typedef struct {
+    FreeBlock* free; // Освобождённые блоки
+    char* top; // Ещё не нарезанный остаток последнего слаба
+    char* end;
+    Slab* slabs;
+    size_t slabCount;
+    size_t used; // Сколько блоков сейчас выдано
+} SizeClass;
+
+static SizeClass sizeClasses[SLAB_CLASSES];
+static size_t largeBlocks = 0; // Сколько блоков сейчас выдал malloc
+
+static int sizeClassOf(size_t size) {
+    return (int)((size - 1) / SLAB_GRANULE);
+}
+
+//* NULL — системе не хватило памяти на новый слаб
+static void* allocateBlock(int index) {
+    SizeClass* sizeClass = &sizeClasses[index];
+    if (sizeClass->free != NULL) {
+        FreeBlock* block = sizeClass->free;
+        sizeClass->free = block->next;
+        sizeClass->used++;
+        return block;
+    }
+
+    size_t blockSize = (size_t)(index + 1) * SLAB_GRANULE;
+    if (sizeClass->top + blockSize > sizeClass->end) {
+        Slab* slab = (Slab*)malloc(SLAB_SIZE);
+        if (slab == NULL) return NULL;
+        slab->next = sizeClass->slabs;
+        sizeClass->slabs = slab;
+        sizeClass->slabCount++;
+        sizeClass->top = (char*)slab + SLAB_HEADER;
+        sizeClass->end = (char*)slab + SLAB_SIZE;
+    }
+    void* block = sizeClass->top;
+    sizeClass->top += blockSize;
+    sizeClass->used++;
+    return block;
+}
+
+static void freeBlock(void* pointer, int index) {
+    FreeBlock* block = (FreeBlock*)pointer;
+    block->next = sizeClasses[index].free;
+    sizeClasses[index].free = block;
+    sizeClasses[index].used--;
+}
+
+//* Блок того же класса остаётся на месте; иначе — новый блок, копия и освобождение старого
+static void* slabReallocate(void* pointer, size_t oldSize, size_t newSize) {
+    bool oldSmall = pointer != NULL && oldSize <= SLAB_MAX_BLOCK;
+    bool newSmall = newSize > 0 && newSize <= SLAB_MAX_BLOCK;
+    if (oldSmall && newSmall && sizeClassOf(oldSize) == sizeClassOf(newSize)) return pointer;
+
+    if (!oldSmall && !newSmall) {
+        if (newSize == 0) {
+            if (pointer != NULL) largeBlocks--;
+            free(pointer);
+            return NULL;
+        }
+        void* result = realloc(pointer, newSize);
+        if (result == NULL) outOfMemory(oldSize, newSize);
+        if (pointer == NULL) largeBlocks++;
+        return result;
+    }
+
+    void* result = NULL;
+    if (newSmall) {
+        result = allocateBlock(sizeClassOf(newSize));
+        if (result == NULL) outOfMemory(oldSize, newSize);
+    } else if (newSize > 0) {
+        result = malloc(newSize);
+        if (result == NULL) outOfMemory(oldSize, newSize);
+        largeBlocks++;
+    }
+    if (pointer != NULL) {
+        if (result != NULL) memcpy(result, pointer, oldSize < newSize ? oldSize : newSize);
+        if (oldSmall) {
+            freeBlock(pointer, sizeClassOf(oldSize));
+        } else {
+            free(pointer);
+            largeBlocks--;
+        }
+    }
+    return result;
+}
+
+//* Заполненность слабов по классам размеров (clox --stats)
+void printSlabStats() {
+    size_t total = 0;
+    size_t used = 0;
+    for (int i = 0; i < SLAB_CLASSES; i++) {
+        SizeClass* sizeClass = &sizeClasses[i];
+        if (sizeClass->slabCount == 0) continue;
+        size_t blockSize = (size_t)(i + 1) * SLAB_GRANULE;
+        size_t capacity = sizeClass->slabCount * ((SLAB_SIZE - SLAB_HEADER) / blockSize);
+        fprintf(stderr, "  %3zu-byte blocks: %zu of %zu in %zu slabs (%.0f%%)\n", blockSize,
+                sizeClass->used, capacity, sizeClass->slabCount, 100.0 * sizeClass->used / capacity);
+        total += sizeClass->slabCount * SLAB_SIZE;
+        used += sizeClass->used * blockSize;
+    }
+    fprintf(stderr, "slab memory:       %zu of %zu bytes in use (%.0f%%)\n", used, total,
+            total > 0 ? 100.0 * used / total : 0.0);
+    fprintf(stderr, "malloc blocks:     %zu\n", largeBlocks);
+}
+
+void freeSlabs() {
+    for (int i = 0; i < SLAB_CLASSES; i++) {
+        SizeClass* sizeClass = &sizeClasses[i];
+        while (sizeClass->slabs != NULL) {
+            Slab* next = sizeClass->slabs->next;
+            free(sizeClass->slabs);
+            sizeClass->slabs = next;
+        }
+        sizeClass->free = NULL;
+        sizeClass->top = NULL;
+        sizeClass->end = NULL;
+        sizeClass->slabCount = 0;
+        sizeClass->used = 0;
+    }
+}
+#endif
+
 void* reallocate(void* pointer, size_t oldSize, size_t newSize) {
+    countAllocation(oldSize, newSize);
+#ifdef SLAB_ALLOCATOR
+    return slabReallocate(pointer, oldSize, newSize);
+#else
     if (newSize == 0) {
         free(pointer);
         return NULL;
     }
 
     void* result = realloc(pointer, newSize);
-    if (result == NULL) exit(1);
+    if (result == NULL) outOfMemory(oldSize, newSize);
+    return result;
+#endif
+}
+
+struct ArenaBlock {
+    ArenaBlock* next;
+    size_t size; // Размер data
+    size_t used;
+    size_t last; // Смещение последнего выделенного массива: только он растёт на месте
+    char data[];
+};
+
+void* arenaGrow(Arena* arena, void* pointer, size_t oldSize, size_t newSize) {
+    newSize = ALIGN(newSize);
+    ArenaBlock* block = arena->blocks;
+    if (block != NULL && pointer == block->data + block->last && block->last + newSize <= block->size) {
+        block->used = block->last + newSize;
+        return pointer;
+    }
+    if (block == NULL || block->used + newSize > block->size) {
+        if (newSize <= ARENA_BLOCK_SIZE && arena->spare != NULL) {
+            block = arena->spare;
+            arena->spare = block->next;
+        } else {
+            size_t size = newSize > ARENA_BLOCK_SIZE ? newSize : ARENA_BLOCK_SIZE;
+            block = (ArenaBlock*)reallocate(NULL, 0, sizeof(ArenaBlock) + size);
+            block->size = size;
+        }
+        block->next = arena->blocks;
+        block->used = 0;
+        arena->blocks = block;
+    }
+    block->last = block->used;
+    block->used += newSize;
+    void* result = block->data + block->last;
+    if (oldSize > 0) memcpy(result, pointer, oldSize);
     return result;
 }
 
+ArenaMark arenaMark(Arena* arena) {
+    ArenaMark mark;
+    mark.block = arena->blocks;
+    mark.used = arena->blocks != NULL ? arena->blocks->used : 0;
+    return mark;
+}
+
+//* Освобождает всё, что выделено после отметки mark
+void arenaRelease(Arena* arena, ArenaMark mark) {
+    while (arena->blocks != mark.block) {
+        ArenaBlock* block = arena->blocks;
+        arena->blocks = block->next;
+        if (block->size == ARENA_BLOCK_SIZE) {
+            block->next = arena->spare;
+            arena->spare = block;
+        } else {
+            reallocate(block, sizeof(ArenaBlock) + block->size, 0);
+        }
+    }
+    if (mark.block != NULL) {
+        mark.block->used = mark.used;
+        mark.block->last = mark.used; // Массивы ниже отметки на месте больше не растут
+    }
+}
+
+static void freeBlocks(ArenaBlock* block) {
+    while (block != NULL) {
+        ArenaBlock* next = block->next;
+        reallocate(block, sizeof(ArenaBlock) + block->size, 0);
+        block = next;
+    }
+}
+
+void freeArena(Arena* arena) {
+    freeBlocks(arena->blocks);
+    freeBlocks(arena->spare);
+    arena->blocks = NULL;
+    arena->spare = NULL;
+}
+
+static size_t objectSize(Obj* object) {
+    switch (objType(object)) {
+        case OBJ_CLOSURE:
+            return sizeof(ObjClosure) + sizeof(ObjUpvalue*) * ((ObjClosure*)object)->upvalueCount;
+        case OBJ_FUNCTION: return sizeof(ObjFunction);
+        case OBJ_NATIVE: return sizeof(ObjNative);
+        case OBJ_STRING: return STRING_SIZE(((ObjString*)object)->length);
+        case OBJ_UPVALUE: return sizeof(ObjUpvalue);
+        case OBJ_BUILDER: return sizeof(ObjBuilder) + ((ObjBuilder*)object)->capacity;
+        case OBJ_SLICE: return sizeof(ObjSlice);
+    }
+    return 0;
+}
+
 static void freeObject(Obj* object) {
-    switch (object->type) {
+#ifdef DEBUG_LOG_GC
+    printf("%p free type %d\n", (void*)object, objType(object));
+#endif
+
+    switch (objType(object)) {
+        case OBJ_FUNCTION: {
+            ObjFunction* function = (ObjFunction*)object;
+            freeChunk(&function->chunk);
+            freeChunk(&function->registerChunk);
+#ifdef JIT
+            freeJitCode(function);
+            forgetTraces(function);
+#endif
+            break;
+        }
+        case OBJ_CLOSURE:
+        case OBJ_STRING:
+        case OBJ_NATIVE:
+        case OBJ_UPVALUE:
+        case OBJ_BUILDER:
+        case OBJ_SLICE:
+            break;
+    }
+
+    //* Память молодого объекта освобождается вместе с питомником, а в уплотняемой области остаётся дырой
+    if (inCompactSpace(object)) {
+        vm.bytesAllocated -= ALIGN(objectSize(object));
+        vm.compactHoles += ALIGN(objectSize(object));
+    } else if (!isYoung(object)) {
+        reallocate(object, objectSize(object), 0);
+    }
+}
+
+void initNursery() {
+    vm.nursery = (char*)malloc(NURSERY_SIZE);
+    if (vm.nursery == NULL) exit(1);
+    vm.nurseryTop = vm.nursery;
+    vm.nurseryFull = false;
+    vm.pretenure = false;
+    vm.rememberedCount = 0;
+    vm.rememberedCapacity = 0;
+    vm.remembered = NULL;
+    vm.minorCollections = 0;
+    vm.promotedBytes = 0;
+}
+
+void freeNursery() {
+    free(vm.nursery);
+    free(vm.remembered);
+}
+
+/*
+ * Выделяет size байт в питомнике сдвигом указателя.
+ * Возвращает NULL, если объект надо выделить в старой куче: питомник заполнен (тогда в ближайшей
+ * безопасной точке пройдёт малая сборка), объект слишком велик или идёт компиляция (vm.pretenure)
+ */
+void* allocateYoung(size_t size) {
+    if (vm.pretenure) return NULL;
+    //* Длинная строка сразу идёт в старую кучу: переносить её дорого, и питомник она заняла бы надолго
+    if (size > NURSERY_SIZE / 8) return NULL;
+    size = ALIGN(size);
+    //* Выделение в питомнике тоже задаёт темп инкрементальной сборки. Шаг объекты не перемещает,
+    //* а новый объект выделяется уже после него
+    if (vm.gcPhase != GC_IDLE) {
+        vm.gcDebt += size;
+        if (!collecting) collectIfNeeded();
+    }
+#ifdef DEBUG_STRESS_GC
+    vm.nurseryFull = true;
+#endif
+    if (vm.nurseryTop + size > vm.nursery + NURSERY_SIZE) {
+        vm.nurseryFull = true;
+        return NULL;
+    }
+    void* result = vm.nurseryTop;
+    vm.nurseryTop += size;
+    return result;
+}
+
+//* Уплотнение перемещает строки, замыкания и upvalue; остальные объекты всегда остаются на месте
+static bool isMovable(ObjType type) {
+    return type != OBJ_FUNCTION && type != OBJ_NATIVE;
+}
+
+//* Уплотняемая область заполнилась после последней очистки: в ней могут быть мёртвые объекты
+static bool compactOverflow = false;
+
+//* Уплотнение нужно в ближайшей безопасной точке: safepoint() проверяет только nurseryFull
+static void requestCompaction() {
+    vm.compactPending = true;
+    vm.nurseryFull = true;
+}
+
+/*
+ * Выделяет size байт под объект старой кучи. В режиме уплотнения перемещаемые объекты
+ * выделяются сдвигом указателя в уплотняемой области; если она заполнена — через reallocate,
+ * а ближайшее уплотнение перенесёт их в область, при необходимости увеличив её
+ */
+void* allocateOld(size_t size, ObjType type) {
+    if (vm.compactRatio > 0 && isMovable(type)) {
+        if (vm.compactSpace == NULL) {
+            vm.compactSpace = (char*)malloc(COMPACT_SPACE_SIZE);
+            if (vm.compactSpace == NULL) exit(1);
+            vm.compactTop = vm.compactSpace;
+            vm.compactEnd = vm.compactSpace + COMPACT_SPACE_SIZE;
+        }
+        //* Сборка внутри countAllocation объекты не перемещает, и место в области останется свободным
+        if (vm.compactTop + ALIGN(size) <= vm.compactEnd) {
+            countAllocation(0, ALIGN(size));
+            void* result = vm.compactTop;
+            vm.compactTop += ALIGN(size);
+            return result;
+        }
+        compactOverflow = true;
+        requestCompaction();
+    }
+    return reallocate(NULL, 0, size);
+}
+
+void rememberObject(Obj* object) {
+    if (vm.rememberedCapacity < vm.rememberedCount + 1) {
+        vm.rememberedCapacity = GROW_CAPACITY(vm.rememberedCapacity);
+        vm.remembered = (Obj**)realloc(vm.remembered, sizeof(Obj*) * vm.rememberedCapacity);
+        if (vm.remembered == NULL) exit(1);
+    }
+    vm.remembered[vm.rememberedCount++] = object;
+    setRemembered(object, true);
+}
+
+void markObject(Obj* object) {
+    if (object == NULL || isMarked(object)) return;
+#ifdef DEBUG_LOG_GC
+    printf("%p mark ", (void*)object);
+    printValue(OBJ_VAL(object));
+    printf("\n");
+#endif
+    setMarked(object, true);
+
+    if (vm.grayCapacity < vm.grayCount + 1) {
+        vm.grayCapacity = GROW_CAPACITY(vm.grayCapacity);
+        vm.grayStack = (Obj**)realloc(vm.grayStack, sizeof(Obj*) * vm.grayCapacity);
+        if (vm.grayStack == NULL) exit(1);
+    }
+    vm.grayStack[vm.grayCount++] = object;
+}
+
+void markValue(Value value) {
+    if (IS_OBJ(value)) markObject(AS_OBJ(value));
+}
+
+static void markArray(ValueArray* array) {
+    for (int i = 0; i < array->count; i++) {
+        markValue(array->values[i]);
+    }
+}
+
+/*
+ * Корни: стек значений, замыкания живых фреймов, открытые upvalue,
+ * глобальные переменные (значения и имена) и функции, которые сейчас компилируются.
+ * Таблица vm.strings сюда не входит: ссылки из неё слабые (см. tableRemoveWhite).
+ */
+static void markRoots() {
+    for (Value* slot = vm.stack; slot < vm.stackTop; slot++) {
+        markValue(*slot);
+    }
+
+    for (CallFrame* frame = vm.frame; frame != NULL; frame = frame->previous) {
+        markObject((Obj*)frame->closure);
+    }
+
+    for (ObjUpvalue* upvalue = vm.openUpvalues; upvalue != NULL; upvalue = upvalue->next) {
+        markObject((Obj*)upvalue);
+    }
+
+    markTable(&vm.globalSlots);
+    markArray(&vm.globalValues);
+    markArray(&vm.globalNames);
+    markCompilerRoots();
+}
+
+//* Помечает всё, на что ссылается серый объект, после чего он становится чёрным
+static void blackenObject(Obj* object) {
+#ifdef DEBUG_LOG_GC
+    printf("%p blacken ", (void*)object);
+    printValue(OBJ_VAL(object));
+    printf("\n");
+#endif
+
+    switch (objType(object)) {
         case OBJ_CLOSURE: {
-            FREE(ObjClosure, object);
+            ObjClosure* closure = (ObjClosure*)object;
+            markObject((Obj*)closure->function);
+            for (int i = 0; i < closure->upvalueCount; i++) {
+                markObject((Obj*)closure->upvalues[i]);
+            }
             break;
         }
         case OBJ_FUNCTION: {
+            //* Регистровый код берёт константы из chunk, так что этого достаточно для обоих бэкендов
             ObjFunction* function = (ObjFunction*)object;
-            freeChunk(&function->chunk);
-            FREE(ObjFunction, object);
+            markObject((Obj*)function->name);
+            markObject((Obj*)function->closure);
+            markArray(&function->chunk.constants);
             break;
         }
+        case OBJ_UPVALUE:
+            markValue(((ObjUpvalue*)object)->closed);
+            break;
+        case OBJ_SLICE:
+            markObject((Obj*)((ObjSlice*)object)->builder);
+            break;
         case OBJ_NATIVE:
-            FREE(ObjNative, object);
+        case OBJ_STRING:
+        case OBJ_BUILDER:
+            break;
+    }
+}
+
+static void traceReferences() {
+    while (vm.grayCount > 0) {
+        Obj* object = vm.grayStack[--vm.grayCount];
+        blackenObject(object);
+    }
+}
+
+//* Проверяет объекты из vm.sweepList, пока их размеры не составят budget байт или не наступит deadline:
+//* помеченные возвращаются в vm.objects, остальные освобождаются. Возвращает, сколько байт просмотрено
+static size_t sweepStep(size_t budget, double deadline) {
+    size_t work = 0;
+    for (int count = 1; vm.sweepList != NULL && work < budget; count++) {
+        Obj* object = vm.sweepList;
+        vm.sweepList = objNext(object);
+        work += objectSize(object);
+        if (isMarked(object)) {
+            setMarked(object, false);
+            setObjNext(object, vm.objects);
+            vm.objects = object;
+        } else {
+            freeObject(object);
+        }
+        if (count % 64 == 0 && now() > deadline) break;
+    }
+    return work;
+}
+
+//* Старые объекты, которые сейчас будут освобождены, уходят из запомненного множества
+static void sweepRemembered() {
+    int count = 0;
+    for (int i = 0; i < vm.rememberedCount; i++) {
+        Obj* object = vm.remembered[i];
+        if (isMarked(object)) {
+            vm.remembered[count++] = object;
+        } else {
+            setRemembered(object, false);
+        }
+    }
+    vm.rememberedCount = count;
+}
+
+//* Молодые объекты не проходят через sweep: их пометки снимаются обходом питомника
+static void clearNurseryMarks() {
+    for (char* cursor = vm.nursery; cursor < vm.nurseryTop;) {
+        Obj* object = (Obj*)cursor;
+        setMarked(object, false);
+        cursor += ALIGN(objectSize(object));
+    }
+}
+
+static void beginCycle() {
+    markRoots();
+    vm.gcPhase = GC_MARKING;
+}
+
+//* Пометка закончена: очищаются vm.strings и запомненное множество, а старая куча целиком уходит в vm.sweepList.
+//* Объекты, выделенные во время очистки, попадают в vm.objects и ей не видны
+static void beginSweep() {
+    tableRemoveWhite(&vm.strings);
+    sweepRemembered();
+    clearNurseryMarks();
+    vm.sweepList = vm.objects;
+    vm.objects = NULL;
+    vm.gcPhase = GC_SWEEPING;
+}
+
+//* Пометка до конца одной паузой (collectGarbage). Записи в корни (стек, глобальные переменные)
+//* барьер не проходят, поэтому корни помечаются заново и серые объекты дообрабатываются до конца
+static void finishMarking() {
+    markRoots();
+    traceReferences();
+    beginSweep();
+}
+
+static void finishCycle() {
+    vm.gcPhase = GC_IDLE;
+    vm.nextGC = vm.bytesAllocated * GC_HEAP_GROW_FACTOR;
+    if (vm.nextGC < GC_INITIAL_HEAP) vm.nextGC = GC_INITIAL_HEAP;
+    vm.collections++;
+    compactOverflow = false;
+    if (vm.compactHoles > 0 && vm.compactHoles >= vm.compactRatio * (double)(vm.compactTop - vm.compactSpace)) {
+        requestCompaction();
+    }
+}
+
+//* Обрабатывает серые объекты, пока их размеры не составят budget байт или не наступит deadline.
+//* Возвращает, сколько байт просмотрено
+static size_t markStep(size_t budget, double deadline) {
+    size_t work = 0;
+    for (int count = 1; vm.grayCount > 0 && work < budget; count++) {
+        Obj* object = vm.grayStack[--vm.grayCount];
+        work += objectSize(object);
+        blackenObject(object);
+        if (count % 64 == 0 && now() > deadline) break;
+    }
+    return work;
+}
+
+/*
+ * Шаг инкрементальной сборки (трёхцветная пометка): белые объекты ещё не найдены, серые найдены,
+ * но их ссылки не просмотрены, чёрные просмотрены. Шаги выполняются при выделениях памяти,
+ * а между ними программа продолжает работу. Её записи в кучу проходят барьер (writeBarrier),
+ * и чёрный объект никогда не ссылается на белый.
+ * Записи в корни (стек, глобальные переменные) барьер не проходят, поэтому, когда серых не осталось,
+ * корни помечаются заново. Если это нашло новые серые объекты, пометка продолжается следующими шагами,
+ * так что пауза повторной пометки ограничена размером корней, а не кучи.
+ * Работа шага — долг vm.gcDebt, умноженный на GC_STEP_RATIO; что не успели за vm.maxPause, остаётся в долге
+ */
+static void incrementalStep() {
+    double start = now();
+    collecting = true;
+    size_t budget = vm.gcDebt * GC_STEP_RATIO;
+    if (budget == 0) budget = 1;
+    size_t work = 0;
+    switch (vm.gcPhase) {
+        case GC_IDLE:
+            beginCycle();
+            break;
+        case GC_MARKING:
+            work = markStep(budget, start + vm.maxPause);
+            if (vm.grayCount == 0) {
+                markRoots();
+                if (vm.grayCount == 0) beginSweep();
+            }
+            break;
+        case GC_SWEEPING:
+            work = sweepStep(budget, start + vm.maxPause);
+            if (vm.sweepList == NULL) finishCycle();
+            break;
+        case GC_CONCURRENT_MARKING:
+            break;
+    }
+    size_t paid = work / GC_STEP_RATIO;
+    vm.gcDebt = paid < vm.gcDebt ? vm.gcDebt - paid : 0;
+    if (vm.gcPhase == GC_IDLE) vm.gcDebt = 0;
+    collecting = false;
+    recordPause(start);
+}
+
+/*
+ * Параллельная пометка. Пока программа работает, старую кучу помечает отдельный поток.
+ * Молодые объекты он не трогает: малая сборка перемещает их в любой безопасной точке.
+ * Поэтому молодую часть снимка пометка проходит сразу, в паузе вместе с корнями, а поток получает
+ * только старые серые объекты. Всё, что было достижимо в начале (snapshot-at-the-beginning),
+ * остаётся помеченным благодаря барьеру удаления (deletionBarrier), а новые объекты сразу чёрные.
+ * Поля, которые меняют программа или малая сборка (все ссылки старых объектов), поток читает атомарно (см. FORWARD_FIELD).
+ * Пока идёт пометка, компилятор не работает (compile ждёт finishConcurrentMarking):
+ * он перевыделяет массивы констант, которые читает поток.
+ */
+static Obj** overwritten = NULL; // Старые объекты, потерявшие ссылку во время пометки (барьер удаления)
+static int overwrittenCount = 0;
+static int overwrittenCapacity = 0;
+
+void rememberOverwritten(Obj* object) {
+    //* Молодые объекты снимка уже помечены в начале, а новые — чёрные
+    if (isYoung(object) || isMarkedAtomic(object)) return;
+    if (overwrittenCapacity < overwrittenCount + 1) {
+        overwrittenCapacity = GROW_CAPACITY(overwrittenCapacity);
+        overwritten = (Obj**)realloc(overwritten, sizeof(Obj*) * overwrittenCapacity);
+        if (overwritten == NULL) exit(1);
+    }
+    overwritten[overwrittenCount++] = object;
+}
+
+#ifdef CONCURRENT_GC
+static pthread_t marker;
+static bool markerDone;
+//* Серый стек потока пометки
+static Obj** markerStack = NULL;
+static int markerCount = 0;
+static int markerCapacity = 0;
+
+static void pushMarker(Obj* object) {
+    if (markerCapacity < markerCount + 1) {
+        markerCapacity = GROW_CAPACITY(markerCapacity);
+        markerStack = (Obj**)realloc(markerStack, sizeof(Obj*) * markerCapacity);
+        if (markerStack == NULL) exit(1);
+    }
+    markerStack[markerCount++] = object;
+}
+
+static void markConcurrent(Obj* object) {
+    if (object == NULL || isYoung(object) || isMarkedAtomic(object)) return;
+    setMarkedAtomic(object);
+    pushMarker(object);
+}
+
+static void markValueConcurrent(Value value) {
+    if (IS_OBJ(value)) markConcurrent(AS_OBJ(value));
+}
+
+static void* markerMain(void* unused) {
+    double start = now();
+    while (markerCount > 0) {
+        Obj* object = markerStack[--markerCount];
+        switch (objType(object)) {
+            case OBJ_CLOSURE: {
+                ObjClosure* closure = (ObjClosure*)object;
+                markConcurrent((Obj*)__atomic_load_n(&closure->function, __ATOMIC_ACQUIRE));
+                for (int i = 0; i < closure->upvalueCount; i++) {
+                    markConcurrent((Obj*)__atomic_load_n(&closure->upvalues[i], __ATOMIC_ACQUIRE));
+                }
+                break;
+            }
+            case OBJ_FUNCTION: {
+                ObjFunction* function = (ObjFunction*)object;
+                markConcurrent((Obj*)__atomic_load_n(&function->name, __ATOMIC_ACQUIRE));
+                markConcurrent((Obj*)__atomic_load_n(&function->closure, __ATOMIC_ACQUIRE));
+                for (int i = 0; i < function->chunk.constants.count; i++) {
+                    markValueConcurrent(__atomic_load_n(&function->chunk.constants.values[i], __ATOMIC_ACQUIRE));
+                }
+                break;
+            }
+            case OBJ_UPVALUE:
+                markValueConcurrent(__atomic_load_n(&((ObjUpvalue*)object)->closed, __ATOMIC_ACQUIRE));
+                break;
+            case OBJ_SLICE:
+                //* Программа ссылку среза на буфер не меняет, но малая сборка переписывает её на копию
+                markConcurrent((Obj*)__atomic_load_n(&((ObjSlice*)object)->builder, __ATOMIC_ACQUIRE));
+                break;
+            case OBJ_NATIVE:
+            case OBJ_STRING:
+            case OBJ_BUILDER:
+                break;
+        }
+    }
+    vm.markerTime += now() - start;
+    __atomic_store_n(&markerDone, true, __ATOMIC_RELEASE);
+    return unused;
+}
+
+/*
+ * Начало параллельной пометки (пауза): корни и запомненное множество (старые объекты со ссылками
+ * в питомник) помечаются, молодые объекты снимка просматриваются здесь же, а старые серые уходят потоку
+ */
+static void beginConcurrentMarking() {
+    markRoots();
+    for (int i = 0; i < vm.rememberedCount; i++) {
+        blackenObject(vm.remembered[i]);
+    }
+    while (vm.grayCount > 0) {
+        Obj* object = vm.grayStack[--vm.grayCount];
+        if (isYoung(object)) {
+            blackenObject(object);
+        } else {
+            pushMarker(object);
+        }
+    }
+
+    markerDone = false;
+    vm.gcPhase = GC_CONCURRENT_MARKING;
+    //* Поток не запустился — помечаем здесь же, без параллельности
+    if (pthread_create(&marker, NULL, markerMain, NULL) != 0) {
+        markerMain(NULL);
+        marker = pthread_self();
+    }
+}
+#endif
+
+/*
+ * Заключительная пометка (пауза): дождаться потока и пометить то, что отложил барьер удаления.
+ * Корни заново не просматриваются: всё достижимое из них либо было в снимке, либо создано чёрным
+ */
+void finishConcurrentMarking() {
+#ifdef CONCURRENT_GC
+    if (vm.gcPhase != GC_CONCURRENT_MARKING) return;
+    double start = now();
+    bool wasCollecting = collecting;
+    collecting = true;
+    if (!pthread_equal(marker, pthread_self())) pthread_join(marker, NULL);
+    for (int i = 0; i < overwrittenCount; i++) {
+        markObject(overwritten[i]);
+    }
+    overwrittenCount = 0;
+    traceReferences();
+    beginSweep();
+    collecting = wasCollecting;
+    recordPause(start);
+#endif
+}
+
+//* Шаг параллельной сборки при выделении памяти: начать пометку или, когда поток закончил, завершить её
+static void concurrentStep() {
+#ifdef CONCURRENT_GC
+    if (vm.gcPhase == GC_IDLE) {
+        double start = now();
+        collecting = true;
+        beginConcurrentMarking();
+        collecting = false;
+        recordPause(start);
+    } else if (vm.gcPhase == GC_CONCURRENT_MARKING && __atomic_load_n(&markerDone, __ATOMIC_ACQUIRE)) {
+        finishConcurrentMarking();
+    }
+#else
+    incrementalStep();
+#endif
+}
+
+/*
+ * Полная сборка, пометка и очистка (mark-sweep), за одну паузу: от корней помечается всё достижимое
+ * в обоих поколениях, затем из vm.strings убираются непомеченные строки и освобождаются непомеченные
+ * старые объекты. Начатая инкрементальная сборка доводится до конца.
+ * Объекты не перемещаются, поэтому полная сборка возможна при любом выделении памяти.
+ * Мёртвые молодые объекты остаются в питомнике до малой сборки.
+ */
+void collectGarbage() {
+#ifdef DEBUG_LOG_GC
+    printf("-- gc begin\n");
+    size_t before = vm.bytesAllocated;
+#endif
+    finishConcurrentMarking();
+    double start = now();
+    collecting = true;
+
+    if (vm.gcPhase == GC_IDLE) beginCycle();
+    if (vm.gcPhase == GC_MARKING) finishMarking();
+    sweepStep(SIZE_MAX, DBL_MAX);
+    finishCycle();
+
+    collecting = false;
+    recordPause(start);
+
+#ifdef DEBUG_LOG_GC
+    printf("-- gc end\n");
+    printf("   collected %zu bytes (from %zu to %zu) next at %zu\n",
+           before - vm.bytesAllocated, before, vm.bytesAllocated, vm.nextGC);
+#endif
+}
+
+//* Идёт переписывание ссылок при уплотнении (compactHeap): forwardObject возвращает новые адреса
+static bool compacting = false;
+
+/*
+ * Переносит молодой объект в старую кучу (один раз: копия запоминается в его next)
+ * и возвращает его новый адрес. Ссылки копии просмотрит scanObject, когда дойдёт до неё очередь.
+ */
+Obj* forwardObject(Obj* object) {
+    //* Во время уплотнения новый адрес перемещаемого объекта уже записан в его next
+    if (compacting) return object != NULL && isMovable(objType(object)) ? objNext(object) : object;
+    if (object == NULL || !isYoung(object)) return object;
+    Obj* forwarded = objNext(object);
+    if (forwarded != NULL) return forwarded;
+
+    size_t size = objectSize(object);
+    Obj* copy = (Obj*)allocateOld(size, objType(object));
+    memcpy(copy, object, size);
+    setObjNext(copy, vm.objects);
+    vm.objects = copy;
+    //* Закрытое upvalue указывает на собственное поле closed
+    if (objType(object) == OBJ_UPVALUE) {
+        ObjUpvalue* upvalue = (ObjUpvalue*)object;
+        if (upvalue->location == &upvalue->closed) ((ObjUpvalue*)copy)->location = &((ObjUpvalue*)copy)->closed;
+    }
+    setObjNext(object, copy);
+    vm.promotedBytes += size;
+
+    //* Очередь ещё не просмотренных копий — тот же серый стек, что у полной сборки
+    if (vm.grayCapacity < vm.grayCount + 1) {
+        vm.grayCapacity = GROW_CAPACITY(vm.grayCapacity);
+        vm.grayStack = (Obj**)realloc(vm.grayStack, sizeof(Obj*) * vm.grayCapacity);
+        if (vm.grayStack == NULL) exit(1);
+    }
+    vm.grayStack[vm.grayCount++] = copy;
+    return copy;
+}
+
+Value forwardValue(Value value) {
+    if (IS_OBJ(value)) return OBJ_VAL(forwardObject(AS_OBJ(value)));
+    return value;
+}
+
+/*
+ * Малая сборка идёт и во время параллельной пометки: поток читает поля старых объектов, пока их
+ * переписывают на копии. Запись с release, а чтение потоком с acquire (на x86-64 и то и другое — обычный mov):
+ * получив адрес копии, поток видит её уже заполненной
+ */
+#ifdef CONCURRENT_GC
+#define FORWARD_FIELD(field) __atomic_store_n(&(field), (__typeof__(field))forwardObject((Obj*)(field)), __ATOMIC_RELEASE)
+#define FORWARD_VALUE(field) __atomic_store_n(&(field), forwardValue(field), __ATOMIC_RELEASE)
+#else
+#define FORWARD_FIELD(field) ((field) = (__typeof__(field))forwardObject((Obj*)(field)))
+#define FORWARD_VALUE(field) ((field) = forwardValue(field))
+#endif
+
+static void forwardArray(ValueArray* array) {
+    for (int i = 0; i < array->count; i++) {
+        FORWARD_VALUE(array->values[i]);
+    }
+}
+
+//* Переносит всё, на что ссылается старый объект (копия или запомненный)
+static void scanObject(Obj* object) {
+    switch (objType(object)) {
+        case OBJ_CLOSURE: {
+            ObjClosure* closure = (ObjClosure*)object;
+            FORWARD_FIELD(closure->function);
+            for (int i = 0; i < closure->upvalueCount; i++) {
+                FORWARD_FIELD(closure->upvalues[i]);
+            }
+            break;
+        }
+        case OBJ_FUNCTION: {
+            ObjFunction* function = (ObjFunction*)object;
+            FORWARD_FIELD(function->name);
+            FORWARD_FIELD(function->closure);
+            forwardArray(&function->chunk.constants);
             break;
-        case OBJ_STRING: {
-            ObjString* string = (ObjString*)object;
-            FREE_ARRAY(char, string->chars, string->length + 1);
-            FREE(ObjString, object);
+        }
+        case OBJ_UPVALUE:
+            FORWARD_VALUE(((ObjUpvalue*)object)->closed);
+            break;
+        case OBJ_SLICE: {
+            ObjSlice* slice = (ObjSlice*)object;
+            FORWARD_FIELD(slice->builder);
             break;
         }
-        case  OBJ_UPVALUE:
-        ObjClosure* closure = (ObjClosure*)object;
-        FREE_ARRAY(ObjUpvalue*, closure->upvalues, closure->upvalueCount);
-            FREE(ObjUpvalue, object);
+        case OBJ_NATIVE:
+        case OBJ_STRING:
+        case OBJ_BUILDER:
             break;
     }
 }
 
+//* Переписывает ссылки из стека, фреймов и глобальных переменных. Список открытых upvalue
+//* каждая сборка обходит сама: после переноса его продолжение лежит в копии, а при уплотнении — ещё на старом месте
+static void forwardRoots() {
+    for (Value* slot = vm.stack; slot < vm.stackTop; slot++) {
+        *slot = forwardValue(*slot);
+    }
+    for (CallFrame* frame = vm.frame; frame != NULL; frame = frame->previous) {
+        frame->closure = (ObjClosure*)forwardObject((Obj*)frame->closure);
+    }
+    forwardTable(&vm.globalSlots);
+    forwardArray(&vm.globalValues);
+    forwardArray(&vm.globalNames);
+}
+
+static void compactHeap();
+
+/*
+ * Малая сборка (копирующая, в духе Чейни): от корней и запомненного множества переносятся
+ * все достижимые молодые объекты, и ссылки на них переписываются на копии.
+ * Корни те же, что у полной сборки; функции компилятора в питомник не попадают (vm.pretenure).
+ * Мёртвым молодым объектам достаточно освободить их внешнюю память, после чего питомник пуст.
+ * Вызывать только в безопасной точке (safepoint): указатели на молодые объекты,
+ * которые держит код на C или машинный код вне корней, после сборки устаревают.
+ */
+void collectNursery() {
+#ifdef DEBUG_LOG_GC
+    printf("-- minor gc begin\n");
+    size_t before = vm.promotedBytes;
+#endif
+    double start = now();
+    collecting = true;
+
+    //* Серый стек инкрементальной пометки может ссылаться на молодые объекты; выше него — очередь переноса
+    int gray = vm.grayCount;
+    for (int i = 0; i < gray; i++) {
+        Obj* copy = forwardObject(vm.grayStack[i]); // forwardObject может перевыделить серый стек
+        vm.grayStack[i] = copy;
+    }
+
+    forwardRoots();
+    ObjUpvalue** link = &vm.openUpvalues;
+    while (*link != NULL) {
+        *link = (ObjUpvalue*)forwardObject((Obj*)*link);
+        link = &(*link)->next;
+    }
+
+    for (int i = 0; i < vm.rememberedCount; i++) {
+        scanObject(vm.remembered[i]);
+        setRemembered(vm.remembered[i], false);
+    }
+    vm.rememberedCount = 0;
+
+    while (vm.grayCount > gray) {
+        scanObject(vm.grayStack[--vm.grayCount]);
+    }
+    tableForwardWeak(&vm.strings);
+
+    for (char* cursor = vm.nursery; cursor < vm.nurseryTop;) {
+        Obj* object = (Obj*)cursor;
+        cursor += ALIGN(objectSize(object));
+        if (objNext(object) == NULL) freeObject(object);
+    }
+    vm.nurseryTop = vm.nursery;
+    vm.nurseryFull = false;
+    vm.minorCollections++;
+    collecting = false;
+    recordPause(start);
+
+#ifdef DEBUG_LOG_GC
+    printf("-- minor gc end\n");
+    printf("   promoted %zu bytes\n", vm.promotedBytes - before);
+#endif
+
+    //* Перенесённые объекты могли поднять старую кучу выше порога
+    collectIfNeeded();
+    //* Питомник пуст, так что на перемещаемые объекты ссылаются только корни и старая куча.
+    //* Пока идёт пометка, уплотнение откладывается: серый стек и поток пометки держат адреса объектов
+    if (vm.compactPending && vm.gcPhase == GC_IDLE) compactHeap();
+}
+
+//* Сначала объекты уплотняемой области в порядке адресов — их можно сдвигать на месте,
+//* за ними выделенные через reallocate, когда область была заполнена
+static int compareMovable(const void* a, const void* b) {
+    Obj* left = *(Obj* const*)a;
+    Obj* right = *(Obj* const*)b;
+    if (inCompactSpace(left) != inCompactSpace(right)) return inCompactSpace(left) ? -1 : 1;
+    return (uintptr_t)left < (uintptr_t)right ? -1 : (uintptr_t)left > (uintptr_t)right;
+}
+
+/*
+ * Уплотнение старой кучи (в духе Lisp 2). Живыми считаются объекты, пережившие последнюю очистку
+ * или перенесённые из питомника после неё. Перемещаемые объекты получают новые адреса подряд
+ * от начала области (адрес запоминается в next), затем ссылки на них переписываются forwardObject,
+ * пока объекты ещё на старых местах, и только после этого объекты сдвигаются. Список vm.objects собирается заново.
+ * Область растёт, если живые объекты в неё не помещаются, и сжимается, если они занимают меньше её четверти
+ */
+static void compactHeap() {
+#ifdef DEBUG_LOG_GC
+    printf("-- compact begin\n");
+#endif
+    //* Область переполнилась раньше, чем прошла сборка: сначала освобождаем мёртвые объекты, чтобы не переносить их
+    if (compactOverflow) collectGarbage();
+    double start = now();
+    collecting = true;
+
+    Obj* objects = NULL; // Неперемещаемые объекты, а после сдвига — все
+    Obj** movable = NULL;
+    int count = 0;
+    int capacity = 0;
+    size_t live = 0;
+    Obj* object = vm.objects;
+    while (object != NULL) {
+        Obj* next = objNext(object);
+        if (isMovable(objType(object))) {
+            if (capacity < count + 1) {
+                capacity = GROW_CAPACITY(capacity);
+                movable = (Obj**)realloc(movable, sizeof(Obj*) * capacity);
+                if (movable == NULL) exit(1);
+            }
+            movable[count++] = object;
+            live += ALIGN(objectSize(object));
+        } else {
+            setObjNext(object, objects);
+            objects = object;
+        }
+        object = next;
+    }
+    qsort(movable, count, sizeof(Obj*), compareMovable);
+
+    size_t size = vm.compactEnd - vm.compactSpace;
+    char* target = vm.compactSpace;
+    if (live > size || (size > COMPACT_SPACE_SIZE && live < size / 4)) {
+        size = live * 2 < COMPACT_SPACE_SIZE ? COMPACT_SPACE_SIZE : live * 2;
+        target = (char*)malloc(size);
+        if (target == NULL) exit(1);
+    }
+    char* top = target;
+    for (int i = 0; i < count; i++) {
+        setObjNext(movable[i], (Obj*)top);
+        top += ALIGN(objectSize(movable[i]));
+    }
+
+    compacting = true;
+    forwardRoots();
+    ObjUpvalue** link = &vm.openUpvalues;
+    while (*link != NULL) {
+        ObjUpvalue* upvalue = *link;
+        *link = (ObjUpvalue*)forwardObject((Obj*)upvalue);
+        link = &upvalue->next;
+    }
+    forwardTable(&vm.strings);
+    for (int i = 0; i < vm.rememberedCount; i++) {
+        vm.remembered[i] = forwardObject(vm.remembered[i]);
+    }
+    for (object = objects; object != NULL; object = objNext(object)) scanObject(object);
+    for (int i = 0; i < count; i++) scanObject(movable[i]);
+    compacting = false;
+
+    //* Новый адрес не выше старого, а объекты идут по возрастанию адресов: сдвиг не затирает ещё не сдвинутые
+    for (int i = 0; i < count; i++) {
+        object = movable[i];
+        Obj* copy = objNext(object);
+        size_t objectBytes = objectSize(object);
+        bool outside = !inCompactSpace(object);
+        memmove(copy, object, objectBytes);
+        //* Закрытое upvalue указывает на собственное поле closed
+        if (objType(copy) == OBJ_UPVALUE && ((ObjUpvalue*)copy)->location == &((ObjUpvalue*)object)->closed) {
+            ((ObjUpvalue*)copy)->location = &((ObjUpvalue*)copy)->closed;
+        }
+        setObjNext(copy, objects);
+        objects = copy;
+        if (outside) {
+            reallocate(object, objectBytes, 0);
+            vm.bytesAllocated += ALIGN(objectBytes);
+        }
+    }
+    free(movable);
+
+    if (target != vm.compactSpace) {
+        free(vm.compactSpace);
+        vm.compactSpace = target;
+        vm.compactEnd = target + size;
+    }
+    vm.compactTop = top;
+    vm.compactHoles = 0;
+    vm.objects = objects;
+    vm.compactPending = false;
+    vm.compactions++;
+#ifdef JIT
+    discardTraces();
+#endif
+    collecting = false;
+    recordPause(start);
+
+#ifdef DEBUG_LOG_GC
+    printf("-- compact end\n");
+    printf("   %zu live bytes in %zu byte space\n", live, size);
+#endif
+}
+
 void freeObjects() {
+    finishConcurrentMarking();
+    collecting = true;
+    sweepStep(SIZE_MAX, DBL_MAX);
     Obj* object = vm.objects;
     while (object != NULL) {
-        Obj* next = object->next;
+        Obj* next = objNext(object);
         freeObject(object);
         object = next;
     }
+    for (char* cursor = vm.nursery; cursor < vm.nurseryTop;) {
+        object = (Obj*)cursor;
+        cursor += ALIGN(objectSize(object));
+        freeObject(object);
+    }
+
+    free(vm.compactSpace);
+    free(vm.grayStack);
+    free(overwritten);
+#ifdef CONCURRENT_GC
+    free(markerStack);
+#endif
 }
\ No newline at end of file
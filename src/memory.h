@@ -4,6 +4,13 @@
 #include "common.h"
 #include "object.h"
 
+//* Сборка мусора запускается, когда выделенная память переходит порог vm.nextGC.
+//* После сборки порог ставится в GC_HEAP_GROW_FACTOR раз выше оставшейся живой кучи
+#ifndef GC_INITIAL_HEAP
+#define GC_INITIAL_HEAP (1024 * 1024)
+#endif
+#define GC_HEAP_GROW_FACTOR 2
+
 #define ALLOCATE(type, count) \
     (type*)reallocate(NULL, 0, sizeof(type) * (count))
 
@@ -18,7 +25,53 @@
 #define FREE_ARRAY(type, pointer, oldCount) \
     reallocate(pointer, sizeof(type) * (oldCount), 0)
 
+/*
+ * Арена: память выдаётся сдвигом указателя в крупных блоках и освобождается вся сразу (freeArena)
+ * или до отметки (arenaRelease), как стек. Последний выделенный в блоке массив растёт на месте,
+ * остальные копируются, а старая копия остаётся в арене до освобождения.
+ * Блоки берутся через reallocate и учитываются в vm.bytesAllocated
+ */
+#define ARENA_BLOCK_SIZE (64 * 1024)
+
+typedef struct ArenaBlock ArenaBlock;
+
+typedef struct Arena {
+    ArenaBlock* blocks; // Текущий блок, за ним — заполненные
+    ArenaBlock* spare; // Освобождённые arenaRelease блоки обычного размера, для повторного использования
+} Arena;
+
+//* Состояние арены, к которому её возвращает arenaRelease
+typedef struct {
+    ArenaBlock* block;
+    size_t used;
+} ArenaMark;
+
+#define ARENA_ALLOCATE(arena, type, count) \
+    (type*)arenaGrow(arena, NULL, 0, sizeof(type) * (count))
+
+#define ARENA_GROW_ARRAY(arena, type, pointer, oldCount, newCount) \
+    (type*)arenaGrow(arena, pointer, sizeof(type) * (oldCount), sizeof(type) * (newCount))
+
 void* reallocate(void* pointer, size_t oldSize, size_t newSize);
+void* arenaGrow(Arena* arena, void* pointer, size_t oldSize, size_t newSize);
+ArenaMark arenaMark(Arena* arena);
+void arenaRelease(Arena* arena, ArenaMark mark);
+void freeArena(Arena* arena);
+void initNursery();
+void freeNursery();
+void* allocateYoung(size_t size);
+void* allocateOld(size_t size, ObjType type);
+void markObject(Obj* object);
+void markValue(Value value);
+Obj* forwardObject(Obj* object);
+Value forwardValue(Value value);
+void collectGarbage();
+void heapLimitExceeded();
+void finishConcurrentMarking();
 void freeObjects();
+#ifdef SLAB_ALLOCATOR
+void printSlabStats();
+void freeSlabs();
+#endif
 
 #endif
\ No newline at end of file
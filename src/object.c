@@ -9,34 +9,64 @@
 #define ALLOCATE_OBJ(type, objectType) \
     (type*)allocateObject(sizeof(type), objectType)
 
+//* Новый объект выделяется в питомнике, а если там нет места — сразу в старой куче
 static Obj* allocateObject(size_t size, ObjType type) {
-    Obj* object = (Obj*)reallocate(NULL, 0, size);
-    object->type = type;
-    // Добавляем объект в начало списка
-    object-> next = vm.objects; 
-    vm.objects = object;
+    if (vm.bytesAllocated > vm.heapLimit) heapLimitExceeded();
+    Obj* object = (Obj*)allocateYoung(size);
+    Obj* next = NULL;
+    if (object == NULL) {
+        object = (Obj*)allocateOld(size, type);
+        // Добавляем объект в начало списка
+        next = vm.objects;
+        vm.objects = object;
+    }
+    //* Во время инкрементальной пометки новый объект сразу чёрный: в этом цикле он выживает.
+    //* Фаза читается после выделения: оно само могло сделать шаг сборки
+    initObjHeader(object, type, next, vm.gcPhase == GC_MARKING || vm.gcPhase == GC_CONCURRENT_MARKING);
 
     return object;
 }
 
+/*
+ * Замыкание вместе с массивом upvalue — одно выделение.
+ * Функции без upvalue различать нечего, поэтому все OP_CLOSURE такой функции
+ * возвращают одно и то же замыкание, сохранённое в function->closure
+ */
 ObjClosure* newClosure(ObjFunction* function) {
-    ObjUpvalue** upvalues = ALLOCATE(ObjUpvalue*, function->upvalueCount);
-    for (int i = 0; i < function->upvalueCount; i++) {
-        upvalues[i] = NULL;
-    }
-    ObjClosure* closure = ALLOCATE_OBJ(ObjClosure, OBJ_CLOSURE);
+    if (function->closure != NULL) return function->closure;
+
+    int upvalueCount = function->upvalueCount;
+    ObjClosure* closure = (ObjClosure*)allocateObject(
+        sizeof(ObjClosure) + sizeof(ObjUpvalue*) * upvalueCount, OBJ_CLOSURE);
     closure->function = function;
-    closure->upvalues = upvalues;
-    closure->upvalueCount = function->upvalueCount;
+    closure->upvalueCount = upvalueCount;
+    for (int i = 0; i < upvalueCount; i++) {
+        closure->upvalues[i] = NULL;
+    }
+    if (upvalueCount == 0) {
+        function->closure = closure;
+        writeBarrier((Obj*)function, OBJ_VAL((Obj*)closure));
+    }
     return closure;
 }
 
-static ObjString* allocateString(char* chars, int length, uint32_t hash) {
-    ObjString* string = ALLOCATE_OBJ(ObjString, OBJ_STRING);
+//* Строка длины length одним объектом: символы заполняет вызывающий.
+//* Пока строку не передали в internString, она не интернирована
+ObjString* newString(int length) {
+    ObjString* string = (ObjString*)allocateObject(STRING_SIZE(length), OBJ_STRING);
     string->length = length;
-    string->chars = chars;
-    string->hash = hash;
+    string->hash = 0;
+    string->isInterned = false;
+    string->chars[length] = '\0';
+    return string;
+}
+
+static ObjString* registerString(ObjString* string) {
+    //* Таблица интернирования может вырасти и запустить сборку мусора, а в ней строка — слабая ссылка
+    push(OBJ_VAL((Obj*)string));
     tableSet(&vm.strings, string, NIL_VAL);
+    pop();
+    string->isInterned = true;
     return string;
 }
 
@@ -45,7 +75,16 @@ ObjFunction* newFunction() {
     function->arity = 0;
     function->upvalueCount = 0;
     function->name = NULL;
+    function->closure = NULL;
     initChunk(&function->chunk);
+    initChunk(&function->registerChunk);
+    function->stackSlots = 0;
+    function->registerCount = 0;
+#ifdef JIT
+    function->calls = 0;
+    function->jitCode = NULL;
+    function->jitSize = 0;
+#endif
     return function;
 }
 
@@ -55,6 +94,50 @@ ObjNative* newNative(NativeFn function) {
     return native;
 }
 
+#ifdef WORD_HASH
+static inline uint64_t mixWord(uint64_t hash, uint64_t word) {
+    hash = (hash ^ word) * 0x9e3779b97f4a7c15u;
+    return hash ^ (hash >> 32);
+}
+
+static inline uint64_t readWord(const char* bytes) {
+    uint64_t word;
+    memcpy(&word, bytes, 8);
+    return word;
+}
+
+static inline uint64_t readHalf(const char* bytes) {
+    uint32_t half;
+    memcpy(&half, bytes, 4);
+    return half;
+}
+
+/*
+ * Ключ читается словами по 8 байт. Хвост длинного ключа — последние 8 байт (с перекрытием),
+ * короткий ключ собирается из двух 4-байтовых или трёх однобайтовых чтений (как в wyhash),
+ * так что ни одного побайтового цикла и вызова memcpy переменной длины. Длина входит в начальное значение.
+ * Каждое слово перемешивается умножением, а в конце биты перемешиваются ещё раз (fmix64 из MurmurHash3):
+ * таблица берёт управляющий байт из 7 младших битов хэша, а группу — из следующих, так что важны все
+ */
+static uint32_t hashString(const char* key, int length) {
+    uint64_t hash = 0xcbf29ce484222325u ^ (uint64_t)length;
+    if (length >= 8) {
+        int i = 0;
+        for (; i + 8 < length; i += 8) hash = mixWord(hash, readWord(key + i));
+        hash = mixWord(hash, readWord(key + length - 8));
+    } else if (length >= 4) {
+        hash = mixWord(hash, readHalf(key) | readHalf(key + length - 4) << 32);
+    } else if (length > 0) {
+        uint64_t word = (uint64_t)(uint8_t)key[0] << 16 | (uint64_t)(uint8_t)key[length >> 1] << 8 |
+                        (uint8_t)key[length - 1];
+        hash = mixWord(hash, word);
+    }
+    hash ^= hash >> 33;
+    hash *= 0xff51afd7ed558ccdu;
+    hash ^= hash >> 33;
+    return (uint32_t)hash;
+}
+#else
 static uint32_t hashString(const char* key, int length) {
     /* Алгоритм FNV-1a */
     uint32_t hash = 2166136261u;
@@ -64,31 +147,25 @@ static uint32_t hashString(const char* key, int length) {
     }
     return hash;
 }
+#endif
 
-ObjString* takeString(char* chars, int length) {
-    //
-    uint32_t hash = hashString(chars, length);
-
-    // Проверка, существует ли такая строка в таблице strings
-    // Если да, то освобождается только что выделенный массив и возвращает существующую
-    ObjString* interned = tableFindString(&vm.strings, chars, length, hash);
-    if (interned != NULL) {
-        FREE_ARRAY(char, chars, length + 1);
-        return interned;
-    }
-
-    return allocateString(chars, length, hash);
+//* Готовая строка из newString: возвращается она сама или равная ей, уже интернированная.
+//* Во втором случае новый объект ни на что не ссылается и достанется сборщику мусора
+ObjString* internString(ObjString* string) {
+    string->hash = hashString(string->chars, string->length);
+    ObjString* interned = tableFindString(&vm.strings, string->chars, string->length, string->hash);
+    if (interned != NULL) return interned;
+    return registerString(string);
 }
 
 ObjString* copyString(const char* chars, int length) {
-    // 
     uint32_t hash = hashString(chars, length);
     ObjString* interned = tableFindString(&vm.strings, chars, length, hash); // Проверка, существует ли такая строка в таблице
     if (interned != NULL) return interned;
-    char* heapChars = ALLOCATE(char, length + 1);
-    memcpy(heapChars, chars, length);
-    heapChars[length] = '\0';
-    return allocateString(heapChars, length, hash);
+    ObjString* string = newString(length);
+    memcpy(string->chars, chars, length);
+    string->hash = hash;
+    return registerString(string);
 }
 
 ObjUpvalue* newUpvalue(Value* slot) {
@@ -99,6 +176,23 @@ ObjUpvalue* newUpvalue(Value* slot) {
     return upvalue;
 }
 
+//* Пустой буфер построителя на capacity символов. Сам по себе он ничего не держит
+ObjBuilder* newBuilder(int capacity) {
+    ObjBuilder* builder = (ObjBuilder*)allocateObject(sizeof(ObjBuilder) + capacity, OBJ_BUILDER);
+    builder->length = 0;
+    builder->capacity = capacity;
+    return builder;
+}
+
+//* builder должен быть достижим для сборщика мусора: выделение среза может запустить сборку
+ObjSlice* newSlice(ObjBuilder* builder, int length) {
+    ObjSlice* slice = ALLOCATE_OBJ(ObjSlice, OBJ_SLICE);
+    slice->length = length;
+    slice->builder = builder;
+    writeBarrier((Obj*)slice, OBJ_VAL((Obj*)builder));
+    return slice;
+}
+
 static void printFunction(ObjFunction* function) {
     if (function->name == NULL) {
         printf("<script>");
@@ -124,5 +218,11 @@ void printObject(Value value) {
         case OBJ_UPVALUE:
             printf("upvalue");
             break;
+        case OBJ_BUILDER:
+            printf("builder");
+            break;
+        case OBJ_SLICE:
+            printf("%.*s", AS_SLICE(value)->length, AS_SLICE(value)->builder->chars);
+            break;
     }
 }
\ No newline at end of file
@@ -5,38 +5,193 @@
 #include "chunk.h"
 #include "value.h"
 
-#define OBJ_TYPE(value) (AS_OBJ(value)->type)
+#define OBJ_TYPE(value) objType(AS_OBJ(value))
 
 #define IS_CLOSURE(value) isObjType(value, OBJ_CLOSURE)
 #define IS_FUNCTION(value) isObjType(value, OBJ_FUNCTION)
 #define IS_NATIVE(value) isObjType(value, OBJ_NATIVE)
-#define IS_STRING(value) isObjType(value, OBJ_STRING)
+#define IS_STRING(value) isString(value)
 
 #define AS_CLOSURE(value) ((ObjClosure*)AS_OBJ(value))
 #define AS_FUNCTION(value) ((ObjFunction*)AS_OBJ(value))
 #define AS_NATIVE(value) (((ObjNative*)AS_OBJ(value))->function)
 #define AS_STRING(value) ((ObjString*)AS_OBJ(value))
 #define AS_CSTRING(value) (((ObjString*)AS_OBJ(value))->chars)
+#define AS_SLICE(value) ((ObjSlice*)AS_OBJ(value))
 
 typedef enum {
     OBJ_CLOSURE,
     OBJ_FUNCTION,
     OBJ_NATIVE,
     OBJ_STRING,
-    OBJ_UPVALUE
+    OBJ_UPVALUE,
+    OBJ_BUILDER,
+    OBJ_SLICE
 } ObjType;
 
+/*
+ * Заголовок объекта. Поля читаются и пишутся только через функции ниже (objType, objNext, isMarked...).
+ * next — следующий объект старой кучи. У молодого объекта NULL, а после переноса — его копия в старой куче.
+ * isMarked — достижим из корней (выставляется фазой пометки сборщика мусора).
+ * isRemembered — старый объект ссылается на молодые и записан в vm.remembered
+ */
+#ifdef COMPACT_HEADER
+//* Одно слово: младшие 48 бит — next, выше — тип и биты сборщика. Мелкие объекты (ObjUpvalue, ObjNative)
+//* становятся на 8 байт меньше
+struct Obj {
+    uint64_t header;
+};
+
+#define HEADER_NEXT ((UINT64_C(1) << 48) - 1)
+#define HEADER_TYPE_SHIFT 48
+#define HEADER_MARKED (UINT64_C(1) << 56)
+#define HEADER_REMEMBERED (UINT64_C(1) << 57)
+
+/*
+ * Поток пометки (clox --concurrent) выставляет бит пометки, пока программа работает, поэтому в сборке
+ * с CONCURRENT_GC слово читается и пишется только атомарными операциями (relaxed: на x86-64 это обычные mov).
+ * next и пометку программа меняет, только пока поток не работает, или у объектов, которых он не видит
+ * (новых и молодых), так что хватает загрузки и записи. isRemembered меняется и во время параллельной пометки,
+ * у любых старых объектов: он выставляется атомарным read-modify-write, чтобы не затереть бит потока
+ */
+#ifdef CONCURRENT_GC
+static inline uint64_t loadHeader(Obj* object) {
+    return __atomic_load_n(&object->header, __ATOMIC_RELAXED);
+}
+
+static inline void storeHeader(Obj* object, uint64_t header) {
+    __atomic_store_n(&object->header, header, __ATOMIC_RELAXED);
+}
+
+static inline void setRemembered(Obj* object, bool remembered) {
+    if (remembered) {
+        __atomic_fetch_or(&object->header, HEADER_REMEMBERED, __ATOMIC_RELAXED);
+    } else {
+        __atomic_fetch_and(&object->header, ~HEADER_REMEMBERED, __ATOMIC_RELAXED);
+    }
+}
+
+static inline void setMarkedAtomic(Obj* object) {
+    __atomic_fetch_or(&object->header, HEADER_MARKED, __ATOMIC_RELAXED);
+}
+#else
+static inline uint64_t loadHeader(Obj* object) {
+    return object->header;
+}
+
+static inline void storeHeader(Obj* object, uint64_t header) {
+    object->header = header;
+}
+
+static inline void setRemembered(Obj* object, bool remembered) {
+    object->header = remembered ? object->header | HEADER_REMEMBERED : object->header & ~HEADER_REMEMBERED;
+}
+
+static inline void setMarkedAtomic(Obj* object) {
+    object->header |= HEADER_MARKED;
+}
+#endif
+
+static inline ObjType objType(Obj* object) {
+    return (ObjType)((loadHeader(object) >> HEADER_TYPE_SHIFT) & 0xff);
+}
+
+static inline Obj* objNext(Obj* object) {
+    return (Obj*)(uintptr_t)(loadHeader(object) & HEADER_NEXT);
+}
+
+static inline void setObjNext(Obj* object, Obj* next) {
+    storeHeader(object, (loadHeader(object) & ~HEADER_NEXT) | (uint64_t)(uintptr_t)next);
+}
+
+static inline bool isMarked(Obj* object) {
+    return (loadHeader(object) & HEADER_MARKED) != 0;
+}
+
+static inline void setMarked(Obj* object, bool marked) {
+    uint64_t header = loadHeader(object);
+    storeHeader(object, marked ? header | HEADER_MARKED : header & ~HEADER_MARKED);
+}
+
+static inline bool isRemembered(Obj* object) {
+    return (loadHeader(object) & HEADER_REMEMBERED) != 0;
+}
+
+//* Пометка из потока параллельной пометки
+static inline bool isMarkedAtomic(Obj* object) {
+    return isMarked(object);
+}
+
+static inline void initObjHeader(Obj* object, ObjType type, Obj* next, bool marked) {
+    storeHeader(object, (uint64_t)(uintptr_t)next | (uint64_t)type << HEADER_TYPE_SHIFT | (marked ? HEADER_MARKED : 0));
+}
+#else
 struct Obj {
     ObjType type;
+    bool isMarked;
+    bool isRemembered;
     struct Obj* next;
 };
 
+static inline ObjType objType(Obj* object) {
+    return object->type;
+}
+
+static inline Obj* objNext(Obj* object) {
+    return object->next;
+}
+
+static inline void setObjNext(Obj* object, Obj* next) {
+    object->next = next;
+}
+
+static inline bool isMarked(Obj* object) {
+    return object->isMarked;
+}
+
+static inline void setMarked(Obj* object, bool marked) {
+    object->isMarked = marked;
+}
+
+static inline bool isRemembered(Obj* object) {
+    return object->isRemembered;
+}
+
+static inline void setRemembered(Obj* object, bool remembered) {
+    object->isRemembered = remembered;
+}
+
+static inline bool isMarkedAtomic(Obj* object) {
+    return __atomic_load_n(&object->isMarked, __ATOMIC_RELAXED);
+}
+
+static inline void setMarkedAtomic(Obj* object) {
+    __atomic_store_n(&object->isMarked, true, __ATOMIC_RELAXED);
+}
+
+static inline void initObjHeader(Obj* object, ObjType type, Obj* next, bool marked) {
+    object->type = type;
+    object->isMarked = marked;
+    object->isRemembered = false;
+    object->next = next;
+}
+#endif
+
 //* у каждой функции есть свой Chunk
 typedef struct {
     Obj obj;
     int arity; //* Количество параметров
     int upvalueCount; //* Количество восходящих значений
     Chunk chunk;
+    int stackSlots; //* Наибольшая глубина стека во фрейме функции (вместе со слотом 0 и параметрами)
+    Chunk registerChunk; //* Регистровый код (--register), константы берутся из chunk
+    int registerCount; //* Сколько регистров занимает фрейм в регистровой машине
+#ifdef JIT
+    int calls; //* Счётчик вызовов до порога JIT_THRESHOLD
+    void* jitCode; //* Машинный код функции (JitCode) или NULL
+    size_t jitSize; //* Размер отображённой под машинный код памяти
+#endif
+    struct ObjClosure* closure; //* Общее замыкание функции без upvalue (создаётся при первом OP_CLOSURE)
     ObjString* name;    //* Имя
 } ObjFunction; //* Объект-функция
 
@@ -50,10 +205,33 @@ typedef struct {
 struct ObjString {
     Obj obj;
     int length;
-    char* chars;
     uint32_t hash; // Поле хэша
+    bool isInterned; //* Строка записана в vm.strings; у неинтернированной хэш не вычислен
+    char chars[]; //* Символы лежат в самом объекте, за ними — завершающий '\0'
 };
 
+//* Размер строки без выравнивания sizeof(ObjString): символы начинаются сразу за isInterned
+#define STRING_SIZE(length) (offsetof(ObjString, chars) + (length) + 1)
+
+/*
+ * Буфер построителя строк для цепочек вида s = s + piece (см. concatenate).
+ * Это не значение Lox: на него ссылаются только срезы. Символы до length уже не меняются,
+ * дописывать можно только в хвост, поэтому все срезы одного буфера видят неизменные строки
+ */
+typedef struct {
+    Obj obj;
+    int length; //* Сколько символов уже записано
+    int capacity;
+    char chars[];
+} ObjBuilder;
+
+//* Строка-срез: первые length символов буфера. Для Lox это обычная строка, но не интернированная
+typedef struct {
+    Obj obj;
+    int length;
+    ObjBuilder* builder;
+} ObjSlice;
+
 /*
     * структура upvalue во время выполнения представляет собой ObjUpvalue с типичным полем заголовка Obj.
 
@@ -71,23 +249,44 @@ typedef struct ObjUpvalue {
  * Последняя содержит ссылку на базовую функцию, а также состояние переменных во время выполнения, на которые ссылается функция.
  * даже если функция на самом деле не замыкается и не захватывает окружающие локальные переменные.
 */
-typedef struct {
+typedef struct ObjClosure {
     Obj obj;
     ObjFunction* function;
-    ObjUpvalue** upvalues;
     int upvalueCount;
+    ObjUpvalue* upvalues[]; //* Массив upvalue лежит в самом объекте
 } ObjClosure;
 
 ObjClosure* newClosure(ObjFunction* function);
 ObjFunction* newFunction();
 ObjNative* newNative(NativeFn function);
-ObjString* takeString(char* chars, int length);
+ObjString* newString(int length);
+ObjString* internString(ObjString* string);
 ObjString* copyString(const char* chars, int length);
 ObjUpvalue* newUpvalue(Value* slot);
+ObjBuilder* newBuilder(int capacity);
+ObjSlice* newSlice(ObjBuilder* builder, int length);
 void printObject(Value value);
 
 static inline bool isObjType(Value value, ObjType type) {
-    return IS_OBJ(value) && AS_OBJ(value)->type == type;
+    return IS_OBJ(value) && objType(AS_OBJ(value)) == type;
+}
+
+//* Строка Lox — ObjString (интернированная или нет) или срез построителя ObjSlice
+static inline bool isString(Value value) {
+    return IS_OBJ(value) && (objType(AS_OBJ(value)) == OBJ_STRING || objType(AS_OBJ(value)) == OBJ_SLICE);
+}
+
+static inline const char* stringChars(Obj* string) {
+    return objType(string) == OBJ_STRING ? ((ObjString*)string)->chars : ((ObjSlice*)string)->builder->chars;
+}
+
+static inline int stringLength(Obj* string) {
+    return objType(string) == OBJ_STRING ? ((ObjString*)string)->length : ((ObjSlice*)string)->length;
+}
+
+//* Равные интернированные строки — один и тот же объект
+static inline bool isInterned(Obj* string) {
+    return objType(string) == OBJ_STRING && ((ObjString*)string)->isInterned;
 }
 
 #endif
\ No newline at end of file
@@ -0,0 +1,102 @@
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "debug.h"
+#include "profile.h"
+
+#ifdef PROFILE_OPCODES
+
+#define NGRAM_TABLE_SIZE (1 << 16)
+#define NGRAM_TOP 12
+
+typedef struct {
+    uint64_t key; // Длина n-граммы в старших битах, опкоды — по байту в младших. 0 — пустая ячейка
+    uint64_t count;
+} NGram;
+
+static NGram ngrams[NGRAM_TABLE_SIZE];
+static uint64_t totalInstructions = 0;
+
+// Последние выполненные инструкции текущей прямой последовательности
+static uint8_t history[PROFILE_MAX_NGRAM];
+static int historyCount = 0;
+static Chunk* lastChunk = NULL;
+static uint8_t* expectedIp = NULL; // Где начнётся следующая инструкция, если не было перехода
+
+static void countNGram(uint64_t key) {
+    uint32_t index = (uint32_t)((key * 0x9E3779B97F4A7C15u) >> 48) & (NGRAM_TABLE_SIZE - 1);
+    for (;;) {
+        NGram* ngram = &ngrams[index];
+        if (ngram->key == key) {
+            ngram->count++;
+            return;
+        }
+        if (ngram->key == 0) {
+            ngram->key = key;
+            ngram->count = 1;
+            return;
+        }
+        index = (index + 1) & (NGRAM_TABLE_SIZE - 1);
+    }
+}
+
+/*
+ * Вызывается перед выполнением каждой инструкции.
+ * Цепочка обрывается, если инструкция не идёт в байт-коде сразу за предыдущей
+ * (был переход, вызов или возврат): слить в одну суперинструкцию можно только соседей.
+ */
+void profileInstruction(Chunk* chunk, uint8_t* ip) {
+    totalInstructions++;
+    if (chunk != lastChunk || ip != expectedIp) historyCount = 0;
+    lastChunk = chunk;
+    expectedIp = ip + instructionLength(chunk, (int)(ip - chunk->code));
+
+    if (historyCount == PROFILE_MAX_NGRAM) {
+        for (int i = 1; i < PROFILE_MAX_NGRAM; i++) history[i - 1] = history[i];
+        historyCount--;
+    }
+    //* Ускоренные варианты считаем как исходную инструкцию, которую выдал компилятор: суперинструкции строятся из неё
+    history[historyCount++] = genericOpcode(*ip);
+
+    // Все n-граммы, которые заканчиваются на текущей инструкции
+    for (int n = 2; n <= historyCount; n++) {
+        uint32_t opcodes = 0;
+        for (int i = historyCount - n; i < historyCount; i++) {
+            opcodes = (opcodes << 8) | history[i];
+        }
+        countNGram(((uint64_t)n << 32) | opcodes);
+    }
+}
+
+static int compareByCount(const void* a, const void* b) {
+    const NGram* left = (const NGram*)a;
+    const NGram* right = (const NGram*)b;
+    if (left->count != right->count) return left->count < right->count ? 1 : -1;
+    return 0;
+}
+
+void printOpcodeProfile() {
+    static NGram sorted[NGRAM_TABLE_SIZE];
+    fprintf(stderr, "== opcode profile: %llu instructions ==\n", (unsigned long long)totalInstructions);
+    if (totalInstructions == 0) return;
+
+    for (int n = 2; n <= PROFILE_MAX_NGRAM; n++) {
+        int count = 0;
+        for (int i = 0; i < NGRAM_TABLE_SIZE; i++) {
+            if (ngrams[i].key >> 32 == (uint64_t)n) sorted[count++] = ngrams[i];
+        }
+        qsort(sorted, count, sizeof(NGram), compareByCount);
+
+        fprintf(stderr, "-- top %d-grams --\n", n);
+        for (int i = 0; i < count && i < NGRAM_TOP; i++) {
+            fprintf(stderr, "%12llu %5.1f%% ", (unsigned long long)sorted[i].count,
+                100.0 * (double)sorted[i].count / (double)totalInstructions);
+            for (int j = n - 1; j >= 0; j--) {
+                fprintf(stderr, " %s", opcodeName((uint8_t)(sorted[i].key >> (j * 8))));
+            }
+            fprintf(stderr, "\n");
+        }
+    }
+}
+
+#endif
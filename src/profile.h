@@ -0,0 +1,17 @@
+#ifndef clox_profile_h
+#define clox_profile_h
+
+#include "chunk.h"
+
+/*
+ * Профилировщик последовательностей опкодов (n-грамм).
+ * Собирается только с -DPROFILE_OPCODES (make profile): считает, какие цепочки
+ * из 2..PROFILE_MAX_NGRAM инструкций, идущих в байт-коде подряд, чаще всего выполняются.
+ * По этим данным выбираются суперинструкции.
+ */
+#define PROFILE_MAX_NGRAM 4
+
+void profileInstruction(Chunk* chunk, uint8_t* ip);
+void printOpcodeProfile();
+
+#endif
@@ -0,0 +1,59 @@
+#ifndef clox_regchunk_h
+#define clox_regchunk_h
+
+#include "chunk.h"
+#include "object.h"
+
+/*
+ * Регистровый набор инструкций (clox --register).
+ * Инструкции адресуют слоты фрейма напрямую: регистр N — это frame->slots[N].
+ * Локальные переменные живут в тех же слотах, что и в стековой машине,
+ * а временные значения — в слотах над ними, поэтому upvalue захватываются так же.
+ * Операнды: A, B, C — номера регистров (байт), k — индекс в пуле констант функции,
+ * g — 16-битный слот глобальной переменной, off — 16-битное смещение перехода.
+ */
+typedef enum {
+    ROP_MOVE, // A B: R[A] = R[B]
+    ROP_LOAD_CONSTANT, // A k: R[A] = K[k]
+    ROP_LOAD_NIL, // A: R[A] = nil
+    ROP_LOAD_TRUE, // A: R[A] = true
+    ROP_LOAD_FALSE, // A: R[A] = false
+    ROP_GET_GLOBAL, // A g: R[A] = G[g]
+    ROP_DEFINE_GLOBAL, // A g: G[g] = R[A]
+    ROP_SET_GLOBAL, // A g: G[g] = R[A], если G[g] определена
+    ROP_GET_UPVALUE, // A u: R[A] = U[u]
+    ROP_SET_UPVALUE, // A u: U[u] = R[A]
+    ROP_EQUAL, // A B C: R[A] = R[B] == R[C]
+    ROP_GREATER, // A B C: R[A] = R[B] > R[C]
+    ROP_LESS, // A B C: R[A] = R[B] < R[C]
+    ROP_ADD, // A B C: R[A] = R[B] + R[C]
+    ROP_SUBTRACT, // A B C: R[A] = R[B] - R[C]
+    ROP_MULTIPLY, // A B C: R[A] = R[B] * R[C]
+    ROP_DIVIDE, // A B C: R[A] = R[B] / R[C]
+    ROP_EQUAL_CONSTANT, // A B k: R[A] = R[B] == K[k]
+    ROP_GREATER_CONSTANT, // A B k: R[A] = R[B] > K[k]
+    ROP_LESS_CONSTANT, // A B k: R[A] = R[B] < K[k]
+    ROP_ADD_CONSTANT, // A B k: R[A] = R[B] + K[k]
+    ROP_SUBTRACT_CONSTANT, // A B k: R[A] = R[B] - K[k]
+    ROP_MULTIPLY_CONSTANT, // A B k: R[A] = R[B] * K[k]
+    ROP_DIVIDE_CONSTANT, // A B k: R[A] = R[B] / K[k]
+    ROP_NOT, // A B: R[A] = !R[B]
+    ROP_NEGATE, // A B: R[A] = -R[B]
+    ROP_PRINT, // A
+    ROP_JUMP, // off: вперёд
+    ROP_JUMP_IF_FALSE, // A off: вперёд, если R[A] ложно
+    ROP_JUMP_IF_NOT_LESS, // A B off: вперёд, если !(R[A] < R[B])
+    ROP_JUMP_IF_NOT_LESS_CONSTANT, // A k off: вперёд, если !(R[A] < K[k])
+    ROP_JUMP_IF_NOT_GREATER, // A B off: вперёд, если !(R[A] > R[B])
+    ROP_JUMP_IF_NOT_GREATER_CONSTANT, // A k off: вперёд, если !(R[A] > K[k])
+    ROP_LOOP, // off: назад
+    ROP_CALL, // A n: R[A] = R[A](R[A+1], ..., R[A+n])
+    ROP_TAIL_CALL, // A n: как ROP_CALL, но вызываемая функция занимает текущий фрейм
+    ROP_CLOSURE, // A k, затем по паре байтов (isLocal, index) на каждый upvalue
+    ROP_CLOSE_UPVALUE, // A: закрыть upvalue, указывающие на R[A] и выше
+    ROP_RETURN, // A: вернуть R[A]
+} RegOpCode;
+
+bool compileRegisters(ObjFunction* function);
+
+#endif
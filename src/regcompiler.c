@@ -0,0 +1,480 @@
+#include <stdlib.h>
+
+#include "common.h"
+#include "memory.h"
+#include "regchunk.h"
+
+/*
+ * Второй бэкенд компилятора: переводит стековый байт-код функции, выданный парсером,
+ * в регистровые инструкции (regchunk.h). Запускается из endCompiler до слияния суперинструкций.
+ *
+ * Глубина стека в каждой точке байт-кода известна статически, поэтому ячейка стека N
+ * становится регистром N. Операнды на стеке при этом отложенные: GET_LOCAL, CONSTANT, NIL и т. п.
+ * ничего не выдают, а лишь запоминают, где лежит значение, и следующая инструкция читает его
+ * прямо из регистра локальной переменной или из пула констант.
+ * Отложенное значение материализуется в свой регистр, только когда иначе нельзя:
+ * на границах базовых блоков, перед вызовом и перед записью в регистр, из которого оно читается.
+ */
+
+#define MAX_REGISTERS UINT8_COUNT
+
+typedef enum {
+    OPERAND_HOME, // значение уже лежит в регистре, совпадающем с ячейкой стека
+    OPERAND_REGISTER, // значение — копия регистра index (локальной переменной)
+    OPERAND_CONSTANT, // значение — константа index
+    OPERAND_NIL,
+    OPERAND_TRUE,
+    OPERAND_FALSE,
+} OperandKind;
+
+typedef struct {
+    OperandKind kind;
+    int index;
+} Operand;
+
+typedef struct {
+    int offset; // Смещение 16-битного операнда перехода в регистровом коде
+    int target; // Смещение цели перехода в стековом коде
+} ForwardJump;
+
+typedef struct {
+    Chunk* source; // Стековый код
+    Chunk* code; // Регистровый код
+    Operand operands[MAX_REGISTERS];
+    int depth; // Текущая глубина стека = число занятых регистров
+    int maxDepth;
+    int line; // Строка исходной инструкции, которую сейчас переводим
+    bool reachable; // false после безусловного перехода, пока не встретится цель перехода
+    bool* isTarget; // По смещению в стековом коде: сюда ведёт какой-либо переход
+    int* targetDepth; // Глубина стека на цели перехода, -1 — ещё неизвестна
+    int* targetOffset; // Смещение цели перехода в регистровом коде
+    ForwardJump* jumps; // Переходы вперёд, чьи смещения ещё не известны
+    int jumpCount;
+    int jumpCapacity;
+    //* Последняя выданная инструкция, результат которой лежит в регистре lastResult (операнд A).
+    //* SET_LOCAL сразу за ней перенаправляет результат в регистр переменной вместо MOVE
+    int lastResult;
+    int lastResultOffset;
+    bool hadError;
+} RegisterCompiler;
+
+static void emitByte(RegisterCompiler* compiler, uint8_t byte) {
+    writeChunk(compiler->code, byte, compiler->line);
+}
+
+static void emitBytes(RegisterCompiler* compiler, uint8_t byte1, uint8_t byte2) {
+    emitByte(compiler, byte1);
+    emitByte(compiler, byte2);
+}
+
+static void emitShort(RegisterCompiler* compiler, uint16_t value) {
+    emitBytes(compiler, (uint8_t)((value >> 8) & 0xff), (uint8_t)(value & 0xff));
+}
+
+static void emitOp(RegisterCompiler* compiler, uint8_t op) {
+    compiler->lastResultOffset = -1;
+    emitByte(compiler, op);
+}
+
+//* Выдаёт инструкцию с регистром-приёмником A и запоминает её для SET_LOCAL
+static void emitResult(RegisterCompiler* compiler, uint8_t op, int dest) {
+    compiler->lastResultOffset = compiler->code->count;
+    emitBytes(compiler, op, (uint8_t)dest);
+    compiler->lastResult = dest;
+}
+
+static void materialize(RegisterCompiler* compiler, int position) {
+    Operand* operand = &compiler->operands[position];
+    switch (operand->kind) {
+        case OPERAND_HOME:
+            return;
+        case OPERAND_REGISTER:
+            if (operand->index == position) break;
+            emitResult(compiler, ROP_MOVE, position);
+            emitByte(compiler, (uint8_t)operand->index);
+            break;
+        case OPERAND_CONSTANT:
+            emitResult(compiler, ROP_LOAD_CONSTANT, position);
+            emitByte(compiler, (uint8_t)operand->index);
+            break;
+        case OPERAND_NIL: emitResult(compiler, ROP_LOAD_NIL, position); break;
+        case OPERAND_TRUE: emitResult(compiler, ROP_LOAD_TRUE, position); break;
+        case OPERAND_FALSE: emitResult(compiler, ROP_LOAD_FALSE, position); break;
+    }
+    operand->kind = OPERAND_HOME;
+}
+
+//* Материализует все ячейки стека: на границе базового блока состояние должно быть одинаковым на всех путях
+static void flush(RegisterCompiler* compiler, int count) {
+    for (int i = 0; i < count; i++) {
+        materialize(compiler, i);
+    }
+}
+
+//* Регистр, из которого инструкция может прочитать операнд, без лишнего MOVE
+static int operandRegister(RegisterCompiler* compiler, int position) {
+    Operand* operand = &compiler->operands[position];
+    if (operand->kind == OPERAND_REGISTER) return operand->index;
+    materialize(compiler, position);
+    return position;
+}
+
+static bool readsRegister(RegisterCompiler* compiler, int reg, int except) {
+    for (int i = 0; i < compiler->depth; i++) {
+        if (i == except) continue;
+        Operand* operand = &compiler->operands[i];
+        if (operand->kind == OPERAND_REGISTER && operand->index == reg) return true;
+    }
+    return false;
+}
+
+//* Перед записью в регистр reg материализуем отложенные копии его старого значения
+static void invalidate(RegisterCompiler* compiler, int reg, int except) {
+    for (int i = 0; i < compiler->depth; i++) {
+        if (i == except) continue;
+        Operand* operand = &compiler->operands[i];
+        if (operand->kind == OPERAND_REGISTER && operand->index == reg) materialize(compiler, i);
+    }
+}
+
+static void push(RegisterCompiler* compiler, OperandKind kind, int index) {
+    if (compiler->depth == MAX_REGISTERS) {
+        compiler->hadError = true;
+        return;
+    }
+    compiler->operands[compiler->depth].kind = kind;
+    compiler->operands[compiler->depth].index = index;
+    compiler->depth++;
+    if (compiler->depth > compiler->maxDepth) compiler->maxDepth = compiler->depth;
+}
+
+static void emitForwardJump(RegisterCompiler* compiler, int target) {
+    if (compiler->jumpCapacity < compiler->jumpCount + 1) {
+        int oldCapacity = compiler->jumpCapacity;
+        compiler->jumpCapacity = GROW_CAPACITY(oldCapacity);
+        compiler->jumps = ARENA_GROW_ARRAY(compiler->code->arena, ForwardJump, compiler->jumps,
+                                           oldCapacity, compiler->jumpCapacity);
+    }
+    compiler->jumps[compiler->jumpCount].offset = compiler->code->count;
+    compiler->jumps[compiler->jumpCount].target = target;
+    compiler->jumpCount++;
+    emitShort(compiler, 0xffff);
+
+    int* depth = &compiler->targetDepth[target];
+    if (*depth == -1) *depth = compiler->depth;
+}
+
+static void patchJumps(RegisterCompiler* compiler, int target) {
+    for (int i = 0; i < compiler->jumpCount; i++) {
+        if (compiler->jumps[i].target != target) continue;
+        int offset = compiler->jumps[i].offset;
+        int jump = compiler->code->count - offset - 2;
+        if (jump > UINT16_MAX) compiler->hadError = true;
+        compiler->code->code[offset] = (jump >> 8) & 0xff;
+        compiler->code->code[offset + 1] = jump & 0xff;
+    }
+}
+
+static int jumpTarget(Chunk* chunk, int offset) {
+    uint16_t jump = (uint16_t)((chunk->code[offset + 1] << 8) | chunk->code[offset + 2]);
+    return chunk->code[offset] == OP_LOOP ? offset + 3 - jump : offset + 3 + jump;
+}
+
+static void findTargets(RegisterCompiler* compiler) {
+    Chunk* chunk = compiler->source;
+    for (int offset = 0; offset < chunk->count; offset += instructionLength(chunk, offset)) {
+        switch (chunk->code[offset]) {
+            case OP_JUMP:
+            case OP_JUMP_IF_FALSE:
+            case OP_LOOP:
+                compiler->isTarget[jumpTarget(chunk, offset)] = true;
+                break;
+            default:
+                break;
+        }
+    }
+}
+
+static void binary(RegisterCompiler* compiler, RegOpCode op, RegOpCode constantOp) {
+    int dest = compiler->depth - 2;
+    Operand right = compiler->operands[dest + 1];
+    int left = operandRegister(compiler, dest);
+    invalidate(compiler, dest, dest);
+    if (right.kind == OPERAND_CONSTANT) {
+        emitResult(compiler, constantOp, dest);
+        emitBytes(compiler, (uint8_t)left, (uint8_t)right.index);
+    } else {
+        int rightRegister = operandRegister(compiler, dest + 1);
+        emitResult(compiler, op, dest);
+        emitBytes(compiler, (uint8_t)left, (uint8_t)rightRegister);
+    }
+    compiler->depth--;
+    compiler->operands[dest].kind = OPERAND_HOME;
+}
+
+static void unary(RegisterCompiler* compiler, RegOpCode op) {
+    int dest = compiler->depth - 1;
+    int source = operandRegister(compiler, dest);
+    emitResult(compiler, op, dest);
+    emitByte(compiler, (uint8_t)source);
+    compiler->operands[dest].kind = OPERAND_HOME;
+}
+
+/*
+ * Сравнение, сразу за которым идёт JUMP_IF_FALSE, а на обоих путях после него — POP
+ * (условия if, while и for), сливается в один условный переход: результат сравнения
+ * никому не нужен, и регистр под него не заводится.
+ */
+static bool compareAndJump(RegisterCompiler* compiler, int offset, RegOpCode op, RegOpCode constantOp) {
+    Chunk* chunk = compiler->source;
+    int jump = offset + 1;
+    if (jump + 3 >= chunk->count || chunk->code[jump] != OP_JUMP_IF_FALSE) return false;
+    int target = jumpTarget(chunk, jump);
+    if (compiler->isTarget[jump] || compiler->isTarget[jump + 3]) return false;
+    if (chunk->code[jump + 3] != OP_POP || chunk->code[target] != OP_POP) return false;
+
+    int left = compiler->depth - 2;
+    flush(compiler, left);
+    Operand right = compiler->operands[left + 1];
+    int leftRegister = operandRegister(compiler, left);
+    int rightOperand = right.kind == OPERAND_CONSTANT ? right.index : operandRegister(compiler, left + 1);
+    emitOp(compiler, right.kind == OPERAND_CONSTANT ? constantOp : op);
+    emitBytes(compiler, (uint8_t)leftRegister, (uint8_t)rightOperand);
+    //* На цели перехода результат сравнения ещё числится на стеке, и его снимает POP
+    compiler->depth = left + 1;
+    compiler->operands[left].kind = OPERAND_HOME;
+    emitForwardJump(compiler, target);
+    compiler->depth = left;
+    return true;
+}
+
+static void setLocal(RegisterCompiler* compiler, int slot) {
+    int top = compiler->depth - 1;
+    Operand value = compiler->operands[top];
+    bool selfAssign = value.kind == OPERAND_REGISTER && value.index == slot;
+
+    if (!selfAssign) {
+        if (value.kind == OPERAND_HOME && compiler->lastResult == top &&
+                compiler->lastResultOffset >= 0 && !readsRegister(compiler, slot, top)) {
+            //* Результат только что вычислен: пусть инструкция сразу пишет в переменную
+            compiler->code->code[compiler->lastResultOffset + 1] = (uint8_t)slot;
+        } else {
+            invalidate(compiler, slot, top);
+            int source;
+            switch (value.kind) {
+                case OPERAND_HOME: source = top; break;
+                case OPERAND_REGISTER: source = value.index; break;
+                default:
+                    compiler->operands[slot] = value;
+                    materialize(compiler, slot);
+                    source = -1;
+                    break;
+            }
+            if (source != -1) {
+                emitOp(compiler, ROP_MOVE);
+                emitBytes(compiler, (uint8_t)slot, (uint8_t)source);
+            }
+        }
+    }
+
+    compiler->operands[slot].kind = OPERAND_HOME;
+    compiler->operands[top].kind = OPERAND_REGISTER;
+    compiler->operands[top].index = slot;
+    compiler->lastResultOffset = -1;
+}
+
+//* Переводит одну стековую инструкцию и возвращает смещение следующей
+static int translate(RegisterCompiler* compiler, int offset) {
+    Chunk* chunk = compiler->source;
+    uint8_t* ip = &chunk->code[offset];
+    int top = compiler->depth - 1;
+
+    switch (ip[0]) {
+        case OP_CONSTANT: push(compiler, OPERAND_CONSTANT, ip[1]); break;
+        case OP_NIL: push(compiler, OPERAND_NIL, 0); break;
+        case OP_TRUE: push(compiler, OPERAND_TRUE, 0); break;
+        case OP_FALSE: push(compiler, OPERAND_FALSE, 0); break;
+        case OP_POP: compiler->depth--; break;
+        case OP_GET_LOCAL:
+            materialize(compiler, ip[1]);
+            push(compiler, OPERAND_REGISTER, ip[1]);
+            break;
+        case OP_SET_LOCAL: setLocal(compiler, ip[1]); break;
+        case OP_GET_GLOBAL:
+        case OP_GET_UPVALUE: {
+            push(compiler, OPERAND_HOME, 0);
+            if (compiler->hadError) break;
+            emitResult(compiler, ip[0] == OP_GET_GLOBAL ? ROP_GET_GLOBAL : ROP_GET_UPVALUE, compiler->depth - 1);
+            emitByte(compiler, ip[1]);
+            if (ip[0] == OP_GET_GLOBAL) emitByte(compiler, ip[2]);
+            break;
+        }
+        case OP_DEFINE_GLOBAL:
+        case OP_SET_GLOBAL: {
+            int source = operandRegister(compiler, top);
+            emitOp(compiler, ip[0] == OP_DEFINE_GLOBAL ? ROP_DEFINE_GLOBAL : ROP_SET_GLOBAL);
+            emitByte(compiler, (uint8_t)source);
+            emitBytes(compiler, ip[1], ip[2]);
+            if (ip[0] == OP_DEFINE_GLOBAL) compiler->depth--;
+            break;
+        }
+        case OP_SET_UPVALUE: {
+            int source = operandRegister(compiler, top);
+            emitOp(compiler, ROP_SET_UPVALUE);
+            emitBytes(compiler, (uint8_t)source, ip[1]);
+            break;
+        }
+        case OP_EQUAL: binary(compiler, ROP_EQUAL, ROP_EQUAL_CONSTANT); break;
+        case OP_GREATER:
+            //* Слитое сравнение поглощает следующие за ним JUMP_IF_FALSE и POP
+            if (compareAndJump(compiler, offset, ROP_JUMP_IF_NOT_GREATER, ROP_JUMP_IF_NOT_GREATER_CONSTANT)) return offset + 5;
+            binary(compiler, ROP_GREATER, ROP_GREATER_CONSTANT);
+            break;
+        case OP_LESS:
+            if (compareAndJump(compiler, offset, ROP_JUMP_IF_NOT_LESS, ROP_JUMP_IF_NOT_LESS_CONSTANT)) return offset + 5;
+            binary(compiler, ROP_LESS, ROP_LESS_CONSTANT);
+            break;
+        case OP_ADD: binary(compiler, ROP_ADD, ROP_ADD_CONSTANT); break;
+        case OP_SUBTRACT: binary(compiler, ROP_SUBTRACT, ROP_SUBTRACT_CONSTANT); break;
+        case OP_MULTIPLY: binary(compiler, ROP_MULTIPLY, ROP_MULTIPLY_CONSTANT); break;
+        case OP_DIVIDE: binary(compiler, ROP_DIVIDE, ROP_DIVIDE_CONSTANT); break;
+        case OP_NOT: unary(compiler, ROP_NOT); break;
+        case OP_NEGATE: unary(compiler, ROP_NEGATE); break;
+        case OP_PRINT: {
+            int source = operandRegister(compiler, top);
+            emitOp(compiler, ROP_PRINT);
+            emitByte(compiler, (uint8_t)source);
+            compiler->depth--;
+            break;
+        }
+        case OP_JUMP:
+            flush(compiler, compiler->depth);
+            emitOp(compiler, ROP_JUMP);
+            emitForwardJump(compiler, jumpTarget(chunk, offset));
+            compiler->reachable = false;
+            break;
+        case OP_JUMP_IF_FALSE:
+            flush(compiler, compiler->depth);
+            emitOp(compiler, ROP_JUMP_IF_FALSE);
+            emitByte(compiler, (uint8_t)top);
+            emitForwardJump(compiler, jumpTarget(chunk, offset));
+            break;
+        case OP_LOOP: {
+            flush(compiler, compiler->depth);
+            emitOp(compiler, ROP_LOOP);
+            int jump = compiler->code->count + 2 - compiler->targetOffset[jumpTarget(chunk, offset)];
+            if (jump > UINT16_MAX) compiler->hadError = true;
+            emitShort(compiler, (uint16_t)jump);
+            compiler->reachable = false;
+            break;
+        }
+        case OP_CALL:
+        case OP_TAIL_CALL: {
+            //* Вызываемое значение и аргументы должны лежать в подряд идущих регистрах,
+            //* а вызов может поменять захваченные локальные переменные — материализуем всё
+            flush(compiler, compiler->depth);
+            int base = compiler->depth - 1 - ip[1];
+            emitOp(compiler, ip[0] == OP_TAIL_CALL ? ROP_TAIL_CALL : ROP_CALL);
+            emitBytes(compiler, (uint8_t)base, ip[1]);
+            compiler->depth = base + 1;
+            break;
+        }
+        case OP_CLOSURE: {
+            ObjFunction* function = AS_FUNCTION(chunk->constants.values[ip[1]]);
+            for (int i = 0; i < function->upvalueCount; i++) {
+                if (ip[2 + i * 2] != CAPTURE_UPVALUE) materialize(compiler, ip[3 + i * 2]);
+            }
+            push(compiler, OPERAND_HOME, 0);
+            if (compiler->hadError) break;
+            emitOp(compiler, ROP_CLOSURE);
+            emitBytes(compiler, (uint8_t)(compiler->depth - 1), ip[1]);
+            for (int i = 0; i < function->upvalueCount * 2; i++) {
+                emitByte(compiler, ip[2 + i]);
+            }
+            break;
+        }
+        case OP_CLOSE_UPVALUE:
+            materialize(compiler, top);
+            emitOp(compiler, ROP_CLOSE_UPVALUE);
+            emitByte(compiler, (uint8_t)top);
+            compiler->depth--;
+            break;
+        case OP_RETURN: {
+            int source = operandRegister(compiler, top);
+            emitOp(compiler, ROP_RETURN);
+            emitByte(compiler, (uint8_t)source);
+            compiler->depth--;
+            compiler->reachable = false;
+            break;
+        }
+        default:
+            //* Ускоренных инструкций и суперинструкций в только что скомпилированном коде нет
+            compiler->hadError = true;
+            break;
+    }
+    return offset + instructionLength(chunk, offset);
+}
+
+/*
+ * Строит function->registerChunk по стековому коду function->chunk.
+ * Возвращает false, если функции не хватает 256 регистров или переход стал длиннее 16 бит.
+ */
+bool compileRegisters(ObjFunction* function) {
+    RegisterCompiler compiler;
+    Chunk* chunk = &function->chunk;
+    compiler.source = chunk;
+    compiler.code = &function->registerChunk;
+    compiler.depth = 0;
+    compiler.maxDepth = 0;
+    compiler.line = 0;
+    compiler.reachable = true;
+    //* Рабочие массивы живут в арене компилятора (registerChunk.arena) и освобождаются вместе с ней в endCompiler
+    compiler.isTarget = ARENA_ALLOCATE(compiler.code->arena, bool, chunk->count + 1);
+    compiler.targetDepth = ARENA_ALLOCATE(compiler.code->arena, int, chunk->count + 1);
+    compiler.targetOffset = ARENA_ALLOCATE(compiler.code->arena, int, chunk->count + 1);
+    compiler.jumps = NULL;
+    compiler.jumpCount = 0;
+    compiler.jumpCapacity = 0;
+    compiler.lastResult = -1;
+    compiler.lastResultOffset = -1;
+    compiler.hadError = false;
+    for (int i = 0; i <= chunk->count; i++) {
+        compiler.isTarget[i] = false;
+        compiler.targetDepth[i] = -1;
+        compiler.targetOffset[i] = -1;
+    }
+
+    //* При входе в функцию в слоте 0 лежит само замыкание, за ним — параметры
+    for (int i = 0; i <= function->arity; i++) {
+        push(&compiler, OPERAND_HOME, 0);
+    }
+
+    findTargets(&compiler);
+    int offset = 0;
+    while (offset < chunk->count && !compiler.hadError) {
+        compiler.line = chunk->lines[offset];
+        if (compiler.isTarget[offset]) {
+            if (compiler.reachable) {
+                flush(&compiler, compiler.depth);
+            } else {
+                //* Сюда попадают только переходом. Если он ещё не встречался (цель LOOP ниже по коду),
+                //* глубина та же, что и после безусловного перехода перед этим местом
+                if (compiler.targetDepth[offset] != -1) compiler.depth = compiler.targetDepth[offset];
+                for (int i = 0; i < compiler.depth; i++) compiler.operands[i].kind = OPERAND_HOME;
+                compiler.reachable = true;
+            }
+            compiler.targetDepth[offset] = compiler.depth;
+            compiler.targetOffset[offset] = compiler.code->count;
+            compiler.lastResultOffset = -1;
+            patchJumps(&compiler, offset);
+        }
+        if (compiler.reachable) {
+            offset = translate(&compiler, offset);
+        } else {
+            //* Недостижимый код (например, после return) не переводим
+            offset += instructionLength(chunk, offset);
+        }
+    }
+    function->registerCount = compiler.maxDepth;
+    return !compiler.hadError;
+}
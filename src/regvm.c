@@ -0,0 +1,385 @@
+#include <stdio.h>
+
+#include "common.h"
+#include "debug.h"
+#include "memory.h"
+#include "object.h"
+#include "regchunk.h"
+#include "vm.h"
+
+/*
+ * Цикл исполнения регистрового кода (clox --register).
+ * Фрейм занимает на стеке значений окно из registerCount регистров, начиная с frame->slots,
+ * и vm.stackTop всё время указывает на конец окна текущего фрейма.
+ * Соглашение о вызове то же, что у стековой машины: вызываемое значение и аргументы
+ * лежат в регистрах A..A+n вызывающего, и они же становятся слотами 0..n вызываемого.
+ */
+
+//* Занимает окно регистров для только что созданного фрейма
+static bool enterFrame(CallFrame* frame) {
+    ObjFunction* function = frame->closure->function;
+    frame->ip = function->registerChunk.code;
+    //* Над окном нужно место ещё под два значения: concatenate() работает через стек.
+    //* Стек при этом может переехать, так что slots вызывающий перечитывает из фрейма
+    if (!reserveStack(function->registerCount + 2 - (int)(vm.stackTop - frame->slots))) return false;
+    //* Регистры над аргументами могут хранить значения прежних фреймов, уже освобождённые:
+    //* сборщик мусора просматривает всё окно, поэтому они очищаются
+    Value* end = frame->slots + function->registerCount;
+    for (Value* slot = vm.stackTop; slot < end; slot++) *slot = NIL_VAL;
+    vm.stackTop = end;
+    return true;
+}
+
+DISPATCH_ATTRIBUTES InterpretResult runRegisters() {
+    CallFrame* frame = vm.frame;
+    if (!enterFrame(frame)) {
+        runtimeError("Stack overflow.");
+        return INTERPRET_RUNTIME_ERROR;
+    }
+    register uint8_t* ip = frame->ip;
+    register Value* slots = frame->slots;
+
+    #define CONSTANTS() (frame->closure->function->chunk.constants.values)
+    #define R(n) (slots[n])
+    #define K(n) (CONSTANTS()[n])
+    #define READ_SHORT_AT(n) ((uint16_t)((ip[n] << 8) | ip[(n) + 1]))
+    #define GLOBAL_NAME(slot) AS_STRING(vm.globalNames.values[slot])
+    #define RUNTIME_ERROR(...) \
+        do { \
+            frame->ip = ip; \
+            runtimeError(__VA_ARGS__); \
+            return INTERPRET_RUNTIME_ERROR; \
+        } while (false)
+    //* R[A] = left op right, операнды читаются до записи результата: A может совпадать с B
+    #define ARITHMETIC_OP(valueType, op, right) \
+        do { \
+            Value a = R(ip[1]); \
+            Value b = (right); \
+            if (!IS_NUMBER(a) || !IS_NUMBER(b)) { \
+                RUNTIME_ERROR("Operands must be numbers."); \
+            } \
+            R(ip[0]) = valueType(AS_NUMBER(a) op AS_NUMBER(b)); \
+            ip += 3; \
+        } while (false)
+    #define ADD_OP(right) \
+        do { \
+            Value a = R(ip[1]); \
+            Value b = (right); \
+            if (IS_NUMBER(a) && IS_NUMBER(b)) { \
+                R(ip[0]) = NUMBER_VAL(AS_NUMBER(a) + AS_NUMBER(b)); \
+            } else if (IS_STRING(a) && IS_STRING(b)) { \
+                frame->ip = ip; \
+                push(a); \
+                push(b); \
+                concatenate(); \
+                R(ip[0]) = pop(); \
+            } else { \
+                RUNTIME_ERROR("Operands must be two numbers or two strings."); \
+            } \
+            ip += 3; \
+        } while (false)
+    //* Переход, если сравнение ложно; смещение отсчитывается от конца инструкции
+    #define COMPARE_JUMP(op, right) \
+        do { \
+            Value a = R(ip[0]); \
+            Value b = (right); \
+            if (!IS_NUMBER(a) || !IS_NUMBER(b)) { \
+                RUNTIME_ERROR("Operands must be numbers."); \
+            } \
+            uint16_t offset = READ_SHORT_AT(2); \
+            ip += 4; \
+            if (!(AS_NUMBER(a) op AS_NUMBER(b))) ip += offset; \
+        } while (false)
+
+    #ifdef DEBUG_TRACE_EXECUTION
+        #define TRACE_EXECUTION() \
+            do { \
+                printf(" "); \
+                for (Value* slot = slots; slot < vm.stackTop; slot++) { \
+                    printf("[ "); \
+                    printValue(*slot); \
+                    printf(" ]"); \
+                } \
+                printf("\n"); \
+                disassembleRegisterInstruction(frame->closure->function, \
+                    (int)(ip - frame->closure->function->registerChunk.code)); \
+            } while (false)
+    #else
+        #define TRACE_EXECUTION() do {} while (false)
+    #endif
+
+    #ifdef COMPUTED_GOTO
+        static void* dispatchTable[UINT8_COUNT] = {
+            [0 ... UINT8_MAX] = &&op_UNKNOWN,
+            [ROP_MOVE] = &&op_ROP_MOVE,
+            [ROP_LOAD_CONSTANT] = &&op_ROP_LOAD_CONSTANT,
+            [ROP_LOAD_NIL] = &&op_ROP_LOAD_NIL,
+            [ROP_LOAD_TRUE] = &&op_ROP_LOAD_TRUE,
+            [ROP_LOAD_FALSE] = &&op_ROP_LOAD_FALSE,
+            [ROP_GET_GLOBAL] = &&op_ROP_GET_GLOBAL,
+            [ROP_DEFINE_GLOBAL] = &&op_ROP_DEFINE_GLOBAL,
+            [ROP_SET_GLOBAL] = &&op_ROP_SET_GLOBAL,
+            [ROP_GET_UPVALUE] = &&op_ROP_GET_UPVALUE,
+            [ROP_SET_UPVALUE] = &&op_ROP_SET_UPVALUE,
+            [ROP_EQUAL] = &&op_ROP_EQUAL,
+            [ROP_GREATER] = &&op_ROP_GREATER,
+            [ROP_LESS] = &&op_ROP_LESS,
+            [ROP_ADD] = &&op_ROP_ADD,
+            [ROP_SUBTRACT] = &&op_ROP_SUBTRACT,
+            [ROP_MULTIPLY] = &&op_ROP_MULTIPLY,
+            [ROP_DIVIDE] = &&op_ROP_DIVIDE,
+            [ROP_EQUAL_CONSTANT] = &&op_ROP_EQUAL_CONSTANT,
+            [ROP_GREATER_CONSTANT] = &&op_ROP_GREATER_CONSTANT,
+            [ROP_LESS_CONSTANT] = &&op_ROP_LESS_CONSTANT,
+            [ROP_ADD_CONSTANT] = &&op_ROP_ADD_CONSTANT,
+            [ROP_SUBTRACT_CONSTANT] = &&op_ROP_SUBTRACT_CONSTANT,
+            [ROP_MULTIPLY_CONSTANT] = &&op_ROP_MULTIPLY_CONSTANT,
+            [ROP_DIVIDE_CONSTANT] = &&op_ROP_DIVIDE_CONSTANT,
+            [ROP_NOT] = &&op_ROP_NOT,
+            [ROP_NEGATE] = &&op_ROP_NEGATE,
+            [ROP_PRINT] = &&op_ROP_PRINT,
+            [ROP_JUMP] = &&op_ROP_JUMP,
+            [ROP_JUMP_IF_FALSE] = &&op_ROP_JUMP_IF_FALSE,
+            [ROP_JUMP_IF_NOT_LESS] = &&op_ROP_JUMP_IF_NOT_LESS,
+            [ROP_JUMP_IF_NOT_LESS_CONSTANT] = &&op_ROP_JUMP_IF_NOT_LESS_CONSTANT,
+            [ROP_JUMP_IF_NOT_GREATER] = &&op_ROP_JUMP_IF_NOT_GREATER,
+            [ROP_JUMP_IF_NOT_GREATER_CONSTANT] = &&op_ROP_JUMP_IF_NOT_GREATER_CONSTANT,
+            [ROP_LOOP] = &&op_ROP_LOOP,
+            [ROP_CALL] = &&op_ROP_CALL,
+            [ROP_TAIL_CALL] = &&op_ROP_TAIL_CALL,
+            [ROP_CLOSURE] = &&op_ROP_CLOSURE,
+            [ROP_CLOSE_UPVALUE] = &&op_ROP_CLOSE_UPVALUE,
+            [ROP_RETURN] = &&op_ROP_RETURN,
+        };
+        #define DISPATCH() \
+            do { \
+                TRACE_EXECUTION(); \
+                goto *dispatchTable[instruction = *ip++]; \
+            } while (false)
+        #define CASE(op) op_##op
+        #define DEFAULT op_UNKNOWN
+        #define NEXT DISPATCH()
+    #else
+        #define CASE(op) case op
+        #define DEFAULT default
+        #define NEXT break
+    #endif
+
+    //* Обработчики получают ip, указывающий на первый операнд (A)
+    uint8_t instruction;
+    #ifdef COMPUTED_GOTO
+    DISPATCH();
+    {
+    #else
+    for (;;) {
+        TRACE_EXECUTION();
+        switch (instruction = *ip++) {
+    #endif
+            CASE(ROP_MOVE): R(ip[0]) = R(ip[1]); ip += 2; NEXT;
+            CASE(ROP_LOAD_CONSTANT): R(ip[0]) = K(ip[1]); ip += 2; NEXT;
+            CASE(ROP_LOAD_NIL): R(ip[0]) = NIL_VAL; ip++; NEXT;
+            CASE(ROP_LOAD_TRUE): R(ip[0]) = BOOL_VAL(true); ip++; NEXT;
+            CASE(ROP_LOAD_FALSE): R(ip[0]) = BOOL_VAL(false); ip++; NEXT;
+            CASE(ROP_GET_GLOBAL): {
+                uint16_t slot = READ_SHORT_AT(1);
+                Value value = vm.globalValues.values[slot];
+                if (IS_UNDEFINED(value)) {
+                    RUNTIME_ERROR("Undefined variable '%s'.", GLOBAL_NAME(slot)->chars);
+                }
+                R(ip[0]) = value;
+                ip += 3;
+                NEXT;
+            }
+            CASE(ROP_DEFINE_GLOBAL): {
+                vm.globalValues.values[READ_SHORT_AT(1)] = R(ip[0]);
+                ip += 3;
+                NEXT;
+            }
+            CASE(ROP_SET_GLOBAL): {
+                uint16_t slot = READ_SHORT_AT(1);
+                if (IS_UNDEFINED(vm.globalValues.values[slot])) {
+                    RUNTIME_ERROR("Undefined variable '%s'.", GLOBAL_NAME(slot)->chars);
+                }
+                vm.globalValues.values[slot] = R(ip[0]);
+                ip += 3;
+                NEXT;
+            }
+            CASE(ROP_GET_UPVALUE): {
+                R(ip[0]) = *frame->closure->upvalues[ip[1]]->location;
+                ip += 2;
+                NEXT;
+            }
+            CASE(ROP_SET_UPVALUE): {
+                ObjUpvalue* upvalue = frame->closure->upvalues[ip[1]];
+                deletionBarrier(*upvalue->location);
+                *upvalue->location = R(ip[0]);
+                writeBarrier((Obj*)upvalue, R(ip[0]));
+                ip += 2;
+                NEXT;
+            }
+            CASE(ROP_EQUAL): R(ip[0]) = BOOL_VAL(valuesEqual(R(ip[1]), R(ip[2]))); ip += 3; NEXT;
+            CASE(ROP_GREATER): ARITHMETIC_OP(BOOL_VAL, >, R(ip[2])); NEXT;
+            CASE(ROP_LESS): ARITHMETIC_OP(BOOL_VAL, <, R(ip[2])); NEXT;
+            CASE(ROP_ADD): ADD_OP(R(ip[2])); NEXT;
+            CASE(ROP_SUBTRACT): ARITHMETIC_OP(NUMBER_VAL, -, R(ip[2])); NEXT;
+            CASE(ROP_MULTIPLY): ARITHMETIC_OP(NUMBER_VAL, *, R(ip[2])); NEXT;
+            CASE(ROP_DIVIDE): ARITHMETIC_OP(NUMBER_VAL, /, R(ip[2])); NEXT;
+            CASE(ROP_EQUAL_CONSTANT): R(ip[0]) = BOOL_VAL(valuesEqual(R(ip[1]), K(ip[2]))); ip += 3; NEXT;
+            CASE(ROP_GREATER_CONSTANT): ARITHMETIC_OP(BOOL_VAL, >, K(ip[2])); NEXT;
+            CASE(ROP_LESS_CONSTANT): ARITHMETIC_OP(BOOL_VAL, <, K(ip[2])); NEXT;
+            CASE(ROP_ADD_CONSTANT): ADD_OP(K(ip[2])); NEXT;
+            CASE(ROP_SUBTRACT_CONSTANT): ARITHMETIC_OP(NUMBER_VAL, -, K(ip[2])); NEXT;
+            CASE(ROP_MULTIPLY_CONSTANT): ARITHMETIC_OP(NUMBER_VAL, *, K(ip[2])); NEXT;
+            CASE(ROP_DIVIDE_CONSTANT): ARITHMETIC_OP(NUMBER_VAL, /, K(ip[2])); NEXT;
+            CASE(ROP_NOT): R(ip[0]) = BOOL_VAL(isFalsey(R(ip[1]))); ip += 2; NEXT;
+            CASE(ROP_NEGATE): {
+                Value value = R(ip[1]);
+                if (!IS_NUMBER(value)) {
+                    RUNTIME_ERROR("Operand must be a number.");
+                }
+                R(ip[0]) = NUMBER_VAL(-AS_NUMBER(value));
+                ip += 2;
+                NEXT;
+            }
+            CASE(ROP_PRINT): {
+                printValue(R(ip[0]));
+                printf("\n");
+                ip++;
+                NEXT;
+            }
+            CASE(ROP_JUMP): {
+                uint16_t offset = READ_SHORT_AT(0);
+                ip += 2 + offset;
+                NEXT;
+            }
+            CASE(ROP_JUMP_IF_FALSE): {
+                uint16_t offset = READ_SHORT_AT(1);
+                bool falsey = isFalsey(R(ip[0]));
+                ip += 3;
+                if (falsey) ip += offset;
+                NEXT;
+            }
+            CASE(ROP_JUMP_IF_NOT_LESS): COMPARE_JUMP(<, R(ip[1])); NEXT;
+            CASE(ROP_JUMP_IF_NOT_LESS_CONSTANT): COMPARE_JUMP(<, K(ip[1])); NEXT;
+            CASE(ROP_JUMP_IF_NOT_GREATER): COMPARE_JUMP(>, R(ip[1])); NEXT;
+            CASE(ROP_JUMP_IF_NOT_GREATER_CONSTANT): COMPARE_JUMP(>, K(ip[1])); NEXT;
+            CASE(ROP_LOOP): {
+                uint16_t offset = READ_SHORT_AT(0);
+                ip += 2;
+                ip -= offset;
+                safepoint();
+                NEXT;
+            }
+            CASE(ROP_CALL): {
+                uint8_t base = ip[0];
+                int argCount = ip[1];
+                ip += 2;
+                frame->ip = ip;
+                //* Безопасная точка — пока vm.stackTop накрывает все регистры фрейма
+                safepoint();
+                //* callValue ожидает вызываемое значение и аргументы на вершине стека
+                vm.stackTop = slots + base + argCount + 1;
+                int frameCount = vm.frameCount;
+                if (!callValue(R(base), argCount)) {
+                    return INTERPRET_RUNTIME_ERROR;
+                }
+                if (vm.frameCount == frameCount) {
+                    //* Нативная функция уже положила результат в R[base]
+                    vm.stackTop = slots + frame->closure->function->registerCount;
+                    NEXT;
+                }
+                if (!enterFrame(vm.frame)) {
+                    vm.frameCount--;
+                    vm.frame = vm.frame->previous;
+                    RUNTIME_ERROR("Stack overflow.");
+                }
+                frame = vm.frame;
+                ip = frame->ip;
+                slots = frame->slots;
+                NEXT;
+            }
+            CASE(ROP_TAIL_CALL): {
+                uint8_t base = ip[0];
+                int argCount = ip[1];
+                ip += 2;
+                frame->ip = ip;
+                safepoint();
+                vm.stackTop = slots + base + argCount + 1;
+                bool reuse = IS_CLOSURE(R(base));
+                if (!tailCallValue(R(base), argCount)) {
+                    return INTERPRET_RUNTIME_ERROR;
+                }
+                if (!reuse) {
+                    //* Нативная функция: результат в R[base] вернёт следующая ROP_RETURN
+                    vm.stackTop = slots + frame->closure->function->registerCount;
+                    NEXT;
+                }
+                //* Окно регистров начинается там же, меняется только его размер
+                if (!enterFrame(frame)) RUNTIME_ERROR("Stack overflow.");
+                ip = frame->ip;
+                slots = frame->slots;
+                NEXT;
+            }
+            CASE(ROP_CLOSURE): {
+                ObjFunction* function = AS_FUNCTION(K(ip[1]));
+                frame->ip = ip;
+                ObjClosure* closure = newClosure(function);
+                R(ip[0]) = OBJ_VAL((Obj*)closure);
+                ip += 2;
+                for (int i = 0; i < closure->upvalueCount; i++) {
+                    uint8_t capture = *ip++;
+                    uint8_t index = *ip++;
+                    if (capture == CAPTURE_LOCAL) {
+                        closure->upvalues[i] = captureUpvalue(slots + index);
+                    } else if (capture == CAPTURE_VALUE) {
+                        closure->upvalues[i] = copyUpvalue(slots + index);
+                    } else {
+                        closure->upvalues[i] = frame->closure->upvalues[index];
+                    }
+                    writeBarrier((Obj*)closure, OBJ_VAL((Obj*)closure->upvalues[i]));
+                }
+                NEXT;
+            }
+            CASE(ROP_CLOSE_UPVALUE): closedUpvalues(slots + ip[0]); ip++; NEXT;
+            CASE(ROP_RETURN): {
+                Value result = R(ip[0]);
+                closedUpvalues(slots);
+                vm.frameCount--;
+                vm.frame = frame->previous;
+                if (vm.frameCount == 0) {
+                    vm.stackTop = vm.stack;
+                    return INTERPRET_OK;
+                }
+
+                //* Слот 0 вызываемого — это регистр A инструкции CALL у вызывающего
+                slots[0] = result;
+                frame = vm.frame;
+                ip = frame->ip;
+                slots = frame->slots;
+                vm.stackTop = slots + frame->closure->function->registerCount;
+                NEXT;
+            }
+            DEFAULT:
+                RUNTIME_ERROR("Unknown opcode %d.", instruction);
+    #ifndef COMPUTED_GOTO
+        }
+    #endif
+    }
+
+    #undef NEXT
+    #undef DEFAULT
+    #undef CASE
+    #ifdef COMPUTED_GOTO
+        #undef DISPATCH
+    #endif
+    #undef TRACE_EXECUTION
+    #undef COMPARE_JUMP
+    #undef ADD_OP
+    #undef ARITHMETIC_OP
+    #undef RUNTIME_ERROR
+    #undef GLOBAL_NAME
+    #undef READ_SHORT_AT
+    #undef K
+    #undef R
+    #undef CONSTANTS
+}
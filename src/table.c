@@ -1,137 +1,318 @@
+#include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
 #include "memory.h"
 #include "object.h"
 #include "table.h"
 #include "value.h"
+#include "vm.h"
+
+//* Заполнение до 7/8 ёмкости (вместе с надгробиями): в таблице всегда остаются пустые ячейки,
+//* на которых поиск отсутствующего ключа останавливается
+#define TABLE_MAX_LOAD(capacity) ((capacity) / 8 * 7)
 
-#define TABLE_MAX_LOAD 0,75
+//* Хэш делится на две части: старшие биты выбирают группу, 7 младших хранятся в управляющем байте
+#define HASH_GROUP(hash) ((hash) >> 7)
+#define HASH_TAG(hash) ((uint8_t)((hash) & 0x7f))
 
 void initTable(Table* table) {
     table->count = 0;
+    table->tombstones = 0;
     table->capacity = 0;
     table->entries = NULL;
+    table->control = NULL;
+}
+
+static size_t tableBytes(int capacity) {
+    return (sizeof(Entry) + 1) * (size_t)capacity;
 }
 
 void freeTable(Table* table) {
-    FREE_ARRAY(Entry, table->entries, table->capacity);
+    FREE_ARRAY(char, table->entries, tableBytes(table->capacity));
     initTable(table);
 }
 
-static Entry* findEntry(Entry* entries, int capacity, ObjString* key) {
-    uint32_t index = key->hash % capacity;
+/*
+ * Битовые маски по группе управляющих байтов: бит i выставлен, если байт i подходит.
+ * С SSE2 группа сравнивается одной инструкцией, без неё — побайтно с тем же результатом
+ */
+#ifdef __SSE2__
+static inline uint32_t matchTag(const uint8_t* group, uint8_t tag) {
+    __m128i control = _mm_loadu_si128((const __m128i*)group);
+    return (uint32_t)_mm_movemask_epi8(_mm_cmpeq_epi8(control, _mm_set1_epi8((char)tag)));
+}
+
+//* Пустые ячейки и надгробия: у обоих выставлен старший бит
+static inline uint32_t matchFree(const uint8_t* group) {
+    return (uint32_t)_mm_movemask_epi8(_mm_loadu_si128((const __m128i*)group));
+}
+#else
+static inline uint32_t matchTag(const uint8_t* group, uint8_t tag) {
+    uint32_t bits = 0;
+    for (int i = 0; i < TABLE_GROUP_WIDTH; i++) {
+        if (group[i] == tag) bits |= 1u << i;
+    }
+    return bits;
+}
+
+static inline uint32_t matchFree(const uint8_t* group) {
+    uint32_t bits = 0;
+    for (int i = 0; i < TABLE_GROUP_WIDTH; i++) {
+        if (group[i] & 0x80) bits |= 1u << i;
+    }
+    return bits;
+}
+#endif
+
+static inline uint32_t matchEmpty(const uint8_t* group) {
+    return matchTag(group, TABLE_EMPTY);
+}
 
-    Entry* tombstone = NULL; // Когда в первые видим надгробие, оно сохраняется сюда
+//* Следующая ячейка из маски; маска теряет этот бит
+static inline int nextMatch(uint32_t* bits) {
+    int index = __builtin_ctz(*bits);
+    *bits &= *bits - 1;
+    return index;
+}
 
-    for (;;) {
-        Entry* entry = &entries[index];
-        if (entry->key == NULL) {
-            if (IS_NIL(entry->value)) {
-                // Пустая ячейка
-                return tombstone != NULL ? tombstone : entry;
-            } else {
-                // Нашли надгробие
-                if (tombstone == NULL) tombstone = entry;
-            }
-        } else if (entry->key == key) {
-            // Нашли ключ
-            return entry;
+/*
+ * Пробы идут по группам: первая выбирается хэшем, дальше шаги 1, 2, 3... (треугольные числа).
+ * При числе групп — степени двойки такая последовательность обходит все группы.
+ * Возвращает индекс ячейки с ключом или -1
+ */
+static int findSlot(Table* table, ObjString* key) {
+    size_t groupMask = (size_t)table->capacity / TABLE_GROUP_WIDTH - 1;
+    size_t group = HASH_GROUP(key->hash) & groupMask;
+    uint8_t tag = HASH_TAG(key->hash);
+    for (size_t step = 1;; step++) {
+        size_t base = group * TABLE_GROUP_WIDTH;
+        uint32_t bits = matchTag(table->control + base, tag);
+        while (bits != 0) {
+            int slot = (int)base + nextMatch(&bits);
+            if (table->entries[slot].key == key) return slot;
         }
+        // Пустая ячейка в группе: дальше этот ключ вставляться не мог
+        if (matchEmpty(table->control + base) != 0) return -1;
+        group = (group + step) & groupMask;
+    }
+}
 
-        index = (index + 1) % capacity; // Для линейного поиска
+//* Первая свободная ячейка (пустая или надгробие) на пути проб хэша
+static int findFree(Table* table, uint32_t hash) {
+    size_t groupMask = (size_t)table->capacity / TABLE_GROUP_WIDTH - 1;
+    size_t group = HASH_GROUP(hash) & groupMask;
+    for (size_t step = 1;; step++) {
+        size_t base = group * TABLE_GROUP_WIDTH;
+        uint32_t bits = matchFree(table->control + base);
+        if (bits != 0) return (int)base + nextMatch(&bits);
+        group = (group + step) & groupMask;
     }
 }
 
 bool tableGet(Table* table, ObjString* key, Value* value) {
     if (table->count == 0) return false;
 
-    Entry* entry = findEntry(table->entries, table->capacity, key);
-    if (entry->key == NULL) return false;
+    int slot = findSlot(table, key);
+    if (slot < 0) return false;
 
-    *value = entry->value;
+    *value = table->entries[slot].value;
     return true;
 }
 
+//* Новый блок выделяется до того, как таблица меняется: ошибка нехватки памяти оставляет её целой
 static void adjustCapacity(Table* table, int capacity) {
-    Entry* entries = ALLOCATE(Entry, capacity);
-    for (int i = 0; i < capacity; i++) {
-        entries[i].key = NULL;
-        entries[i].value = NIL_VAL;
-    }
-    // Счётчик обнуляем, так как надгробия больше не нужны
-    table->count = 0;
+    Entry* entries = (Entry*)ALLOCATE(char, tableBytes(capacity));
+    Table resized;
+    resized.count = 0;
+    resized.tombstones = 0;
+    resized.capacity = capacity;
+    resized.entries = entries;
+    resized.control = (uint8_t*)(entries + capacity);
+    memset(resized.control, TABLE_EMPTY, (size_t)capacity);
 
+    // Надгробия не переносятся
     for (int i = 0; i < table->capacity; i++) {
+        if (table->control[i] & 0x80) continue;
         Entry* entry = &table->entries[i];
-        if (entry->key == NULL) continue;
-
-        Entry* dest = findEntry(entries, capacity, entry->key);
-        dest->key = entry->key;
-        dest->value = entry->value;
-
-        // Увеличимаем счётчик при вставке нового значения
-        table->count++;
+        int slot = findFree(&resized, entry->key->hash);
+        resized.control[slot] = HASH_TAG(entry->key->hash);
+        resized.entries[slot] = *entry;
+        resized.count++;
     }
 
-    FREE_ARRAY(Entry, table->entries, table->capacity);
-
-    table->entries = entries;
-    table->capacity = capacity;
+    FREE_ARRAY(char, table->entries, tableBytes(table->capacity));
+    *table = resized;
 }
 
 bool tableSet(Table* table, ObjString* key, Value value) {
-    if (table->count + 1 > table->capacity * TABLE_MAX_LOAD) {
-        int capacity = GROW_CAPACITY(table->capacity);
-        adjustCapacity(table, capacity);
+    if (table->count > 0) {
+        int slot = findSlot(table, key);
+        if (slot >= 0) {
+            table->entries[slot].value = value;
+            return false;
+        }
     }
-    Entry* entry = findEntry(table->entries, table->capacity, key);
-    bool isNewKey = entry->key == NULL;
 
-    if (isNewKey && IS_NIL(entry->value)) table->count++; // Увеличимаем счётчик, только если записали в ПУСТУЮ ячейку (надгробие не считается)
+    if (table->count + table->tombstones + 1 > TABLE_MAX_LOAD(table->capacity)) {
+        //* Если место заняли в основном надгробия, таблица перестраивается в той же ёмкости
+        int capacity = table->capacity < TABLE_GROUP_WIDTH ? TABLE_GROUP_WIDTH : table->capacity;
+        if ((table->count + 1) * 2 > TABLE_MAX_LOAD(capacity)) capacity *= 2;
+        adjustCapacity(table, capacity);
+    }
 
-    entry->key = key;
-    entry->value = value;
+    int slot = findFree(table, key->hash);
+    if (table->control[slot] == TABLE_DELETED) table->tombstones--;
+    table->control[slot] = HASH_TAG(key->hash);
+    table->entries[slot].key = key;
+    table->entries[slot].value = value;
+    table->count++;
+    return true;
+}
 
-    return isNewKey;
+/*
+ * Если в группе ячейки есть пустая, поиск и без этой ячейки останавливается на группе,
+ * и её можно сразу сделать пустой. Иначе остаётся надгробие, чтобы пробы шли дальше
+ */
+static void deleteSlot(Table* table, int slot) {
+    const uint8_t* group = table->control + (slot & ~(TABLE_GROUP_WIDTH - 1));
+    if (matchEmpty(group) != 0) {
+        table->control[slot] = TABLE_EMPTY;
+    } else {
+        table->control[slot] = TABLE_DELETED;
+        table->tombstones++;
+    }
+    table->entries[slot].key = NULL;
+    table->entries[slot].value = NIL_VAL;
+    table->count--;
 }
 
 bool tableDelete(Table* table, ObjString* key) {
-    if (table-> count == 0) return false;
+    if (table->count == 0) return false;
 
-    Entry* entry = findEntry(table->entries, table->capacity, key);
-    if (entry->key == NULL) return false;
+    int slot = findSlot(table, key);
+    if (slot < 0) return false;
 
-    // Вставка надгробия вместо удаленной записи
-    entry->key = NULL;
-    entry->value = BOOL_VAL(true);
+    deleteSlot(table, slot);
     return true;
 }
 
 void tableAddAll(Table* from, Table* to) {
     for (int i = 0; i < from->capacity; i++) {
-        Entry* entry = &from->entries[i];
-        if (entry->key != NULL) {
-            tableSet(to, entry->key, entry->value);
-        }
+        if (from->control[i] & 0x80) continue;
+        tableSet(to, from->entries[i].key, from->entries[i].value);
     }
 }
 
 ObjString* tableFindString(Table* table, const char* chars, int length, uint32_t hash) {
     if (table->count == 0) return NULL;
 
-    uint32_t index = hash % table->capacity; // Вычисляем индекс
+    size_t groupMask = (size_t)table->capacity / TABLE_GROUP_WIDTH - 1;
+    size_t group = HASH_GROUP(hash) & groupMask;
+    uint8_t tag = HASH_TAG(hash);
+    for (size_t step = 1;; step++) {
+        size_t base = group * TABLE_GROUP_WIDTH;
+        uint32_t bits = matchTag(table->control + base, tag);
+        while (bits != 0) {
+            ObjString* key = table->entries[base + nextMatch(&bits)].key;
+            if (key->length == length && key->hash == hash && memcmp(key->chars, chars, length) == 0) {
+                // Нашли ключ
+                return key;
+            }
+        }
+        // Остановится, если в группе есть пустая ячейка, не являющаяся надгробием
+        if (matchEmpty(table->control + base) != 0) return NULL;
+        group = (group + step) & groupMask;
+    }
+}
+//* Удаляет ключи, не помеченные сборщиком мусора: так таблица интернирования держит строки слабо
+void tableRemoveWhite(Table* table) {
+    for (int i = 0; i < table->capacity; i++) {
+        if (table->control[i] & 0x80) continue;
+        if (!isMarked((Obj*)table->entries[i].key)) deleteSlot(table, i);
+    }
+}
+
+void markTable(Table* table) {
+    for (int i = 0; i < table->capacity; i++) {
+        if (table->control[i] & 0x80) continue;
+        Entry* entry = &table->entries[i];
+        markObject((Obj*)entry->key);
+        markValue(entry->value);
+    }
+}
+
+
+//* Малая сборка: ключи и значения таблицы переписываются на перенесённые копии
+void forwardTable(Table* table) {
+    for (int i = 0; i < table->capacity; i++) {
+        if (table->control[i] & 0x80) continue;
+        Entry* entry = &table->entries[i];
+        entry->key = (ObjString*)forwardObject((Obj*)entry->key);
+        entry->value = forwardValue(entry->value);
+    }
+}
 
-    for (;;) {
-        Entry* entry = &table->entries[index];
-        if (entry->key == NULL) {
-            // Остановится, если мы найдем пустую ячейку, не являющуюся надгробием
-            if (IS_NIL(entry->value)) return NULL;
-        } else if (entry->key->length == length && entry->key->hash == hash && memcmp(entry->key->chars, chars, length) == 0) {
-            // Нашли ключ
-            return entry->key;
+//* Малая сборка для таблицы со слабыми ключами (vm.strings): перенесённый ключ заменяется копией,
+//* а молодой ключ, который никто не перенёс, мёртв и удаляется. Хэш копии тот же, ячейка не меняется
+void tableForwardWeak(Table* table) {
+    for (int i = 0; i < table->capacity; i++) {
+        if (table->control[i] & 0x80) continue;
+        Entry* entry = &table->entries[i];
+        if (!isYoung((Obj*)entry->key)) continue;
+        Obj* copy = objNext((Obj*)entry->key);
+        if (copy != NULL) {
+            entry->key = (ObjString*)copy;
+        } else {
+            deleteSlot(table, i);
         }
+    }
+}
 
-        index = (index + 1) % table->capacity;
+//* Номер шага проб, на котором поиск ключа с хэшем hash доходит до группы target (начиная с 1)
+static int probeLength(Table* table, uint32_t hash, size_t target) {
+    size_t groupMask = (size_t)table->capacity / TABLE_GROUP_WIDTH - 1;
+    size_t group = HASH_GROUP(hash) & groupMask;
+    int length = 1;
+    for (size_t step = 1; group != target; step++) {
+        group = (group + step) & groupMask;
+        length++;
     }
-}
\ No newline at end of file
+    return length;
+}
+
+//* Статистика считается обходом таблицы, так что поиск и вставка ничего не подсчитывают
+void tableStats(Table* table, TableStats* stats) {
+    stats->count = table->count;
+    stats->capacity = table->capacity;
+    stats->tombstones = table->tombstones;
+    stats->averageProbe = 0;
+    stats->maxProbe = 0;
+    stats->collisions = 0;
+    stats->tagCollisions = 0;
+    long total = 0;
+    for (int i = 0; i < table->capacity; i++) {
+        if (table->control[i] & 0x80) continue;
+        size_t group = (size_t)i / TABLE_GROUP_WIDTH;
+        int length = probeLength(table, table->entries[i].key->hash, group);
+        total += length;
+        if (length > stats->maxProbe) stats->maxProbe = length;
+        if (length > 1) stats->collisions++;
+        //* Совпавший байт в группе — лишнее сравнение ключа при поиске
+        uint32_t bits = matchTag(table->control + group * TABLE_GROUP_WIDTH, table->control[i]);
+        if (bits & (bits - 1)) stats->tagCollisions++;
+    }
+    if (table->count > 0) stats->averageProbe = (double)total / table->count;
+}
+
+void printTableStats(const char* name, Table* table) {
+    TableStats stats;
+    tableStats(table, &stats);
+    fprintf(stderr, "%-18s %d of %d slots, %d tombstones, probe avg %.2f max %d groups, "
+            "%d displaced, %d tag collisions\n", name, stats.count, stats.capacity, stats.tombstones,
+            stats.averageProbe, stats.maxProbe, stats.collisions, stats.tagCollisions);
+}
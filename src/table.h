@@ -10,13 +10,37 @@ typedef struct {
     Value value;
 } Entry;
 
-/* ХЭш-таблица */
+/*
+ * ХЭш-таблица с открытой адресацией в духе Swiss table.
+ * Ёмкость — степень двойки, не меньше TABLE_GROUP_WIDTH. На каждую запись приходится управляющий байт:
+ * 7 младших битов хэша ключа для занятой ячейки, TABLE_EMPTY или TABLE_DELETED (надгробие).
+ * Поиск сравнивает сразу группу из TABLE_GROUP_WIDTH управляющих байтов и заглядывает в entries
+ * только для совпавших, так что цепочки проб почти не трогают сами записи.
+ * entries и control выделяются одним блоком: control лежит сразу за entries
+ */
+#define TABLE_GROUP_WIDTH 16
+#define TABLE_EMPTY ((uint8_t)0x80)
+#define TABLE_DELETED ((uint8_t)0xfe)
+
 typedef struct {
-    int count;
+    int count; // Живые записи
+    int tombstones; // Надгробия: ячейки, которые нельзя считать пустыми при поиске
     int capacity;
     Entry* entries;
+    uint8_t* control;
 } Table;
 
+//* Качество хэша для clox --stats: сколько групп просматривает поиск каждого ключа
+typedef struct {
+    int count;
+    int capacity;
+    int tombstones;
+    double averageProbe; // Средняя длина проб в группах (1 — ключ в своей группе)
+    int maxProbe;
+    int collisions; // Ключи, вытесненные из своей группы
+    int tagCollisions; // Ключи, чей управляющий байт совпал с байтом другого ключа той же группы
+} TableStats;
+
 void initTable(Table* table);
 void freeTable(Table* table);
 bool tableGet(Table* table, ObjString* key, Value* value);
@@ -24,6 +48,11 @@ bool tableSet(Table* table, ObjString* key, Value value);
 bool tableDelete(Table* table, ObjString* key);
 void tableAddAll(Table* from, Table* to);
 ObjString* tableFindString(Table* table, const char* chars, int length, uint32_t hash);
+void tableRemoveWhite(Table* table);
+void markTable(Table* table);
+void forwardTable(Table* table);
+void tableForwardWeak(Table* table);
+void tableStats(Table* table, TableStats* stats);
+void printTableStats(const char* name, Table* table);
 
 #endif
-
@@ -0,0 +1,1121 @@
+#include <stddef.h>
+#include <stdio.h>
+
+#include "common.h"
+#include "trace.h"
+
+#ifdef JIT
+
+#include "assembler.h"
+#include "debug.h"
+#include "jit.h"
+#include "memory.h"
+
+/*
+ * Трассирующий JIT.
+ *
+ * Запись. Когда обратный переход цикла выполнился TRACE_THRESHOLD раз, traceLoop сама
+ * выполняет следующую итерацию цикла (record) и записывает каждую выполненную инструкцию
+ * вместе с типами её операндов. Переходы не записываются как переходы: трасса линейна и идёт
+ * по тем ветвям, которые были выбраны на этой итерации. Запись заканчивается, когда управление
+ * возвращается к заголовку цикла, и срывается на инструкциях, которых трасса не поддерживает
+ * (вызовы, замыкания, возврат), на ошибках и на вложенном цикле. При срыве интерпретатор
+ * продолжает ровно с той инструкции, на которой остановилась запись: состояние VM общее.
+ *
+ * Компиляция. Трасса переводится в машинный код с теми же приёмами, что и регистровый
+ * бэкенд (regcompiler.c): значения на стеке отложены — копии локальных и глобальных переменных
+ * и константы читаются прямо из источника, а результат арифметики остаётся в xmm0.
+ * Типы значений известны компилятору трассы: каждое значение проверяется один раз,
+ * при первом использовании, а дальше его тип выводится (результат арифметики — число и т. п.).
+ * Проверка, не совпавшая с записанным, — это боковой выход: он материализует отложенные
+ * значения, выставляет vm.stackTop и frame->ip и возвращает управление интерпретатору,
+ * который выполнит эту инструкцию сам. Поэтому машинный код трассы никогда не сообщает ошибок.
+ *
+ * Во время работы трассы: rbx — frame->slots, r13 — CallFrame*,
+ * r14 — vm.globalValues.values, r15 — маска QNAN.
+ */
+
+#define SLOT(position) ((int32_t)((position) * (int)sizeof(Value)))
+
+static TraceCache cache = {0, 0, NULL};
+static int traceCount = 0; // Для нумерации трасс в отладочном выводе
+
+static const char* typeName(TraceType type) {
+    switch (type) {
+        case TYPE_NUMBER: return "number";
+        case TYPE_BOOL: return "bool";
+        case TYPE_NIL: return "nil";
+        case TYPE_STRING: return "string";
+        case TYPE_OBJECT: return "object";
+        default: return "?";
+    }
+}
+
+static TraceType typeOf(Value value) {
+    if (IS_NUMBER(value)) return TYPE_NUMBER;
+    if (IS_BOOL(value)) return TYPE_BOOL;
+    if (IS_NIL(value)) return TYPE_NIL;
+    if (IS_STRING(value)) return TYPE_STRING;
+    if (IS_OBJ(value)) return TYPE_OBJECT;
+    return TYPE_UNKNOWN;
+}
+
+static int traceLine(Trace* trace, uint8_t* ip) {
+    return trace->function->chunk.lines[ip - trace->function->chunk.code];
+}
+
+static const char* functionName(ObjFunction* function) {
+    return function->name != NULL ? function->name->chars : "script";
+}
+
+//* Кэш трасс
+
+static uint32_t hashHeader(uint8_t* header) {
+    uint64_t key = (uint64_t)(uintptr_t)header;
+    return (uint32_t)((key * 0x9e3779b97f4a7c15u) >> 32);
+}
+
+static TraceEntry* findEntry(TraceEntry* entries, int capacity, uint8_t* header) {
+    uint32_t index = hashHeader(header) & (capacity - 1);
+    for (;;) {
+        TraceEntry* entry = &entries[index];
+        if (entry->header == header || entry->header == NULL) return entry;
+        index = (index + 1) & (capacity - 1);
+    }
+}
+
+static void adjustCapacity(int capacity) {
+    TraceEntry* entries = ALLOCATE(TraceEntry, capacity);
+    for (int i = 0; i < capacity; i++) {
+        entries[i].header = NULL;
+        entries[i].trace = NULL;
+    }
+
+    cache.count = 0;
+    for (int i = 0; i < cache.capacity; i++) {
+        TraceEntry* entry = &cache.entries[i];
+        if (entry->header == NULL) continue;
+        *findEntry(entries, capacity, entry->header) = *entry;
+        cache.count++;
+    }
+
+    FREE_ARRAY(TraceEntry, cache.entries, cache.capacity);
+    cache.entries = entries;
+    cache.capacity = capacity;
+}
+
+//* Запись кэша для цикла с заголовком header; заводит новую, если цикл встретился впервые
+static TraceEntry* cacheEntry(uint8_t* header, ObjFunction* function) {
+    if ((cache.count + 1) * 4 > cache.capacity * 3) {
+        adjustCapacity(cache.capacity < 16 ? 16 : cache.capacity * 2);
+    }
+
+    TraceEntry* entry = findEntry(cache.entries, cache.capacity, header);
+    if (entry->header == NULL) {
+        entry->header = header;
+        entry->function = function;
+        entry->hotness = 0;
+        entry->aborts = 0;
+        entry->trace = NULL;
+        cache.count++;
+    }
+    return entry;
+}
+
+static void freeTrace(Trace* trace) {
+    if (trace->native != NULL) unmapCode(trace->native, trace->nativeSize);
+    FREE_ARRAY(TraceInstruction, trace->code, trace->capacity);
+    FREE_ARRAY(TraceExit, trace->exits, trace->exitCapacity);
+    FREE(Trace, trace);
+}
+
+//* Запись трассы
+
+static TraceInstruction* appendInstruction(Trace* trace, uint8_t* ip, uint8_t opcode) {
+    if (trace->capacity < trace->count + 1) {
+        int oldCapacity = trace->capacity;
+        trace->capacity = GROW_CAPACITY(oldCapacity);
+        trace->code = GROW_ARRAY(TraceInstruction, trace->code, oldCapacity, trace->capacity);
+    }
+    TraceInstruction* instruction = &trace->code[trace->count++];
+    instruction->ip = ip;
+    instruction->opcode = opcode;
+    instruction->types[0] = TYPE_UNKNOWN;
+    instruction->types[1] = TYPE_UNKNOWN;
+    instruction->taken = false;
+    return instruction;
+}
+
+//* Этот обратный переход уже встречался в трассе: значит, запись крутит вложенный цикл
+static bool seenLoop(Trace* trace, uint8_t* ip) {
+    for (int i = 0; i < trace->count - 1; i++) {
+        if (trace->code[i].ip == ip) return true;
+    }
+    return false;
+}
+
+/*
+ * Выполняет одну итерацию цикла, начиная с frame->ip (заголовка), и записывает её в trace.
+ * Возвращает true, если итерация дошла до обратного перехода на заголовок.
+ * В любом случае frame->ip указывает на следующую невыполненную инструкцию.
+ */
+static bool record(Trace* trace, CallFrame* frame) {
+    Chunk* chunk = &frame->closure->function->chunk;
+    uint8_t* ip = frame->ip;
+    #define BINARY_TYPES() \
+        do { \
+            instruction->types[0] = typeOf(peek(1)); \
+            instruction->types[1] = typeOf(peek(0)); \
+        } while (false)
+    #define NUMBERS() (IS_NUMBER(peek(0)) && IS_NUMBER(peek(1)))
+
+    for (;;) {
+        if (trace->count == TRACE_MAX_LENGTH) break;
+        uint8_t opcode = genericOpcode(*ip);
+        uint8_t* next = ip + opcodeLength(chunk, (int)(ip - chunk->code), opcode);
+        TraceInstruction* instruction = appendInstruction(trace, ip, opcode);
+
+        switch (opcode) {
+            case OP_CONSTANT: push(chunk->constants.values[ip[1]]); break;
+            case OP_NIL: push(NIL_VAL); break;
+            case OP_TRUE: push(BOOL_VAL(true)); break;
+            case OP_FALSE: push(BOOL_VAL(false)); break;
+            case OP_POP: pop(); break;
+            case OP_GET_LOCAL:
+                push(frame->slots[ip[1]]);
+                instruction->types[0] = typeOf(peek(0));
+                break;
+            case OP_SET_LOCAL: frame->slots[ip[1]] = peek(0); break;
+            case OP_GET_GLOBAL:
+            case OP_SET_GLOBAL: {
+                int slot = (ip[1] << 8) | ip[2];
+                Value* global = &vm.globalValues.values[slot];
+                //* Ошибку "Undefined variable" сообщит интерпретатор
+                if (IS_UNDEFINED(*global)) goto abort;
+                if (opcode == OP_GET_GLOBAL) {
+                    push(*global);
+                    instruction->types[0] = typeOf(peek(0));
+                } else {
+                    *global = peek(0);
+                }
+                break;
+            }
+            case OP_GET_UPVALUE:
+                push(*frame->closure->upvalues[ip[1]]->location);
+                instruction->types[0] = typeOf(peek(0));
+                break;
+            case OP_SET_UPVALUE: *frame->closure->upvalues[ip[1]]->location = peek(0); break;
+            case OP_EQUAL: {
+                BINARY_TYPES();
+                Value b = pop();
+                Value a = pop();
+                push(BOOL_VAL(valuesEqual(a, b)));
+                break;
+            }
+            case OP_GREATER:
+            case OP_LESS: {
+                if (!NUMBERS()) goto abort;
+                BINARY_TYPES();
+                double b = AS_NUMBER(pop());
+                double a = AS_NUMBER(pop());
+                push(BOOL_VAL(opcode == OP_GREATER ? a > b : a < b));
+                break;
+            }
+            case OP_ADD:
+                BINARY_TYPES();
+                if (IS_STRING(peek(0)) && IS_STRING(peek(1))) {
+                    concatenate();
+                } else if (NUMBERS()) {
+                    double b = AS_NUMBER(pop());
+                    double a = AS_NUMBER(pop());
+                    push(NUMBER_VAL(a + b));
+                } else {
+                    goto abort;
+                }
+                break;
+            case OP_SUBTRACT:
+            case OP_MULTIPLY:
+            case OP_DIVIDE: {
+                if (!NUMBERS()) goto abort;
+                BINARY_TYPES();
+                double b = AS_NUMBER(pop());
+                double a = AS_NUMBER(pop());
+                double result = opcode == OP_SUBTRACT ? a - b : opcode == OP_MULTIPLY ? a * b : a / b;
+                push(NUMBER_VAL(result));
+                break;
+            }
+            case OP_NOT:
+                instruction->types[0] = typeOf(peek(0));
+                push(BOOL_VAL(isFalsey(pop())));
+                break;
+            case OP_NEGATE:
+                if (!IS_NUMBER(peek(0))) goto abort;
+                instruction->types[0] = TYPE_NUMBER;
+                push(NUMBER_VAL(-AS_NUMBER(pop())));
+                break;
+            case OP_PRINT:
+                printValue(pop());
+                printf("\n");
+                break;
+            case OP_JUMP:
+                next += (uint16_t)((ip[1] << 8) | ip[2]);
+                break;
+            case OP_JUMP_IF_FALSE:
+                instruction->types[0] = typeOf(peek(0));
+                instruction->taken = isFalsey(peek(0));
+                if (instruction->taken) next += (uint16_t)((ip[1] << 8) | ip[2]);
+                break;
+            case OP_LOOP:
+                next -= (uint16_t)((ip[1] << 8) | ip[2]);
+                if (next == trace->header) {
+                    frame->ip = next;
+                    return true;
+                }
+                //* Обратный переход внутри тела (инкремент цикла for) — просто идём по нему;
+                //* повторный — это вложенный цикл, у которого будет своя трасса.
+                //* Если у цели уже есть трасса, этот цикл ею и выполняется
+                if (seenLoop(trace, ip) || findEntry(cache.entries, cache.capacity, next)->trace != NULL) goto abort;
+                break;
+            default:
+                //* Вызовы, замыкания, возврат из функции и т. п. трасса не поддерживает
+                goto abort;
+        }
+
+        int depth = (int)(vm.stackTop - frame->slots);
+        if (depth > trace->maxDepth) trace->maxDepth = depth;
+        ip = next;
+    }
+
+abort:
+    if (vm.dumpTraces) {
+        fprintf(stderr, "-- trace aborted in %s() at line %d: %s\n", functionName(trace->function),
+                traceLine(trace, ip), opcodeName(genericOpcode(*ip)));
+    }
+    frame->ip = ip;
+    return false;
+
+    #undef NUMBERS
+    #undef BINARY_TYPES
+}
+
+//* Компиляция трассы
+
+typedef enum {
+    OPERAND_STACK, // значение лежит в своей ячейке стека
+    OPERAND_LOCAL, // значение — копия ячейки index (локальной переменной)
+    OPERAND_GLOBAL, // значение — копия глобальной переменной index
+    OPERAND_CONSTANT, // значение известно при компиляции
+    OPERAND_XMM0, // число пока только в регистре xmm0
+} OperandKind;
+
+typedef struct {
+    OperandKind kind;
+    int index;
+    Value value;
+    TraceType type; // Известный тип значения или TYPE_UNKNOWN
+} Operand;
+
+//* Выход, код которого будет выдан после тела трассы
+typedef struct {
+    int position; // Смещение операнда условного перехода на выход
+    int exit; // Номер выхода в trace->exits
+    int depth;
+    Operand* snapshot; // Отложенные значения стека в момент выхода
+} PendingExit;
+
+typedef struct {
+    Assembler as;
+    Trace* trace;
+    TraceInstruction* instruction; // Переводимая инструкция
+    Operand* operands;
+    int depth;
+    int xmmOwner; // Ячейка, значение которой лежит в xmm0, или -1
+    TraceType* globalTypes;
+    bool* globalDefined;
+    int globalCount;
+    PendingExit* pending;
+    int pendingCount;
+    int pendingCapacity;
+    bool hadError;
+} TraceCompiler;
+
+//* Записывает значение operand в ячейку стека position
+static void storeOperand(Assembler* as, Operand* operand, int position) {
+    switch (operand->kind) {
+        case OPERAND_STACK:
+            break;
+        case OPERAND_LOCAL:
+            if (operand->index == position) break;
+            load(as, RAX, RBX, SLOT(operand->index));
+            store(as, RBX, SLOT(position), RAX);
+            break;
+        case OPERAND_GLOBAL:
+            load(as, RAX, R14, SLOT(operand->index));
+            store(as, RBX, SLOT(position), RAX);
+            break;
+        case OPERAND_CONSTANT:
+            moveImmediate(as, RAX, operand->value);
+            store(as, RBX, SLOT(position), RAX);
+            break;
+        case OPERAND_XMM0:
+            storeXmm(as, RBX, SLOT(position), XMM0);
+            break;
+    }
+}
+
+static void materialize(TraceCompiler* compiler, int position) {
+    Operand* operand = &compiler->operands[position];
+    storeOperand(&compiler->as, operand, position);
+    if (operand->kind == OPERAND_XMM0) compiler->xmmOwner = -1;
+    operand->kind = OPERAND_STACK;
+}
+
+static void flush(TraceCompiler* compiler) {
+    for (int i = 0; i < compiler->depth; i++) {
+        materialize(compiler, i);
+    }
+}
+
+//* xmm0 сейчас понадобится (или его испортит вызов помощника): выгружаем его владельца, если это не keep
+static void releaseXmm(TraceCompiler* compiler, int keep1, int keep2) {
+    int owner = compiler->xmmOwner;
+    if (owner != -1 && owner != keep1 && owner != keep2) materialize(compiler, owner);
+}
+
+//* Перед записью в локальную (global = false) или глобальную переменную index материализуем её отложенные копии
+static void invalidate(TraceCompiler* compiler, OperandKind kind, int index, int except) {
+    for (int i = 0; i < compiler->depth; i++) {
+        Operand* operand = &compiler->operands[i];
+        if (i != except && operand->kind == kind && operand->index == index) materialize(compiler, i);
+    }
+}
+
+static void loadOperand(TraceCompiler* compiler, Register reg, int position) {
+    Assembler* as = &compiler->as;
+    Operand* operand = &compiler->operands[position];
+    switch (operand->kind) {
+        case OPERAND_STACK: load(as, reg, RBX, SLOT(position)); break;
+        case OPERAND_LOCAL: load(as, reg, RBX, SLOT(operand->index)); break;
+        case OPERAND_GLOBAL: load(as, reg, R14, SLOT(operand->index)); break;
+        case OPERAND_CONSTANT: moveImmediate(as, reg, operand->value); break;
+        case OPERAND_XMM0: moveFromXmm(as, reg, XMM0); break;
+    }
+}
+
+static void loadNumber(TraceCompiler* compiler, XmmRegister xmm, int position) {
+    Assembler* as = &compiler->as;
+    Operand* operand = &compiler->operands[position];
+    switch (operand->kind) {
+        case OPERAND_STACK: loadXmm(as, xmm, RBX, SLOT(position)); break;
+        case OPERAND_LOCAL: loadXmm(as, xmm, RBX, SLOT(operand->index)); break;
+        case OPERAND_GLOBAL: loadXmm(as, xmm, R14, SLOT(operand->index)); break;
+        case OPERAND_CONSTANT:
+            moveImmediate(as, RAX, operand->value);
+            moveToXmm(as, xmm, RAX);
+            break;
+        case OPERAND_XMM0:
+            if (xmm != XMM0) sseOp(as, 0x66, SSE_MOVE, xmm, XMM0);
+            break;
+    }
+}
+
+static void pushOperand(TraceCompiler* compiler, OperandKind kind, int index, Value value, TraceType type) {
+    Operand* operand = &compiler->operands[compiler->depth++];
+    operand->kind = kind;
+    operand->index = index;
+    operand->value = value;
+    operand->type = type;
+}
+
+static void pushConstant(TraceCompiler* compiler, Value value) {
+    pushOperand(compiler, OPERAND_CONSTANT, 0, value, typeOf(value));
+}
+
+//* Заменяет верхние значения стека, начиная с position, результатом
+static void setResult(TraceCompiler* compiler, int position, OperandKind kind, Value value, TraceType type) {
+    if (compiler->xmmOwner >= position) compiler->xmmOwner = -1;
+    compiler->depth = position;
+    pushOperand(compiler, kind, 0, value, type);
+    if (kind == OPERAND_XMM0) compiler->xmmOwner = position;
+}
+
+//* Значение в ячейке position оказалось типа type: это верно и для всех его копий и источника
+static void learnType(TraceCompiler* compiler, int position, TraceType type) {
+    Operand* operand = &compiler->operands[position];
+    operand->type = type;
+    OperandKind kind = operand->kind;
+    int source = position;
+    if (kind == OPERAND_GLOBAL) {
+        source = operand->index;
+        compiler->globalTypes[source] = type;
+    } else if (kind == OPERAND_LOCAL) {
+        source = operand->index;
+        compiler->operands[source].type = type;
+    } else if (kind != OPERAND_STACK) {
+        return;
+    }
+    if (kind == OPERAND_STACK) kind = OPERAND_LOCAL;
+    for (int i = 0; i < compiler->depth; i++) {
+        if (compiler->operands[i].kind == kind && compiler->operands[i].index == source) {
+            compiler->operands[i].type = type;
+        }
+    }
+}
+
+/*
+ * Условный переход на боковой выход. Снимок отложенных значений стека берётся сейчас,
+ * а код выхода выдаётся после тела трассы. Интерпретатор продолжит с инструкции resume.
+ */
+static void exitIf(TraceCompiler* compiler, Condition condition, uint8_t* resume) {
+    Trace* trace = compiler->trace;
+    if (trace->exitCapacity < trace->exitCount + 1) {
+        int oldCapacity = trace->exitCapacity;
+        trace->exitCapacity = GROW_CAPACITY(oldCapacity);
+        trace->exits = GROW_ARRAY(TraceExit, trace->exits, oldCapacity, trace->exitCapacity);
+    }
+    trace->exits[trace->exitCount].ip = resume;
+    trace->exits[trace->exitCount].count = 0;
+
+    if (compiler->pendingCapacity < compiler->pendingCount + 1) {
+        int oldCapacity = compiler->pendingCapacity;
+        compiler->pendingCapacity = GROW_CAPACITY(oldCapacity);
+        compiler->pending = GROW_ARRAY(PendingExit, compiler->pending, oldCapacity, compiler->pendingCapacity);
+    }
+    PendingExit* exit = &compiler->pending[compiler->pendingCount++];
+    exit->position = jumpForward(&compiler->as, condition);
+    exit->exit = trace->exitCount++;
+    exit->depth = compiler->depth;
+    exit->snapshot = ALLOCATE(Operand, compiler->depth);
+    for (int i = 0; i < compiler->depth; i++) {
+        exit->snapshot[i] = compiler->operands[i];
+    }
+}
+
+//* Проверка типа: если значение не число, выходим перед текущей инструкцией
+static void guardNumber(TraceCompiler* compiler, int position) {
+    if (compiler->operands[position].type == TYPE_NUMBER) return;
+    Assembler* as = &compiler->as;
+    loadOperand(compiler, RAX, position);
+    moveRegister(as, RDX, RAX);
+    aluRegister(as, AND_REGISTER, RDX, R15);
+    aluRegister(as, CMP_REGISTER, RDX, R15);
+    exitIf(compiler, CC_E, compiler->instruction->ip);
+    learnType(compiler, position, TYPE_NUMBER);
+}
+
+//* Глобальная переменная определена; однажды определённая, она такой и остаётся
+static void guardDefined(TraceCompiler* compiler, int slot) {
+    if (compiler->globalDefined[slot]) return;
+    Assembler* as = &compiler->as;
+    load(as, RAX, R14, SLOT(slot));
+    moveImmediate(as, RDX, UNDEFINED_VAL);
+    aluRegister(as, CMP_REGISTER, RAX, RDX);
+    exitIf(compiler, CC_E, compiler->instruction->ip);
+    compiler->globalDefined[slot] = true;
+}
+
+static bool bothConstant(TraceCompiler* compiler, int a) {
+    return compiler->operands[a].kind == OPERAND_CONSTANT && compiler->operands[a + 1].kind == OPERAND_CONSTANT;
+}
+
+//* Проверяет, что оба операнда — числа, и загружает их в xmm0 и xmm1
+static void loadNumbers(TraceCompiler* compiler, int a) {
+    int b = a + 1;
+    releaseXmm(compiler, a, b);
+    guardNumber(compiler, a);
+    guardNumber(compiler, b);
+    if (compiler->operands[b].kind == OPERAND_XMM0) {
+        loadNumber(compiler, XMM1, b);
+        loadNumber(compiler, XMM0, a);
+    } else {
+        loadNumber(compiler, XMM0, a);
+        loadNumber(compiler, XMM1, b);
+    }
+}
+
+static void numberOp(TraceCompiler* compiler, uint8_t sseOpcode) {
+    int a = compiler->depth - 2;
+    if (bothConstant(compiler, a) && IS_NUMBER(compiler->operands[a].value) && IS_NUMBER(compiler->operands[a + 1].value)) {
+        //* Свёртка констант
+        double x = AS_NUMBER(compiler->operands[a].value);
+        double y = AS_NUMBER(compiler->operands[a + 1].value);
+        double result = sseOpcode == SSE_ADD ? x + y : sseOpcode == SSE_SUBTRACT ? x - y :
+            sseOpcode == SSE_MULTIPLY ? x * y : x / y;
+        setResult(compiler, a, OPERAND_CONSTANT, NUMBER_VAL(result), TYPE_NUMBER);
+        return;
+    }
+    loadNumbers(compiler, a);
+    sseOp(&compiler->as, 0xf2, sseOpcode, XMM0, XMM1);
+    setResult(compiler, a, OPERAND_XMM0, 0, TYPE_NUMBER);
+}
+
+//* Логическое значение по флагам: rax = condition ? true : false
+static void storeCondition(TraceCompiler* compiler, Condition condition, int position) {
+    Assembler* as = &compiler->as;
+    setCondition(as, condition);
+    emit(as, 0x0f); emit(as, 0xb6); emit(as, 0xc0); // movzx eax, al
+    moveImmediate(as, RCX, FALSE_VAL);
+    aluRegister(as, ADD_REGISTER, RAX, RCX);
+    store(as, RBX, SLOT(position), RAX);
+    setResult(compiler, position, OPERAND_STACK, 0, TYPE_BOOL);
+}
+
+static void compareOp(TraceCompiler* compiler, bool less) {
+    int a = compiler->depth - 2;
+    TraceInstruction* next = compiler->instruction + 1;
+    if (bothConstant(compiler, a)) {
+        double x = AS_NUMBER(compiler->operands[a].value);
+        double y = AS_NUMBER(compiler->operands[a + 1].value);
+        setResult(compiler, a, OPERAND_CONSTANT, BOOL_VAL(less ? x < y : x > y), TYPE_BOOL);
+        return;
+    }
+    loadNumbers(compiler, a);
+    //* a < b вычисляется как b > a: ucomisd xmm1, xmm0; для a > b — ucomisd xmm0, xmm1
+    sseOp(&compiler->as, 0x66, SSE_COMPARE, less ? XMM1 : XMM0, less ? XMM0 : XMM1);
+
+    if (next < compiler->trace->code + compiler->trace->count && next->opcode == OP_JUMP_IF_FALSE) {
+        //* Условие цикла или if: результат сравнения известен по записи, флаги сразу проверяются выходом.
+        //* На выходе на стеке лежит противоположный результат, и JUMP_IF_FALSE выполнит интерпретатор
+        bool result = !next->taken;
+        setResult(compiler, a, OPERAND_CONSTANT, BOOL_VAL(!result), TYPE_BOOL);
+        exitIf(compiler, result ? CC_BE : CC_A, next->ip);
+        compiler->operands[a].value = BOOL_VAL(result);
+        return;
+    }
+    storeCondition(compiler, CC_A, a);
+}
+
+//* Помощники, которые вызывает машинный код трассы
+
+static Value traceEqual(Value a, Value b) {
+    return BOOL_VAL(valuesEqual(a, b));
+}
+
+static bool traceConcatenate() {
+    if (!IS_STRING(peek(0)) || !IS_STRING(peek(1))) return false;
+    concatenate();
+    return true;
+}
+
+static void tracePrint(Value value) {
+    printValue(value);
+    printf("\n");
+}
+
+static void equalOp(TraceCompiler* compiler) {
+    Assembler* as = &compiler->as;
+    TraceInstruction* instruction = compiler->instruction;
+    int a = compiler->depth - 2;
+    if (bothConstant(compiler, a)) {
+        Value result = BOOL_VAL(valuesEqual(compiler->operands[a].value, compiler->operands[a + 1].value));
+        setResult(compiler, a, OPERAND_CONSTANT, result, TYPE_BOOL);
+        return;
+    }
+    if (instruction->types[0] == TYPE_NUMBER && instruction->types[1] == TYPE_NUMBER) {
+        //* Числа сравниваются как double: при NaN (PF = 1) результат false
+        loadNumbers(compiler, a);
+        sseOp(as, 0x66, SSE_COMPARE, XMM0, XMM1);
+        moveImmediate(as, RAX, FALSE_VAL);
+        int notEqual = jumpForward(as, CC_NE);
+        int unordered = jumpForward(as, CC_P);
+        moveImmediate(as, RAX, TRUE_VAL);
+        patchHere(as, notEqual);
+        patchHere(as, unordered);
+    } else {
+        releaseXmm(compiler, -1, -1);
+        loadOperand(compiler, RDI, a);
+        loadOperand(compiler, RSI, a + 1);
+        callHelper(as, traceEqual);
+    }
+    store(as, RBX, SLOT(a), RAX);
+    setResult(compiler, a, OPERAND_STACK, 0, TYPE_BOOL);
+}
+
+//* Конкатенация строк: помощнику нужны оба операнда на настоящем стеке VM
+static void concatenateOp(TraceCompiler* compiler) {
+    Assembler* as = &compiler->as;
+    int a = compiler->depth - 2;
+    //* Помощник может запустить сборку мусора, а она просматривает стек целиком:
+    //* отложенных значений (и устаревших слотов под ними) на нём остаться не должно
+    flush(compiler);
+    moveRegister(as, RAX, RBX);
+    addImmediate(as, RAX, SLOT(compiler->depth));
+    moveImmediate(as, RCX, (uint64_t)(uintptr_t)&vm.stackTop);
+    store(as, RCX, 0, RAX);
+    callHelper(as, traceConcatenate);
+    testResult(as);
+    exitIf(compiler, CC_E, compiler->instruction->ip);
+    setResult(compiler, a, OPERAND_STACK, 0, TYPE_STRING);
+}
+
+static void notOp(TraceCompiler* compiler) {
+    Assembler* as = &compiler->as;
+    int top = compiler->depth - 1;
+    Operand* operand = &compiler->operands[top];
+    switch (operand->type) {
+        case TYPE_NUMBER:
+        case TYPE_STRING:
+        case TYPE_OBJECT:
+            setResult(compiler, top, OPERAND_CONSTANT, FALSE_VAL, TYPE_BOOL);
+            return;
+        case TYPE_NIL:
+            setResult(compiler, top, OPERAND_CONSTANT, TRUE_VAL, TYPE_BOOL);
+            return;
+        case TYPE_BOOL:
+            if (operand->kind == OPERAND_CONSTANT) {
+                setResult(compiler, top, OPERAND_CONSTANT, BOOL_VAL(!AS_BOOL(operand->value)), TYPE_BOOL);
+                return;
+            }
+            //* true и false различаются младшим битом
+            loadOperand(compiler, RAX, top);
+            moveImmediate(as, RDX, 1);
+            aluRegister(as, XOR_REGISTER, RAX, RDX);
+            break;
+        default: {
+            loadOperand(compiler, RAX, top);
+            moveImmediate(as, RDX, NIL_VAL);
+            aluRegister(as, CMP_REGISTER, RAX, RDX);
+            int isNil = jumpForward(as, CC_E);
+            moveImmediate(as, RDX, FALSE_VAL);
+            aluRegister(as, CMP_REGISTER, RAX, RDX);
+            int isFalse = jumpForward(as, CC_E);
+            moveImmediate(as, RAX, FALSE_VAL);
+            int done = jumpForward(as, JUMP_ALWAYS);
+            patchHere(as, isNil);
+            patchHere(as, isFalse);
+            moveImmediate(as, RAX, TRUE_VAL);
+            patchHere(as, done);
+            break;
+        }
+    }
+    store(as, RBX, SLOT(top), RAX);
+    setResult(compiler, top, OPERAND_STACK, 0, TYPE_BOOL);
+}
+
+static void negateOp(TraceCompiler* compiler) {
+    Assembler* as = &compiler->as;
+    int top = compiler->depth - 1;
+    Operand* operand = &compiler->operands[top];
+    if (operand->kind == OPERAND_CONSTANT && IS_NUMBER(operand->value)) {
+        setResult(compiler, top, OPERAND_CONSTANT, NUMBER_VAL(-AS_NUMBER(operand->value)), TYPE_NUMBER);
+        return;
+    }
+    guardNumber(compiler, top);
+    loadOperand(compiler, RAX, top);
+    moveImmediate(as, RDX, SIGN_BIT);
+    aluRegister(as, XOR_REGISTER, RAX, RDX);
+    store(as, RBX, SLOT(top), RAX);
+    setResult(compiler, top, OPERAND_STACK, 0, TYPE_NUMBER);
+}
+
+/*
+ * JUMP_IF_FALSE: трасса идёт по записанной ветви, а проверка выходит,
+ * если значение условия ведёт в другую. Тогда переход выполнит интерпретатор.
+ */
+static void jumpIfFalseOp(TraceCompiler* compiler) {
+    Assembler* as = &compiler->as;
+    TraceInstruction* instruction = compiler->instruction;
+    int top = compiler->depth - 1;
+    Operand* operand = &compiler->operands[top];
+    if (operand->kind == OPERAND_CONSTANT) return;
+    if (operand->type == TYPE_NUMBER || operand->type == TYPE_STRING || operand->type == TYPE_OBJECT) return;
+
+    loadOperand(compiler, RAX, top);
+    if (instruction->taken) {
+        //* Было ложно: ровно nil или ровно false
+        Value value = instruction->types[0] == TYPE_NIL ? NIL_VAL : FALSE_VAL;
+        moveImmediate(as, RDX, value);
+        aluRegister(as, CMP_REGISTER, RAX, RDX);
+        exitIf(compiler, CC_NE, instruction->ip);
+        operand->kind = OPERAND_CONSTANT;
+        operand->value = value;
+        operand->type = typeOf(value);
+    } else {
+        moveImmediate(as, RDX, NIL_VAL);
+        aluRegister(as, CMP_REGISTER, RAX, RDX);
+        exitIf(compiler, CC_E, instruction->ip);
+        moveImmediate(as, RDX, FALSE_VAL);
+        aluRegister(as, CMP_REGISTER, RAX, RDX);
+        exitIf(compiler, CC_E, instruction->ip);
+        if (operand->type == TYPE_BOOL) {
+            operand->kind = OPERAND_CONSTANT;
+            operand->value = TRUE_VAL;
+        }
+    }
+}
+
+static void setLocal(TraceCompiler* compiler, int slot) {
+    Assembler* as = &compiler->as;
+    int top = compiler->depth - 1;
+    Operand value = compiler->operands[top];
+    if (value.kind == OPERAND_LOCAL && value.index == slot) return;
+
+    invalidate(compiler, OPERAND_LOCAL, slot, top);
+    if (compiler->xmmOwner == slot) compiler->xmmOwner = -1;
+    if (value.kind == OPERAND_XMM0) {
+        storeXmm(as, RBX, SLOT(slot), XMM0);
+    } else {
+        loadOperand(compiler, RAX, top);
+        store(as, RBX, SLOT(slot), RAX);
+        compiler->operands[top].kind = OPERAND_LOCAL;
+        compiler->operands[top].index = slot;
+    }
+    compiler->operands[slot].kind = OPERAND_STACK;
+    compiler->operands[slot].type = value.type;
+}
+
+static void setGlobal(TraceCompiler* compiler, int slot) {
+    Assembler* as = &compiler->as;
+    int top = compiler->depth - 1;
+    Operand value = compiler->operands[top];
+    guardDefined(compiler, slot);
+    if (value.kind == OPERAND_GLOBAL && value.index == slot) return;
+
+    invalidate(compiler, OPERAND_GLOBAL, slot, top);
+    if (value.kind == OPERAND_XMM0) {
+        storeXmm(as, R14, SLOT(slot), XMM0);
+    } else {
+        loadOperand(compiler, RAX, top);
+        store(as, R14, SLOT(slot), RAX);
+    }
+    compiler->globalTypes[slot] = value.type;
+}
+
+static void loadUpvalue(Assembler* as, Register reg, int index) {
+    load(as, reg, R13, offsetof(CallFrame, closure));
+    load(as, reg, reg, (int)offsetof(ObjClosure, upvalues) + index * (int)sizeof(ObjUpvalue*));
+}
+
+static void loadUpvalueLocation(Assembler* as, Register reg, int index) {
+    loadUpvalue(as, reg, index);
+    load(as, reg, reg, offsetof(ObjUpvalue, location));
+}
+
+static void translate(TraceCompiler* compiler) {
+    Assembler* as = &compiler->as;
+    TraceInstruction* instruction = compiler->instruction;
+    Chunk* chunk = &compiler->trace->function->chunk;
+    uint8_t* ip = instruction->ip;
+    int top = compiler->depth - 1;
+
+    switch (instruction->opcode) {
+        case OP_CONSTANT: pushConstant(compiler, chunk->constants.values[ip[1]]); break;
+        case OP_NIL: pushConstant(compiler, NIL_VAL); break;
+        case OP_TRUE: pushConstant(compiler, TRUE_VAL); break;
+        case OP_FALSE: pushConstant(compiler, FALSE_VAL); break;
+        case OP_POP:
+            if (compiler->xmmOwner == top) compiler->xmmOwner = -1;
+            compiler->depth--;
+            break;
+        case OP_GET_LOCAL:
+            materialize(compiler, ip[1]);
+            pushOperand(compiler, OPERAND_LOCAL, ip[1], 0, compiler->operands[ip[1]].type);
+            break;
+        case OP_SET_LOCAL: setLocal(compiler, ip[1]); break;
+        case OP_GET_GLOBAL: {
+            int slot = (ip[1] << 8) | ip[2];
+            guardDefined(compiler, slot);
+            pushOperand(compiler, OPERAND_GLOBAL, slot, 0, compiler->globalTypes[slot]);
+            break;
+        }
+        case OP_SET_GLOBAL: setGlobal(compiler, (ip[1] << 8) | ip[2]); break;
+        case OP_GET_UPVALUE:
+            loadUpvalueLocation(as, RAX, ip[1]);
+            load(as, RAX, RAX, 0);
+            store(as, RBX, SLOT(compiler->depth), RAX);
+            pushOperand(compiler, OPERAND_STACK, 0, 0, TYPE_UNKNOWN);
+            break;
+        case OP_SET_UPVALUE:
+            //* Открытое upvalue может указывать на ячейку этого же фрейма: копии локальных
+            //* переменных материализуем заранее, а их типы после записи больше не известны
+            for (int i = 0; i < compiler->depth; i++) {
+                if (compiler->operands[i].kind == OPERAND_LOCAL) materialize(compiler, i);
+            }
+            //* Помощники барьеров портят xmm0
+            releaseXmm(compiler, -1, -1);
+            emitDeletionBarrier(as, ip[1]);
+            loadUpvalue(as, RDX, ip[1]);
+            load(as, RCX, RDX, offsetof(ObjUpvalue, location));
+            loadOperand(compiler, RAX, compiler->depth - 1);
+            store(as, RCX, 0, RAX);
+            //* Барьер записи нужен, только если записан объект
+            switch (compiler->operands[compiler->depth - 1].type) {
+                case TYPE_NUMBER:
+                case TYPE_BOOL:
+                case TYPE_NIL:
+                    break;
+                default:
+                    emitWriteBarrier(as, RDX, RAX);
+                    break;
+            }
+            for (int i = 0; i < compiler->depth; i++) {
+                if (compiler->operands[i].kind == OPERAND_STACK) compiler->operands[i].type = TYPE_UNKNOWN;
+            }
+            break;
+        case OP_EQUAL: equalOp(compiler); break;
+        case OP_GREATER: compareOp(compiler, false); break;
+        case OP_LESS: compareOp(compiler, true); break;
+        case OP_ADD:
+            if (instruction->types[0] == TYPE_NUMBER && instruction->types[1] == TYPE_NUMBER) {
+                numberOp(compiler, SSE_ADD);
+            } else {
+                concatenateOp(compiler);
+            }
+            break;
+        case OP_SUBTRACT: numberOp(compiler, SSE_SUBTRACT); break;
+        case OP_MULTIPLY: numberOp(compiler, SSE_MULTIPLY); break;
+        case OP_DIVIDE: numberOp(compiler, SSE_DIVIDE); break;
+        case OP_NOT: notOp(compiler); break;
+        case OP_NEGATE: negateOp(compiler); break;
+        case OP_PRINT:
+            releaseXmm(compiler, top, -1);
+            loadOperand(compiler, RDI, top);
+            callHelper(as, tracePrint);
+            if (compiler->xmmOwner == top) compiler->xmmOwner = -1;
+            compiler->depth--;
+            break;
+        case OP_JUMP:
+            break;
+        case OP_JUMP_IF_FALSE: jumpIfFalseOp(compiler); break;
+        case OP_LOOP:
+            //* Внутренний обратный переход (инкремент цикла for) трасса уже развернула
+            break;
+        default:
+            compiler->hadError = true;
+            break;
+    }
+}
+
+//* Начало итерации: о значениях на стеке ничего не известно
+static void resetState(TraceCompiler* compiler) {
+    compiler->depth = compiler->trace->depth;
+    compiler->xmmOwner = -1;
+    for (int i = 0; i < compiler->depth; i++) {
+        compiler->operands[i].kind = OPERAND_STACK;
+        compiler->operands[i].type = TYPE_UNKNOWN;
+    }
+    for (int i = 0; i < compiler->globalCount; i++) {
+        compiler->globalTypes[i] = TYPE_UNKNOWN;
+        compiler->globalDefined[i] = false;
+    }
+}
+
+static void emitEpilogue(Assembler* as) {
+    pop64(as, R15);
+    pop64(as, R14);
+    pop64(as, R13);
+    pop64(as, RBX);
+    pop64(as, RBP);
+    emit(as, 0xc3);
+}
+
+static void emitExit(TraceCompiler* compiler, PendingExit* exit) {
+    Assembler* as = &compiler->as;
+    patchHere(as, exit->position);
+    for (int i = 0; i < exit->depth; i++) {
+        storeOperand(as, &exit->snapshot[i], i);
+    }
+    moveRegister(as, RAX, RBX);
+    addImmediate(as, RAX, SLOT(exit->depth));
+    moveImmediate(as, RCX, (uint64_t)(uintptr_t)&vm.stackTop);
+    store(as, RCX, 0, RAX);
+    moveImmediate(as, RAX, (uint64_t)(uintptr_t)compiler->trace->exits[exit->exit].ip);
+    store(as, R13, offsetof(CallFrame, ip), RAX);
+    moveImmediate(as, RAX, (uint64_t)exit->exit);
+    emitEpilogue(as);
+}
+
+static bool compileTrace(Trace* trace) {
+    TraceCompiler compiler;
+    initAssembler(&compiler.as);
+    compiler.trace = trace;
+    compiler.operands = ALLOCATE(Operand, trace->maxDepth + 1);
+    compiler.globalCount = vm.globalValues.count;
+    compiler.globalTypes = ALLOCATE(TraceType, compiler.globalCount);
+    compiler.globalDefined = ALLOCATE(bool, compiler.globalCount);
+    compiler.pending = NULL;
+    compiler.pendingCount = 0;
+    compiler.pendingCapacity = 0;
+    compiler.hadError = false;
+    Assembler* as = &compiler.as;
+
+    //* Пролог: четыре сохранённых регистра и rbp оставляют стек выровненным по 16 байт
+    push64(as, RBP);
+    moveRegister(as, RBP, RSP);
+    push64(as, RBX);
+    push64(as, R13);
+    push64(as, R14);
+    push64(as, R15);
+    moveRegister(as, R13, RDI);
+    load(as, RBX, R13, offsetof(CallFrame, slots));
+    moveImmediate(as, R14, (uint64_t)(uintptr_t)&vm.globalValues.values);
+    load(as, R14, R14, 0);
+    moveImmediate(as, R15, QNAN);
+
+    int loopLabel = as->count;
+    resetState(&compiler);
+    for (int i = 0; i < trace->count && !compiler.hadError; i++) {
+        compiler.instruction = &trace->code[i];
+        translate(&compiler);
+    }
+    //* Конец итерации: всё отложенное — на свои места, и снова к заголовку
+    flush(&compiler);
+    if (compiler.depth != trace->depth) compiler.hadError = true;
+    jumpBack(as, loopLabel);
+
+    for (int i = 0; i < compiler.pendingCount; i++) {
+        emitExit(&compiler, &compiler.pending[i]);
+    }
+
+    if (!compiler.hadError) {
+        trace->native = mapCode(as, &trace->nativeSize);
+        if (trace->native == NULL) compiler.hadError = true;
+    }
+
+    for (int i = 0; i < compiler.pendingCount; i++) {
+        FREE_ARRAY(Operand, compiler.pending[i].snapshot, compiler.pending[i].depth);
+    }
+    FREE_ARRAY(PendingExit, compiler.pending, compiler.pendingCapacity);
+    FREE_ARRAY(Operand, compiler.operands, trace->maxDepth + 1);
+    FREE_ARRAY(TraceType, compiler.globalTypes, compiler.globalCount);
+    FREE_ARRAY(bool, compiler.globalDefined, compiler.globalCount);
+    int size = as->count;
+    freeAssembler(as);
+    if (!compiler.hadError && vm.dumpTraces) {
+        fprintf(stderr, "-- %d instructions, %d bytes of machine code, %d exits\n",
+                trace->count, size, trace->exitCount);
+    }
+    return !compiler.hadError;
+}
+
+static void printTrace(Trace* trace) {
+    fprintf(stderr, "== trace %d: loop at line %d in %s() ==\n", trace->id,
+            traceLine(trace, trace->header), functionName(trace->function));
+    for (int i = 0; i < trace->count; i++) {
+        TraceInstruction* instruction = &trace->code[i];
+        fprintf(stderr, "%04d %4d %-18s", (int)(instruction->ip - trace->function->chunk.code),
+                traceLine(trace, instruction->ip), opcodeName(instruction->opcode));
+        if (instruction->types[0] != TYPE_UNKNOWN) fprintf(stderr, " %s", typeName(instruction->types[0]));
+        if (instruction->types[1] != TYPE_UNKNOWN) fprintf(stderr, " %s", typeName(instruction->types[1]));
+        if (instruction->opcode == OP_JUMP_IF_FALSE) fprintf(stderr, instruction->taken ? " (taken)" : " (not taken)");
+        fprintf(stderr, "\n");
+    }
+}
+
+static Trace* newTrace(CallFrame* frame) {
+    Trace* trace = ALLOCATE(Trace, 1);
+    trace->id = 0;
+    trace->function = frame->closure->function;
+    trace->header = frame->ip;
+    trace->depth = (int)(vm.stackTop - frame->slots);
+    trace->maxDepth = trace->depth;
+    trace->code = NULL;
+    trace->count = 0;
+    trace->capacity = 0;
+    trace->exits = NULL;
+    trace->exitCount = 0;
+    trace->exitCapacity = 0;
+    trace->native = NULL;
+    trace->nativeSize = 0;
+    trace->entries = 0;
+    return trace;
+}
+
+/*
+ * Вызывается run() на каждом обратном переходе цикла, frame->ip — заголовок цикла.
+ * Выполняет трассу цикла, если она есть, или записывает её, если цикл стал горячим.
+ * Возвращает true, если часть цикла уже выполнена здесь и интерпретатору нужно перечитать frame->ip.
+ */
+bool traceLoop(CallFrame* frame) {
+    TraceEntry* entry = cacheEntry(frame->ip, frame->closure->function);
+    Trace* trace = entry->trace;
+    if (trace != NULL) {
+        int exit = ((TraceCode)trace->native)(frame);
+        trace->entries++;
+        trace->exits[exit].count++;
+        vm.traceExits++;
+        return true;
+    }
+
+    //* Счётчик останавливается на пороге: цикл, который не удалось записать, больше не трассируется
+    if (entry->hotness >= TRACE_THRESHOLD || ++entry->hotness < TRACE_THRESHOLD) return false;
+
+    trace = newTrace(frame);
+    if (record(trace, frame)) {
+        trace->id = ++traceCount;
+        if (vm.dumpTraces) printTrace(trace);
+        if (compileTrace(trace)) {
+            //* Во время записи кэш не перестраивается, так что entry по-прежнему действителен
+            entry->trace = trace;
+            vm.compiledTraces++;
+            return true;
+        }
+    }
+    freeTrace(trace);
+    if (++entry->aborts < TRACE_MAX_ABORTS) entry->hotness = 0;
+    return true;
+}
+
+//* Функция освобождается: её трассы и счётчики указывают в её байт-код и больше не нужны
+void forgetTraces(ObjFunction* function) {
+    bool found = false;
+    for (int i = 0; i < cache.capacity; i++) {
+        TraceEntry* entry = &cache.entries[i];
+        if (entry->header == NULL || entry->function != function) continue;
+        if (entry->trace != NULL) freeTrace(entry->trace);
+        entry->header = NULL;
+        found = true;
+    }
+    //* Открытая адресация без надгробий: оставшиеся записи раскладываем заново
+    if (found) adjustCapacity(cache.capacity);
+}
+
+/*
+ * Уплотнение кучи переместило объекты, а константы-строки зашиты в машинный код трасс.
+ * Трассы выбрасываются; циклы снова набирают горячесть и записываются уже с новыми адресами.
+ * Уплотнение идёт только в безопасных точках, а трасса их не содержит, так что ни одна трасса сейчас не выполняется
+ */
+void discardTraces() {
+    for (int i = 0; i < cache.capacity; i++) {
+        TraceEntry* entry = &cache.entries[i];
+        if (entry->header == NULL || entry->trace == NULL) continue;
+        freeTrace(entry->trace);
+        entry->trace = NULL;
+        entry->hotness = 0;
+    }
+}
+
+void freeTraces() {
+    for (int i = 0; i < cache.capacity; i++) {
+        TraceEntry* entry = &cache.entries[i];
+        if (entry->header != NULL && entry->trace != NULL) freeTrace(entry->trace);
+    }
+    FREE_ARRAY(TraceEntry, cache.entries, cache.capacity);
+    cache.entries = NULL;
+    cache.count = 0;
+    cache.capacity = 0;
+}
+
+//* Отладочный вывод (clox --traces): сколько раз выполнялась каждая трасса и где из неё выходили
+void printTraces() {
+    fflush(stdout);
+    fprintf(stderr, "== trace exits ==\n");
+    for (int id = 1; id <= traceCount; id++) {
+        for (int i = 0; i < cache.capacity; i++) {
+            Trace* trace = cache.entries[i].header != NULL ? cache.entries[i].trace : NULL;
+            if (trace == NULL || trace->id != id) continue;
+            fprintf(stderr, "trace %d (line %d in %s()): %llu entries\n", trace->id,
+                    traceLine(trace, trace->header), functionName(trace->function),
+                    (unsigned long long)trace->entries);
+            for (int j = 0; j < trace->exitCount; j++) {
+                TraceExit* exit = &trace->exits[j];
+                if (exit->count == 0) continue;
+                fprintf(stderr, "  exit %d -> %04d (line %d): %llu\n", j,
+                        (int)(exit->ip - trace->function->chunk.code), traceLine(trace, exit->ip),
+                        (unsigned long long)exit->count);
+            }
+        }
+    }
+}
+
+#endif
@@ -0,0 +1,97 @@
+#ifndef clox_trace_h
+#define clox_trace_h
+
+#include "common.h"
+#include "object.h"
+#include "vm.h"
+
+#ifdef JIT
+
+/*
+ * Трассирующий JIT для горячих циклов (trace.c).
+ * run() считает выполнения каждого обратного перехода OP_LOOP; когда цикл становится горячим,
+ * одна итерация его тела записывается в линейную трассу вместе с замеченными типами значений,
+ * а трасса переводится в машинный код с проверками типов и боковыми выходами в интерпретатор.
+ */
+
+//* Сколько раз должен выполниться обратный переход цикла, прежде чем его тело будет записано в трассу
+#ifndef TRACE_THRESHOLD
+#define TRACE_THRESHOLD 100
+#endif
+//* После стольких сорвавшихся записей цикл больше не трассируется
+#define TRACE_MAX_ABORTS 4
+//* Предельная длина трассы в инструкциях байт-кода
+#define TRACE_MAX_LENGTH 512
+
+//* Тип значения, замеченный при записи трассы (или известный компилятору трассы)
+typedef enum {
+    TYPE_UNKNOWN,
+    TYPE_NUMBER,
+    TYPE_BOOL,
+    TYPE_NIL,
+    TYPE_STRING,
+    TYPE_OBJECT,
+} TraceType;
+
+//* Записанная инструкция байт-кода
+typedef struct {
+    uint8_t* ip; // Адрес инструкции в байт-коде
+    uint8_t opcode; // Исходный опкод (genericOpcode): трасса не зависит от ускорения и слияния
+    TraceType types[2]; // Типы операндов (у бинарных: левый, правый) или загруженного значения
+    bool taken; // OP_JUMP_IF_FALSE: переход был выполнен
+} TraceInstruction;
+
+//* Боковой выход: здесь машинный код трассы возвращает управление интерпретатору
+typedef struct {
+    uint8_t* ip; // С какой инструкции продолжит интерпретатор
+    uint64_t count; // Сколько раз трасса вышла здесь
+} TraceExit;
+
+typedef struct {
+    int id;
+    ObjFunction* function;
+    uint8_t* header; // Начало цикла: цель обратного перехода
+    int depth; // Глубина стека фрейма на входе в трассу (и в конце каждой итерации)
+    int maxDepth;
+    TraceInstruction* code;
+    int count;
+    int capacity;
+    TraceExit* exits;
+    int exitCount;
+    int exitCapacity;
+    void* native; // Машинный код трассы (TraceCode)
+    size_t nativeSize;
+    uint64_t entries; // Сколько раз интерпретатор входил в трассу
+} Trace;
+
+//* Запись кэша трасс: счётчик горячести цикла и его трасса, если она уже есть
+typedef struct {
+    uint8_t* header; // Ключ — адрес заголовка цикла в байт-коде; NULL — свободная ячейка
+    ObjFunction* function;
+    int hotness;
+    int aborts;
+    Trace* trace;
+} TraceEntry;
+
+//* Кэш трасс: открытая адресация по адресу заголовка цикла, ёмкость — степень двойки
+typedef struct {
+    int count;
+    int capacity;
+    TraceEntry* entries;
+} TraceCache;
+
+/*
+ * Машинный код трассы: выполняет итерации цикла во фрейме frame до бокового выхода.
+ * Выход сам записывает frame->ip и vm.stackTop и возвращает свой номер.
+ */
+typedef int (*TraceCode)(CallFrame* frame);
+
+bool traceLoop(CallFrame* frame);
+void forgetTraces(ObjFunction* function);
+void discardTraces();
+void freeTraces();
+void printTraces();
+
+#endif
+
+#endif
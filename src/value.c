@@ -14,9 +14,11 @@ void initValueArray(ValueArray* array) {
 
 void writeValueArray(ValueArray* array, Value value) {
     if (array->capacity < array->count + 1) {
+        //* Ёмкость меняется только после выделения: ошибка нехватки памяти оставляет массив целым
         int oldCapacity = array->capacity;
-        array->capacity = GROW_CAPACITY(oldCapacity);
-        array->values = GROW_ARRAY(Value, array->values, oldCapacity, array->capacity);
+        int capacity = GROW_CAPACITY(oldCapacity);
+        array->values = GROW_ARRAY(Value, array->values, oldCapacity, capacity);
+        array->capacity = capacity;
     }
 
     array->values[array->count] = value;
@@ -28,7 +30,30 @@ void freeValueArray(ValueArray* array) {
     initValueArray(array);
 }
 
+static void printNumber(double num) {
+    if (floor(num) == num) {
+        // Целое число, выводим без дробной части
+        printf("%.0f", num);
+    } else {
+        // Не целое, выводим с дробной частью
+        printf("%f", num);
+    }
+}
+
 void printValue(Value value) {
+#ifdef NAN_BOXING
+    if (IS_BOOL(value)) {
+        printf(AS_BOOL(value) ? "true" : "false");
+    } else if (IS_NIL(value)) {
+        printf("nil");
+    } else if (IS_NUMBER(value)) {
+        printNumber(AS_NUMBER(value));
+    } else if (IS_OBJ(value)) {
+        printObject(value);
+    } else if (IS_UNDEFINED(value)) {
+        printf("undefined");
+    }
+#else
     switch (value.type) {
         case VAL_BOOL:
             printf(AS_BOOL(value) ? "true" : "false");
@@ -36,28 +61,45 @@ void printValue(Value value) {
         case VAL_NIL:
             printf("nil");
             break;
-        case VAL_NUMBER: {
-            double num = AS_NUMBER(value);
-            if (floor(num) == num) {
-                // Целое число, выводим без дробной части
-                printf("%.0f", num);
-            } else {
-                // Не целое, выводим с дробной частью
-                printf("%f", num);
-            }
+        case VAL_NUMBER:
+            printNumber(AS_NUMBER(value));
             break;
-        }
         case VAL_OBJ: printObject(value); break;
+        case VAL_UNDEFINED:
+            printf("undefined");
+            break;
     }
+#endif
+}
+
+//* Неинтернированная строка (срез построителя, результат конкатенации) равна любой строке с теми же символами.
+//* Вынесено из valuesEqual, чтобы частый побитовый случай оставался коротким
+static __attribute__((noinline)) bool stringsEqual(Value a, Value b) {
+    if (!IS_STRING(a) || !IS_STRING(b)) return false;
+    if (isInterned(AS_OBJ(a)) && isInterned(AS_OBJ(b))) return false;
+    int length = stringLength(AS_OBJ(a));
+    return length == stringLength(AS_OBJ(b)) &&
+        memcmp(stringChars(AS_OBJ(a)), stringChars(AS_OBJ(b)), length) == 0;
 }
 
 bool valuesEqual(Value a, Value b) {
+#ifdef NAN_BOXING
+    // Числа сравниваем как double, чтобы NaN != NaN, а 0 == -0
+    if (IS_NUMBER(a) && IS_NUMBER(b)) {
+        return AS_NUMBER(a) == AS_NUMBER(b);
+    }
+    // Всё остальное (nil, bool, интернированные строки и прочие объекты) — побитово
+    if (a == b) return true;
+#else
     if (a.type != b.type) return false;
     switch(a.type) {
         case VAL_BOOL: return AS_BOOL(a) == AS_BOOL(b);
         case VAL_NIL: return true;
         case VAL_NUMBER: return AS_NUMBER(a) == AS_NUMBER(b);
-        case VAL_OBJ: return AS_OBJ(a) == AS_OBJ(b);
+        case VAL_OBJ: if (AS_OBJ(a) == AS_OBJ(b)) return true; break;
+        case VAL_UNDEFINED: return true;
         default: return false;
     }
-}
\ No newline at end of file
+#endif
+    return stringsEqual(a, b);
+}
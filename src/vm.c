@@ -1,15 +1,23 @@
 #include <stdio.h>
 #include <stdarg.h>
+#include <limits.h>
 #include <string.h>
 #include <time.h>
 
 #include "common.h"
 #include "compiler.h"
 #include "debug.h"
+#include "jit.h"
 #include "object.h"
 #include "memory.h"
+#include "profile.h"
+#include "trace.h"
 #include "vm.h"
 
+#ifdef JIT
+#include <sys/resource.h>
+#endif
+
 VM vm;
 
 static Value clockNative(int argCount, Value* args) {
@@ -18,22 +26,23 @@ static Value clockNative(int argCount, Value* args) {
 
 static void resetStack() {
     vm.stackTop = vm.stack;
+    vm.frame = NULL;
     vm.frameCount = 0;
     vm.openUpvalues = NULL;
 }
 
-static void runtimeError(const char* format, ...) {
+void runtimeError(const char* format, ...) {
     va_list args;
     va_start(args, format);
     vfprintf(stderr, format, args);
     va_end(args);
     fputs("\n", stderr);
 
-    for (int i = vm.frameCount - 1; i >= 0; i--) {
-        CallFrame* frame = &vm.frames[i];
+    for (CallFrame* frame = vm.frame; frame != NULL; frame = frame->previous) {
         ObjFunction* function = frame->closure->function;
-        size_t instruction = frame->ip - function->chunk.code - 1;
-        fprintf(stderr, "[line %d] in ", function->chunk.lines[instruction]);
+        Chunk* chunk = vm.registerMode ? &function->registerChunk : &function->chunk;
+        size_t instruction = frame->ip - chunk->code - 1;
+        fprintf(stderr, "[line %d] in ", chunk->lines[instruction]);
 
         if (function->name == NULL) {
             fprintf(stderr, "script\n");
@@ -47,25 +56,154 @@ static void runtimeError(const char* format, ...) {
 static void defineNative(const char* name, NativeFn function) {
     push(OBJ_VAL((Obj*)copyString(name, (int)(strlen(name)))));
     push(OBJ_VAL((Obj*)newNative(function)));
-    tableSet(&vm.globals, AS_STRING(vm.stack[0]), vm.stack[1]);
+    int slot = globalSlot(AS_STRING(vm.stack[0]));
+    vm.globalValues.values[slot] = vm.stack[1];
     pop();
     pop();
 }
 
 void initVM() {
-    resetStack();
+    //* Сборщик мусора может запуститься уже при первых выделениях памяти ниже
+    initNursery();
     vm.objects = NULL;
-    initTable(&vm.globals);
+    vm.bytesAllocated = 0;
+    vm.peakBytes = 0;
+    vm.nextGC = GC_INITIAL_HEAP;
+    vm.heapLimit = HEAP_LIMIT;
+    vm.errorJump = NULL;
+    vm.collections = 0;
+    vm.grayCount = 0;
+    vm.grayCapacity = 0;
+    vm.grayStack = NULL;
+    vm.incrementalGC = false;
+    vm.gcPhase = GC_IDLE;
+    vm.gcDebt = 0;
+    vm.maxPause = GC_MAX_PAUSE;
+    vm.sweepList = NULL;
+    for (int i = 0; i < GC_PAUSE_BUCKETS; i++) vm.pauseHistogram[i] = 0;
+    vm.longestPause = 0;
+    vm.totalPause = 0;
+    vm.concurrentGC = false;
+    vm.markerTime = 0;
+    vm.compactRatio = 0;
+    vm.compactSpace = NULL;
+    vm.compactTop = NULL;
+    vm.compactEnd = NULL;
+    vm.compactHoles = 0;
+    vm.compactPending = false;
+    vm.compactions = 0;
+    //* Стек фреймов начинается с одного фрейма, стек значений — с STACK_INITIAL слотов
+    vm.frames = ALLOCATE(CallFrame, 1);
+    vm.frames->previous = NULL;
+    vm.frames->next = NULL;
+    vm.maxFrames = FRAMES_MAX;
+    vm.stack = ALLOCATE(Value, STACK_INITIAL);
+    vm.stackCapacity = STACK_INITIAL;
+    vm.maxStack = STACK_MAX;
+    vm.nativeStackBase = NULL;
+    vm.nativeStackLimit = NATIVE_STACK_MAX;
+#ifdef JIT
+    struct rlimit stackLimit;
+    if (getrlimit(RLIMIT_STACK, &stackLimit) == 0 && stackLimit.rlim_cur != RLIM_INFINITY &&
+        stackLimit.rlim_cur / 2 < vm.nativeStackLimit) {
+        vm.nativeStackLimit = stackLimit.rlim_cur / 2;
+    }
+#endif
+    resetStack();
+    vm.quickenedSites = 0;
+    vm.deoptimizedSites = 0;
+    vm.registerMode = false;
+    vm.jitFunctions = 0;
+    vm.compiledTraces = 0;
+    vm.traceExits = 0;
+    vm.dumpTraces = false;
+    initTable(&vm.globalSlots);
+    initValueArray(&vm.globalValues);
+    initValueArray(&vm.globalNames);
     initTable(&vm.strings);
     defineNative("clock", clockNative);
 }
 
 void freeVM() {
     freeObjects();
-    freeTable(&vm.globals);
+    freeNursery();
+#ifdef JIT
+    freeTraces();
+#endif
+    freeTable(&vm.globalSlots);
+    freeValueArray(&vm.globalValues);
+    freeValueArray(&vm.globalNames);
     freeTable(&vm.strings);
+    FREE_ARRAY(Value, vm.stack, vm.stackCapacity);
+    CallFrame* frame = vm.frames;
+    while (frame != NULL) {
+        CallFrame* next = frame->next;
+        FREE(CallFrame, frame);
+        frame = next;
+    }
+#ifdef SLAB_ALLOCATOR
+    freeSlabs();
+#endif
+}
+
+/*
+ * Возвращает индекс слота глобальной переменной с именем name,
+ * при первом обращении заводит для неё новый слот со значением UNDEFINED_VAL.
+ * Вызывается компилятором: слоты переживают отдельные вызовы interpret(), как и в REPL.
+ */
+int globalSlot(ObjString* name) {
+    Value slot;
+    if (tableGet(&vm.globalSlots, name, &slot)) return (int)AS_NUMBER(slot);
+
+    push(OBJ_VAL((Obj*)name));
+    writeValueArray(&vm.globalValues, UNDEFINED_VAL);
+    writeValueArray(&vm.globalNames, OBJ_VAL((Obj*)name));
+    int index = vm.globalValues.count - 1;
+    tableSet(&vm.globalSlots, name, NUMBER_VAL((double)index));
+    pop();
+    return index;
 }
 
+void printVMStats() {
+    //* Время потока пометки можно читать, только когда он закончил
+    finishConcurrentMarking();
+    fflush(stdout);
+    fprintf(stderr, "== vm stats ==\n");
+    fprintf(stderr, "quickened sites:   %zu\n", vm.quickenedSites);
+    fprintf(stderr, "deoptimized sites: %zu\n", vm.deoptimizedSites);
+    fprintf(stderr, "gc collections:    %zu\n", vm.collections);
+    fprintf(stderr, "minor collections: %zu\n", vm.minorCollections);
+    fprintf(stderr, "promoted bytes:    %zu\n", vm.promotedBytes);
+    fprintf(stderr, "longest gc pause:  %.1f us\n", vm.longestPause);
+    fprintf(stderr, "total gc pauses:   %.1f us\n", vm.totalPause);
+    if (vm.concurrentGC) fprintf(stderr, "marker thread:     %.1f us\n", vm.markerTime);
+    for (int i = 0; i < GC_PAUSE_BUCKETS; i++) {
+        if (vm.pauseHistogram[i] == 0) continue;
+        fprintf(stderr, "  pauses < %7d us: %zu\n", 1 << i, vm.pauseHistogram[i]);
+    }
+    fprintf(stderr, "heap bytes:        %zu\n", vm.bytesAllocated);
+    fprintf(stderr, "peak heap bytes:   %zu\n", vm.peakBytes);
+    printTableStats("interned strings:", &vm.strings);
+    printTableStats("global names:", &vm.globalSlots);
+    if (vm.compactRatio > 0) {
+        fprintf(stderr, "compactions:       %zu\n", vm.compactions);
+        fprintf(stderr, "compact space:     %zu of %zu bytes used, %zu in holes\n",
+                (size_t)(vm.compactTop - vm.compactSpace), (size_t)(vm.compactEnd - vm.compactSpace), vm.compactHoles);
+    }
+#ifdef SLAB_ALLOCATOR
+    printSlabStats();
+#endif
+#ifdef JIT
+    fprintf(stderr, "jit functions:     %zu\n", vm.jitFunctions);
+    fprintf(stderr, "compiled traces:   %zu\n", vm.compiledTraces);
+    fprintf(stderr, "trace exits:       %zu\n", vm.traceExits);
+#endif
+#ifdef PROFILE_OPCODES
+    printOpcodeProfile();
+#endif
+}
+
+//* Граница стека здесь не проверяется: место под весь фрейм резервирует call() (см. reserveStack)
 void push(Value value) {
     *vm.stackTop = value;
     vm.stackTop++;
@@ -83,21 +221,102 @@ Value peek(int distance) {
     return vm.stackTop[-1 - distance];
 }
 
+//* Начинает выполнение замыкания closure во фрейме frame, слоты которого уже на месте
+static void enterFunction(CallFrame* frame, ObjClosure* closure) {
+    frame->closure = closure;
+    frame->ip = closure->function->chunk.code;
+    frame->native = false;
+#ifdef JIT
+    //* Функция, вызванная JIT_THRESHOLD раз, переводится в машинный код (только стековой машиной)
+    ObjFunction* function = closure->function;
+    if (function->calls < JIT_THRESHOLD && !vm.registerMode && ++function->calls == JIT_THRESHOLD) {
+        jitCompile(function);
+    }
+    //* Глубоко во вложенном машинном коде функция выполняется интерпретатором
+    frame->native = function->jitCode != NULL && nativeStackAvailable();
+#endif
+}
+
+/*
+ * Перевыделяет стек значений так, чтобы над vm.stackTop поместилось ещё count значений
+ * (медленный путь reserveStack). Старый стек копируется в новый, и все указатели в него переносятся:
+ * слоты фреймов, открытые upvalue и vm.stackTop. Указатели на стек, взятые до вызова, устаревают.
+ */
+bool growStack(int count) {
+    int required = (int)(vm.stackTop - vm.stack) + count;
+    if (required > vm.maxStack) return false;
+    int capacity = vm.stackCapacity;
+    while (capacity < required) capacity *= 2;
+    if (capacity > vm.maxStack) capacity = vm.maxStack;
+
+    Value* stack = ALLOCATE(Value, capacity);
+    memcpy(stack, vm.stack, sizeof(Value) * (vm.stackTop - vm.stack));
+    CallFrame* frame = vm.frame;
+    for (int i = 0; i < vm.frameCount; i++, frame = frame->previous) {
+        frame->slots = stack + (frame->slots - vm.stack);
+    }
+    for (ObjUpvalue* upvalue = vm.openUpvalues; upvalue != NULL; upvalue = upvalue->next) {
+        upvalue->location = stack + (upvalue->location - vm.stack);
+    }
+    vm.stackTop = stack + (vm.stackTop - vm.stack);
+    FREE_ARRAY(Value, vm.stack, vm.stackCapacity);
+    vm.stack = stack;
+    vm.stackCapacity = capacity;
+    return true;
+}
+
+//* Дописывает в конец списка фреймов ещё один, над текущим (медленный путь pushFrame)
+CallFrame* appendFrame() {
+    CallFrame* frame = ALLOCATE(CallFrame, 1);
+    frame->previous = vm.frame;
+    frame->next = NULL;
+    vm.frame->next = frame;
+    return frame;
+}
+
 static bool call(ObjClosure* closure, int argCount) {
     if (argCount != closure->function->arity) {
         runtimeError("Expected %d arguments but got %d.", closure->function->arity, argCount);
         return false;
     }
 
-    if (vm.frameCount == FRAMES_MAX) {
+    //* Место под весь фрейм резервируется сразу: внутри него push() уже не выходит за границу стека
+    if (vm.frameCount == vm.maxFrames || !reserveStack(closure->function->stackSlots - argCount - 1)) {
         runtimeError("Stack overflow.");
         return false;
     }
 
-    CallFrame* frame = &vm.frames[vm.frameCount++];
-    frame->closure = closure;
-    frame->ip = closure->function->chunk.code;
+    CallFrame* frame = pushFrame();
     frame->slots = vm.stackTop - argCount - 1;
+    enterFunction(frame, closure);
+    return true;
+}
+
+/*
+ * Хвостовой вызов (OP_TAIL_CALL): вызываемая функция занимает фрейм текущей,
+ * поэтому рекурсия в хвостовой позиции выполняется в постоянном числе фреймов.
+ * Upvalue текущей функции закрываются до того, как её слоты будут перезаписаны аргументами.
+ * Нативная функция вызывается как обычно: её результат вернёт следующая инструкция OP_RETURN.
+ */
+bool tailCallValue(Value callee, int argCount) {
+    if (!IS_CLOSURE(callee)) return callValue(callee, argCount);
+
+    ObjClosure* closure = AS_CLOSURE(callee);
+    if (argCount != closure->function->arity) {
+        runtimeError("Expected %d arguments but got %d.", closure->function->arity, argCount);
+        return false;
+    }
+
+    CallFrame* frame = vm.frame;
+    closedUpvalues(frame->slots);
+    //* Вызываемое значение и аргументы переезжают в начало фрейма
+    memmove(frame->slots, vm.stackTop - argCount - 1, sizeof(Value) * (argCount + 1));
+    vm.stackTop = frame->slots + argCount + 1;
+    if (!reserveStack(closure->function->stackSlots - argCount - 1)) {
+        runtimeError("Stack overflow.");
+        return false;
+    }
+    enterFunction(frame, closure);
     return true;
 }
 
@@ -113,7 +332,7 @@ static bool call(ObjClosure* closure, int argCount) {
  * @param argCount - количество аргументов, передаваемых функции.
  * @return значение "true", если функция была успешно вызвана, и "false" в противном случае.
  */
-static bool callValue(Value callee, int argCount) {
+bool callValue(Value callee, int argCount) {
     if (IS_OBJ(callee)) {
         switch (OBJ_TYPE(callee)) {
             case OBJ_CLOSURE:
@@ -139,7 +358,7 @@ static bool callValue(Value callee, int argCount) {
  * @param local the address of the local variable to capture.
  * @return a pointer to the newly created upvalue.
  */
-static ObjUpvalue* captureUpvalue(Value* local) {
+ObjUpvalue* captureUpvalue(Value* local) {
     /*
     * Мы начинаем с начала списка, то есть с upvalue, ближайшего к вершине стека. 
     * Мы проходим по списку, используя небольшое сравнение указателей, 
@@ -168,41 +387,92 @@ static ObjUpvalue* captureUpvalue(Value* local) {
     return createdUpvalue;
 }
 
+//* Сразу закрытое upvalue с копией значения слота: в список открытых оно не попадает и закрывать его не нужно
+ObjUpvalue* copyUpvalue(Value* local) {
+    ObjUpvalue* upvalue = newUpvalue(NULL);
+    upvalue->closed = *local;
+    upvalue->location = &upvalue->closed;
+    writeBarrier((Obj*)upvalue, upvalue->closed);
+    return upvalue;
+}
+
 /*
  * Она закрывает все открытые значения upvalue, которые могут указывать на этот слот или любой слот над ним в стеке
  * @param last указатель на слот в стеке
 */
-static void closedUpvalues(Value* last) {
+void closedUpvalues(Value* last) {
     while (vm.openUpvalues != NULL && vm.openUpvalues->location >= last) {
         ObjUpvalue* upvalue = vm.openUpvalues;
         upvalue->closed = *upvalue->location;
         upvalue->location = &upvalue->closed;
+        writeBarrier((Obj*)upvalue, upvalue->closed);
         vm.openUpvalues = upvalue->next;
     }
 }
 
-static bool isFalsey(Value value) {
+bool isFalsey(Value value) {
     return IS_NIL(value) || (IS_BOOL(value) && !AS_BOOL(value));
 }
 
-static void concatenate() {
-    ObjString* b = AS_STRING(pop());
-    ObjString* a = AS_STRING(pop());
+/*
+ * Длинный результат конкатенации — срез построителя. Если левый операнд — срез, чей буфер
+ * после него ещё никто не продолжил, правый дописывается в тот же буфер, иначе оба копируются
+ * в новый буфер с двойным запасом. Так цепочка s = s + piece копирует каждый символ
+ * амортизированно O(1) раз. Вынесено из concatenate, чтобы короткий путь оставался маленьким
+ */
+static __attribute__((noinline)) void concatenateBuilder(Obj* a, Obj* b) {
+    int aLength = stringLength(a);
+    int bLength = stringLength(b);
+    int length = aLength + bLength;
+    ObjBuilder* builder = objType(a) == OBJ_SLICE ? ((ObjSlice*)a)->builder : NULL;
+    if (builder == NULL || builder->length != aLength || builder->capacity - aLength < bLength) {
+        builder = newBuilder(length < INT_MAX / 2 ? length * 2 : length);
+        memcpy(builder->chars, stringChars(a), aLength);
+    }
+    memcpy(builder->chars + aLength, stringChars(b), bLength);
+    builder->length = length;
+    //* Правый операнд уже скопирован: его слот держит буфер, пока выделяется срез
+    vm.stackTop[-1] = OBJ_VAL((Obj*)builder);
+    ObjSlice* result = newSlice(builder, length);
+    pop();
+    pop();
+    push(OBJ_VAL((Obj*)result));
+}
 
-    int length = a->length + b->length;
-    char* chars = ALLOCATE(char, length + 1);
-    memcpy(chars, a->chars, a->length);
-    memcpy(chars + a->length, b->chars, b->length);
-    chars[length] = '\0';
+void concatenate() {
+    //* Операнды остаются на стеке до конца: выделение памяти под результат может запустить сборку мусора
+    Obj* b = AS_OBJ(peek(0));
+    Obj* a = AS_OBJ(peek(1));
+    int aLength = stringLength(a);
+    int bLength = stringLength(b);
+    if (aLength + bLength >= BUILDER_MIN_LENGTH) {
+        concatenateBuilder(a, b);
+        return;
+    }
 
-    ObjString* result = takeString(chars, length);
+    //* Символы пишутся сразу в объект результата, без промежуточного буфера
+    ObjString* result = newString(aLength + bLength);
+    memcpy(result->chars, stringChars(a), aLength);
+    memcpy(result->chars + aLength, stringChars(b), bLength);
+#ifndef LAZY_INTERNING
+    result = internString(result);
+#endif
+    pop();
+    pop();
     push(OBJ_VAL((Obj*)result));
 }
 
-static InterpretResult run() {
-    CallFrame* frame = &vm.frames[vm.frameCount - 1];
+/*
+ * Выполняет байт-код, начиная с верхнего фрейма, пока не вернётся функция скрипта
+ * или пока функция не вернёт управление машинному коду, который её вызвал (frame->native).
+ */
+DISPATCH_ATTRIBUTES InterpretResult run() {
+    CallFrame* frame = vm.frame;
+    //* Указатель инструкции текущего фрейма держим в локальной переменной (в регистре),
+    //* а в frame->ip сохраняем только перед вызовами и ошибками времени выполнения
+    register uint8_t* ip = frame->ip;
 
-    #define READ_BYTE() (*frame->ip++)
+    #define READ_BYTE() (*ip++)
     #define READ_CONSTANT() (frame->closure->function->chunk.constants.values[READ_BYTE()])
     // * Объединение старшего и младшего байтов в одно 16-разрядное целое число
     //* vm.ip[-2] считывает старший байт 16-разрядного целого числа.
@@ -210,183 +480,450 @@ static InterpretResult run() {
     //* << 8 сдвигает старший байт на 8 бит влево, эффективно умножая его на 256.
     //* | выполняет побитовую операцию OR для объединения старшего и младшего байтов в одно 16-разрядное целое число.
     #define READ_SHORT() \
-        (frame->ip += 2, (uint16_t)((frame->ip[-2] << 8) | frame->ip[-1]))
+        (ip += 2, (uint16_t)((ip[-2] << 8) | ip[-1]))
     #define READ_STRING() AS_STRING(READ_CONSTANT())
-    #define BINARY_OP(valueType, op) \
+    #define GLOBAL_NAME(slot) AS_STRING(vm.globalNames.values[slot])
+    #define RUNTIME_ERROR(...) \
+        do { \
+            frame->ip = ip; \
+            runtimeError(__VA_ARGS__); \
+            return INTERPRET_RUNTIME_ERROR; \
+        } while (false)
+    //* Ускорение (quickening): только что прочитанная однобайтовая инструкция
+    //* переписывает себя в байт-коде на специализированный вариант
+    #define QUICKEN(specialized) \
+        do { \
+            ip[-1] = (specialized); \
+            vm.quickenedSites++; \
+        } while (false)
+    //* Откат: специализированный вариант возвращает на место обобщённую инструкцию
+    //* и отступает на неё, чтобы следующая диспетчеризация выполнила её заново
+    #define DEOPTIMIZE(generic) \
+        do { \
+            ip[-1] = (generic); \
+            ip--; \
+            vm.deoptimizedSites++; \
+        } while (false)
+    #define BINARY_OP(valueType, op, specialized) \
         do { \
             if (!IS_NUMBER(peek(0)) || !IS_NUMBER(peek(1))) { \
-                runtimeError("Operands must be numbers."); \
-                return INTERPRET_RUNTIME_ERROR; \
+                RUNTIME_ERROR("Operands must be numbers."); \
             } \
+            QUICKEN(specialized); \
             double b = AS_NUMBER(pop()); \
             double a = AS_NUMBER(pop()); \
             push(valueType(a op b)); \
         } while (false)
+    //* Специализированный вариант BINARY_OP: проверка типов осталась только как дешёвая защита
+    #define NUMBER_OP(valueType, op, generic) \
+        do { \
+            if (IS_NUMBER(peek(0)) && IS_NUMBER(peek(1))) { \
+                double b = AS_NUMBER(pop()); \
+                double a = AS_NUMBER(pop()); \
+                push(valueType(a op b)); \
+            } else { \
+                DEOPTIMIZE(generic); \
+            } \
+        } while (false)
     
-    for(;;) {
-        #ifdef DEBUG_TRACE_EXECUTION
-            printf(" ");
-            for (Value* slot = vm.stack; slot < vm.stackTop; slot++) {
-                printf("[ ");
-                printValue(*slot);
-                printf(" ]");
-            }
-            printf("\n");
-            disassembleInstruction(&frame->closure->function->chunk, (int)(frame->ip - frame->closure->function->chunk.code));
-        #endif
-        uint8_t instruction;
+    #ifdef DEBUG_TRACE_EXECUTION
+        #define TRACE_EXECUTION() \
+            do { \
+                printf(" "); \
+                for (Value* slot = vm.stack; slot < vm.stackTop; slot++) { \
+                    printf("[ "); \
+                    printValue(*slot); \
+                    printf(" ]"); \
+                } \
+                printf("\n"); \
+                disassembleInstruction(&frame->closure->function->chunk, (int)(ip - frame->closure->function->chunk.code)); \
+            } while (false)
+    #else
+        #define TRACE_EXECUTION() do {} while (false)
+    #endif
+
+    //* Обратный переход цикла — безопасная точка для малой сборки мусора
+    #ifdef JIT
+        //* Горячий цикл записывается в трассу, а готовая трасса
+        //* выполняет итерации машинным кодом и возвращается сюда на боковом выходе
+        #define BACK_EDGE() \
+            do { \
+                safepoint(); \
+                frame->ip = ip; \
+                if (traceLoop(frame)) ip = frame->ip; \
+            } while (false)
+    #else
+        #define BACK_EDGE() safepoint()
+    #endif
+
+    #ifdef PROFILE_OPCODES
+        #define PROFILE_INSTRUCTION() profileInstruction(&frame->closure->function->chunk, ip)
+    #else
+        #define PROFILE_INSTRUCTION() do {} while (false)
+    #endif
+
+    #ifdef COMPUTED_GOTO
+        //* Прямая шитая диспетчеризация: у каждого опкода своя метка,
+        //* и каждый обработчик сам переходит к следующему через goto *.
+        //* Так у каждого опкода своя точка косвенного перехода,
+        //* и предсказатель переходов учится на парах "текущий -> следующий" опкод.
+        static void* dispatchTable[UINT8_COUNT] = {
+            [0 ... UINT8_MAX] = &&op_UNKNOWN,
+            [OP_CONSTANT] = &&op_OP_CONSTANT,
+            [OP_NIL] = &&op_OP_NIL,
+            [OP_TRUE] = &&op_OP_TRUE,
+            [OP_FALSE] = &&op_OP_FALSE,
+            [OP_POP] = &&op_OP_POP,
+            [OP_GET_LOCAL] = &&op_OP_GET_LOCAL,
+            [OP_SET_LOCAL] = &&op_OP_SET_LOCAL,
+            [OP_GET_GLOBAL] = &&op_OP_GET_GLOBAL,
+            [OP_DEFINE_GLOBAL] = &&op_OP_DEFINE_GLOBAL,
+            [OP_SET_GLOBAL] = &&op_OP_SET_GLOBAL,
+            [OP_GET_UPVALUE] = &&op_OP_GET_UPVALUE,
+            [OP_SET_UPVALUE] = &&op_OP_SET_UPVALUE,
+            [OP_EQUAL] = &&op_OP_EQUAL,
+            [OP_GREATER] = &&op_OP_GREATER,
+            [OP_LESS] = &&op_OP_LESS,
+            [OP_ADD] = &&op_OP_ADD,
+            [OP_SUBTRACT] = &&op_OP_SUBTRACT,
+            [OP_MULTIPLY] = &&op_OP_MULTIPLY,
+            [OP_DIVIDE] = &&op_OP_DIVIDE,
+            [OP_NOT] = &&op_OP_NOT,
+            [OP_NEGATE] = &&op_OP_NEGATE,
+            [OP_PRINT] = &&op_OP_PRINT,
+            [OP_JUMP] = &&op_OP_JUMP,
+            [OP_JUMP_IF_FALSE] = &&op_OP_JUMP_IF_FALSE,
+            [OP_LOOP] = &&op_OP_LOOP,
+            [OP_CALL] = &&op_OP_CALL,
+            [OP_TAIL_CALL] = &&op_OP_TAIL_CALL,
+            [OP_CLOSURE] = &&op_OP_CLOSURE,
+            [OP_CLOSE_UPVALUE] = &&op_OP_CLOSE_UPVALUE,
+            [OP_RETURN] = &&op_OP_RETURN,
+            [OP_GREATER_NUMBER] = &&op_OP_GREATER_NUMBER,
+            [OP_LESS_NUMBER] = &&op_OP_LESS_NUMBER,
+            [OP_ADD_NUMBER] = &&op_OP_ADD_NUMBER,
+            [OP_ADD_STRING] = &&op_OP_ADD_STRING,
+            [OP_SUBTRACT_NUMBER] = &&op_OP_SUBTRACT_NUMBER,
+            [OP_MULTIPLY_NUMBER] = &&op_OP_MULTIPLY_NUMBER,
+            [OP_DIVIDE_NUMBER] = &&op_OP_DIVIDE_NUMBER,
+            [OP_GET_LOCAL_GET_LOCAL] = &&op_OP_GET_LOCAL_GET_LOCAL,
+            [OP_GET_LOCAL_CONSTANT] = &&op_OP_GET_LOCAL_CONSTANT,
+            [OP_SET_LOCAL_POP] = &&op_OP_SET_LOCAL_POP,
+            [OP_SET_GLOBAL_POP] = &&op_OP_SET_GLOBAL_POP,
+            [OP_ADD_SET_LOCAL_POP] = &&op_OP_ADD_SET_LOCAL_POP,
+            [OP_LESS_JUMP_IF_FALSE_POP] = &&op_OP_LESS_JUMP_IF_FALSE_POP,
+            [OP_JUMP_IF_FALSE_POP] = &&op_OP_JUMP_IF_FALSE_POP,
+            [OP_POP_LOOP] = &&op_OP_POP_LOOP,
+        };
+        #define DISPATCH() \
+            do { \
+                TRACE_EXECUTION(); \
+                PROFILE_INSTRUCTION(); \
+                goto *dispatchTable[instruction = READ_BYTE()]; \
+            } while (false)
+        #define CASE(op) op_##op
+        #define DEFAULT op_UNKNOWN
+        #define NEXT DISPATCH()
+    #else
+        //* Переносимый вариант: один общий switch на все опкоды
+        #define CASE(op) case op
+        #define DEFAULT default
+        #define NEXT break
+    #endif
+
+    uint8_t instruction;
+    #ifdef COMPUTED_GOTO
+    DISPATCH();
+    {
+    #else
+    for (;;) {
+        TRACE_EXECUTION();
+        PROFILE_INSTRUCTION();
         switch (instruction = READ_BYTE()) {
-            case OP_CONSTANT:{
+    #endif
+            CASE(OP_CONSTANT):{
                 Value constant = READ_CONSTANT();
                 push(constant);
-                break;
+                NEXT;
             }
-            case OP_NIL: push(NIL_VAL); break;
-            case OP_TRUE: push(BOOL_VAL(true)); break;
-            case OP_FALSE: push(BOOL_VAL(false)); break;
-            case OP_POP: pop(); break;
-            case OP_GET_LOCAL: {
+            CASE(OP_NIL): push(NIL_VAL); NEXT;
+            CASE(OP_TRUE): push(BOOL_VAL(true)); NEXT;
+            CASE(OP_FALSE): push(BOOL_VAL(false)); NEXT;
+            CASE(OP_POP): pop(); NEXT;
+            CASE(OP_GET_LOCAL): {
                 uint8_t slot = READ_BYTE();
                 push(frame->slots[slot]);
-                break;
+                NEXT;
             }
-            case OP_SET_LOCAL: {
+            CASE(OP_SET_LOCAL): {
                 uint8_t slot = READ_BYTE();
                 frame->slots[slot] = peek(0);
-                break;
+                NEXT;
             }
-            case OP_GET_GLOBAL: {
-                ObjString* name = READ_STRING();
-                Value value;
-                if (!tableGet(&vm.globals, name, &value)) {
-                    runtimeError("Undefined variable '%s'.", name->chars);
-                    return INTERPRET_RUNTIME_ERROR;
+            CASE(OP_GET_GLOBAL): {
+                //* Операнд — 16-битный индекс слота, разрешённый компилятором
+                uint16_t slot = READ_SHORT();
+                Value value = vm.globalValues.values[slot];
+                if (IS_UNDEFINED(value)) {
+                    RUNTIME_ERROR("Undefined variable '%s'.", GLOBAL_NAME(slot)->chars);
                 }
                 push(value);
-                break;
+                NEXT;
             }
-            case OP_DEFINE_GLOBAL: {
-                //* обрабатывает команду OP_DEFINE_GLOBAL. 
-                //* Он определяет глобальную переменную с именем, считываемым из пула констант (READ_STRING()), 
-                //* и присваивает ей значение, которое в данный момент находится на вершине стека (peek(0)). 
+            CASE(OP_DEFINE_GLOBAL): {
+                //* Определяет глобальную переменную в слоте из операнда
+                //* и присваивает ей значение с вершины стека (peek(0)). 
                 //* Затем значение удаляется из стека (pop()).
-                ObjString* name = READ_STRING();
-                tableSet(&vm.globals, name, peek(0));
+                uint16_t slot = READ_SHORT();
+                vm.globalValues.values[slot] = peek(0);
                 pop();
-                break;
+                NEXT;
             }
-            case OP_SET_GLOBAL: {
-                //* обрабатывает инструкцию OP_SET_GLOBAL. 
-                //* Он пытается присвоить глобальной переменной с заданным именем (READ_STRING()) значение, 
-                //* находящееся в верхней части стека (peek(0)). 
-                //* Если переменная еще не определена, функция tableSet() возвращает значение true, и код удаляет переменную 
-                //* и сообщает об ошибке во время выполнения, указывая, что переменная не определена.
-                ObjString* name = READ_STRING();
-                if (tableSet(&vm.globals, name, peek(0))) {
-                    tableDelete(&vm.globals, name);
-                    runtimeError("Undefined variable '%s'.", name->chars);
-                    return INTERPRET_RUNTIME_ERROR;
+            CASE(OP_SET_GLOBAL): {
+                //* Присваивает значение с вершины стека (peek(0)) уже определённой глобальной переменной.
+                //* Слот, в котором всё ещё лежит UNDEFINED_VAL, означает, что переменная не определена.
+                uint16_t slot = READ_SHORT();
+                if (IS_UNDEFINED(vm.globalValues.values[slot])) {
+                    RUNTIME_ERROR("Undefined variable '%s'.", GLOBAL_NAME(slot)->chars);
                 }
-                break;
+                vm.globalValues.values[slot] = peek(0);
+                NEXT;
             }
-            case OP_GET_UPVALUE: {
+            CASE(OP_GET_UPVALUE): {
                 uint8_t slot = READ_BYTE();
                 push(*frame->closure->upvalues[slot]->location);
-                break;
+                NEXT;
             }
-            case OP_SET_UPVALUE: {
+            CASE(OP_SET_UPVALUE): {
                 uint8_t slot = READ_BYTE();
-                *frame->closure->upvalues[slot]->location = peek(0);
-                break;
+                ObjUpvalue* upvalue = frame->closure->upvalues[slot];
+                deletionBarrier(*upvalue->location);
+                *upvalue->location = peek(0);
+                writeBarrier((Obj*)upvalue, peek(0));
+                NEXT;
             }
-            case OP_EQUAL: {
+            CASE(OP_EQUAL): {
                 Value b = pop();
                 Value a = pop();
                 push(BOOL_VAL(valuesEqual(a, b)));
-                break;
+                NEXT;
             }
-            case OP_GREATER: BINARY_OP(BOOL_VAL, >); break;
-            case OP_LESS: BINARY_OP(BOOL_VAL, <); break;
-            case OP_ADD: {
+            CASE(OP_GREATER): BINARY_OP(BOOL_VAL, >, OP_GREATER_NUMBER); NEXT;
+            CASE(OP_LESS): BINARY_OP(BOOL_VAL, <, OP_LESS_NUMBER); NEXT;
+            CASE(OP_ADD): {
                 if (IS_STRING(peek(0)) && IS_STRING(peek(1))) {
+                    QUICKEN(OP_ADD_STRING);
+                    frame->ip = ip;
                     concatenate();
                 } else if(IS_NUMBER(peek(0)) && IS_NUMBER(peek(1))) {
+                    QUICKEN(OP_ADD_NUMBER);
                     double b = AS_NUMBER(pop());
                     double a = AS_NUMBER(pop());
                     push(NUMBER_VAL(a + b));
                 } else {
-                    runtimeError("Operands must be two numbers or two strings.");
-                    return INTERPRET_RUNTIME_ERROR;
+                    RUNTIME_ERROR("Operands must be two numbers or two strings.");
                 }
-                break;
+                NEXT;
+            }
+            CASE(OP_SUBTRACT): BINARY_OP(NUMBER_VAL, -, OP_SUBTRACT_NUMBER); NEXT;
+            CASE(OP_MULTIPLY): BINARY_OP(NUMBER_VAL, *, OP_MULTIPLY_NUMBER); NEXT;
+            CASE(OP_DIVIDE): BINARY_OP(NUMBER_VAL, /, OP_DIVIDE_NUMBER); NEXT;
+            CASE(OP_GREATER_NUMBER): NUMBER_OP(BOOL_VAL, >, OP_GREATER); NEXT;
+            CASE(OP_LESS_NUMBER): NUMBER_OP(BOOL_VAL, <, OP_LESS); NEXT;
+            CASE(OP_ADD_NUMBER): NUMBER_OP(NUMBER_VAL, +, OP_ADD); NEXT;
+            CASE(OP_ADD_STRING): {
+                if (IS_STRING(peek(0)) && IS_STRING(peek(1))) {
+                    frame->ip = ip;
+                    concatenate();
+                } else {
+                    DEOPTIMIZE(OP_ADD);
+                }
+                NEXT;
+            }
+            CASE(OP_SUBTRACT_NUMBER): NUMBER_OP(NUMBER_VAL, -, OP_SUBTRACT); NEXT;
+            CASE(OP_MULTIPLY_NUMBER): NUMBER_OP(NUMBER_VAL, *, OP_MULTIPLY); NEXT;
+            CASE(OP_DIVIDE_NUMBER): NUMBER_OP(NUMBER_VAL, /, OP_DIVIDE); NEXT;
+            //* Суперинструкции. Байты слитых инструкций лежат на своих местах,
+            //* поэтому операнды читаются с пропуском их опкодов (см. chunk.h)
+            CASE(OP_GET_LOCAL_GET_LOCAL): {
+                push(frame->slots[ip[0]]);
+                push(frame->slots[ip[2]]);
+                ip += 3;
+                NEXT;
+            }
+            CASE(OP_GET_LOCAL_CONSTANT): {
+                push(frame->slots[ip[0]]);
+                push(frame->closure->function->chunk.constants.values[ip[2]]);
+                ip += 3;
+                NEXT;
+            }
+            CASE(OP_SET_LOCAL_POP): {
+                frame->slots[ip[0]] = pop();
+                ip += 2;
+                NEXT;
+            }
+            CASE(OP_SET_GLOBAL_POP): {
+                uint16_t slot = READ_SHORT();
+                if (IS_UNDEFINED(vm.globalValues.values[slot])) {
+                    RUNTIME_ERROR("Undefined variable '%s'.", GLOBAL_NAME(slot)->chars);
+                }
+                vm.globalValues.values[slot] = pop();
+                ip++;
+                NEXT;
+            }
+            CASE(OP_ADD_SET_LOCAL_POP): {
+                if (IS_NUMBER(peek(0)) && IS_NUMBER(peek(1))) {
+                    double b = AS_NUMBER(pop());
+                    double a = AS_NUMBER(pop());
+                    frame->slots[ip[1]] = NUMBER_VAL(a + b);
+                } else if (IS_STRING(peek(0)) && IS_STRING(peek(1))) {
+                    frame->ip = ip;
+                    concatenate();
+                    frame->slots[ip[1]] = pop();
+                } else {
+                    RUNTIME_ERROR("Operands must be two numbers or two strings.");
+                }
+                ip += 3;
+                NEXT;
+            }
+            CASE(OP_LESS_JUMP_IF_FALSE_POP): {
+                if (!IS_NUMBER(peek(0)) || !IS_NUMBER(peek(1))) {
+                    RUNTIME_ERROR("Operands must be numbers.");
+                }
+                double b = AS_NUMBER(pop());
+                double a = AS_NUMBER(pop());
+                uint16_t offset = (uint16_t)((ip[1] << 8) | ip[2]);
+                if (a < b) {
+                    //* Условие истинно: POP из цепочки сразу снимает его со стека
+                    ip += 4;
+                } else {
+                    //* Условие ложно: оставляем его для POP в месте перехода
+                    push(BOOL_VAL(false));
+                    ip += 3 + offset;
+                }
+                NEXT;
             }
-            case OP_SUBTRACT: BINARY_OP(NUMBER_VAL, -); break;
-            case OP_MULTIPLY: BINARY_OP(NUMBER_VAL, *); break;
-            case OP_DIVIDE: BINARY_OP(NUMBER_VAL, /); break;
-            case OP_NOT: push(BOOL_VAL(isFalsey(pop()))); break;
-            case OP_NEGATE:
+            CASE(OP_JUMP_IF_FALSE_POP): {
+                uint16_t offset = READ_SHORT();
+                if (isFalsey(peek(0))) {
+                    ip += offset;
+                } else {
+                    pop();
+                    ip++;
+                }
+                NEXT;
+            }
+            CASE(OP_POP_LOOP): {
+                pop();
+                ip++;
+                uint16_t offset = READ_SHORT();
+                ip -= offset;
+                BACK_EDGE();
+                NEXT;
+            }
+            CASE(OP_NOT): push(BOOL_VAL(isFalsey(pop()))); NEXT;
+            CASE(OP_NEGATE):
                 if (!IS_NUMBER(peek(0))) {
-                    runtimeError("Operand must be a number.");
-                    return INTERPRET_RUNTIME_ERROR;
+                    RUNTIME_ERROR("Operand must be a number.");
                 }
                 push(NUMBER_VAL(-AS_NUMBER(pop()))); 
-                break;
-            case OP_PRINT: {
+                NEXT;
+            CASE(OP_PRINT): {
                 printValue(pop());
                 printf("\n");
-                break;
+                NEXT;
             }
-            case OP_JUMP: {
+            CASE(OP_JUMP): {
                 uint16_t offset = READ_SHORT();
-                frame->ip += offset;
-                break;
+                ip += offset;
+                NEXT;
             }
-            case OP_JUMP_IF_FALSE: {
+            CASE(OP_JUMP_IF_FALSE): {
                 uint16_t offset = READ_SHORT();
-                if (isFalsey(peek(0))) frame->ip += offset;
-                break;
+                if (isFalsey(peek(0))) ip += offset;
+                NEXT;
             }
-            case OP_LOOP: {
+            CASE(OP_LOOP): {
                 uint16_t offset = READ_SHORT();
-                frame->ip -= offset;
-                break;
+                ip -= offset;
+                BACK_EDGE();
+                NEXT;
             }
-            case OP_CALL: {
+            CASE(OP_CALL): {
                 /*
                 * Нам нужно знать вызываемую функцию и количество переданных ей аргументов. 
                 * Последнее мы получаем из операнда инструкции
                 */
                 int argCount = READ_BYTE();
+                frame->ip = ip;
+                safepoint();
                 if (!callValue(peek(argCount), argCount)) {
                     return INTERPRET_RUNTIME_ERROR;
                 }
-                //* 
-                frame = &vm.frames[vm.frameCount - 1];
-                break;
+                //* Если вызвана Lox-функция, продолжаем выполнение уже в её фрейме
+                frame = vm.frame;
+            #ifdef JIT
+                if (frame->native) {
+                    //* Функция уже переведена в машинный код: он выполняет её до возврата
+                    //* (или до хвостового вызова функции без машинного кода — тогда её фрейм продолжим здесь)
+                    if (runNative(frame) == NATIVE_ERROR) return INTERPRET_RUNTIME_ERROR;
+                    frame = vm.frame;
+                }
+            #endif
+                ip = frame->ip;
+                NEXT;
             }
-            case OP_CLOSURE: {
+            CASE(OP_TAIL_CALL): {
+                //* Как OP_CALL, но новый фрейм не заводится: вызываемая функция выполняется в текущем
+                int argCount = READ_BYTE();
+                frame->ip = ip;
+                safepoint();
+                if (!tailCallValue(peek(argCount), argCount)) {
+                    return INTERPRET_RUNTIME_ERROR;
+                }
+            #ifdef JIT
+                if (frame->native) {
+                    NativeResult result = runNative(frame);
+                    if (result == NATIVE_ERROR) return INTERPRET_RUNTIME_ERROR;
+                    if (result == NATIVE_RETURN) {
+                        //* Фрейм уже снят вместе с результатом, дальше — как после OP_RETURN
+                        frame = vm.frame;
+                        if (frame->native) return INTERPRET_OK;
+                    }
+                }
+            #endif
+                ip = frame->ip;
+                NEXT;
+            }
+            CASE(OP_CLOSURE): {
                 ObjFunction* function = AS_FUNCTION(READ_CONSTANT());
+                frame->ip = ip; //* Выделение памяти может закончиться ошибкой "Out of memory"
                 ObjClosure* closure = newClosure(function);
                 push(OBJ_VAL((Obj*)closure));
                 //* Теперь мы должны проинициализировать upvalues
                 //* нашего замыкания.
                 //* читаем количество upvalues из байт-кода
                 for (int i = 0; i < closure->upvalueCount; i++) {
-                    uint8_t isLocal = READ_BYTE();
+                    uint8_t capture = READ_BYTE();
                     uint8_t index = READ_BYTE();
-                    if (isLocal) {
+                    if (capture == CAPTURE_LOCAL) {
                         //* Если upvalue является локальным, 
                         //* мы захватываем upvalue из текущего фрейма
                         closure->upvalues[i] = captureUpvalue(frame->slots + index);
+                    } else if (capture == CAPTURE_VALUE) {
+                        //* Переменную больше не присваивают: достаточно копии её значения
+                        closure->upvalues[i] = copyUpvalue(frame->slots + index);
                     } else {
                         //* Если upvalue не является локальным, 
                         //* мы просто копируем upvalue из текущего замыкания
                         closure->upvalues[i] = frame->closure->upvalues[index];
                     }
+                    //* Питомник мог быть заполнен, и тогда само замыкание уже в старой куче
+                    writeBarrier((Obj*)closure, OBJ_VAL((Obj*)closure->upvalues[i]));
                 }
-                break;
+                NEXT;
             }
-            case OP_CLOSE_UPVALUE:
+            CASE(OP_CLOSE_UPVALUE):
             /*
             * Когда мы доходим до этой инструкции, переменная, которую мы поднимаем, оказывается в верхней части стека. 
             * Мы вызываем вспомогательную функцию, передавая ей адрес этого слота в стеке. 
@@ -395,11 +932,12 @@ static InterpretResult run() {
             */
                 closedUpvalues(vm.stackTop - 1);
                 pop();
-                break;
-            case OP_RETURN: {
+                NEXT;
+            CASE(OP_RETURN): {
                 Value result = pop();
                 closedUpvalues(frame->slots);
                 vm.frameCount--;
+                vm.frame = frame->previous;
                 if (vm.frameCount == 0) {
                     pop();
                     return INTERPRET_OK;
@@ -407,27 +945,74 @@ static InterpretResult run() {
 
                 vm.stackTop = frame->slots;
                 push(result);
-                frame = &vm.frames[vm.frameCount - 1];
-                break;
-            }  
+                frame = vm.frame;
+                //* Вызывающий выполняется машинным кодом: результат уже на стеке, возвращаемся в него
+                if (frame->native) return INTERPRET_OK;
+                ip = frame->ip;
+                NEXT;
+            }
+            DEFAULT:
+                RUNTIME_ERROR("Unknown opcode %d.", instruction);
+    #ifndef COMPUTED_GOTO
         }
+    #endif
     }
 
+    #undef NEXT
+    #undef DEFAULT
+    #undef CASE
+    #ifdef COMPUTED_GOTO
+        #undef DISPATCH
+    #endif
+    #undef BACK_EDGE
+    #undef PROFILE_INSTRUCTION
+    #undef TRACE_EXECUTION
+    #undef NUMBER_OP
     #undef BINARY_OP
+    #undef DEOPTIMIZE
+    #undef QUICKEN
+    #undef RUNTIME_ERROR
+    #undef GLOBAL_NAME
     #undef READ_STRING
     #undef READ_SHORT
     #undef READ_CONSTANT
     #undef READ_BYTE
 }
 
+static InterpretResult execute(ObjClosure* closure) {
+    call(closure, 0);
+    if (vm.registerMode) return runRegisters();
+#ifdef JIT
+    if (vm.frames->native) {
+        if (runNative(vm.frames) == NATIVE_ERROR) return INTERPRET_RUNTIME_ERROR;
+        pop();
+        return INTERPRET_OK;
+    }
+#endif
+    return run();
+}
+
 InterpretResult interpret(const char* source) {
     ObjFunction* function = compile(source);
     if (function == NULL) return INTERPRET_COMPILE_ERROR;
 
+    //* Замыкание скрипта выделяется, пока vm.errorJump нет, и предел кучи не проверяет, как и компиляция.
+    //* Иначе после нехватки памяти в REPL куча остаётся больше предела и не выполнится ни одна строка,
+    //* даже освобождающая память (keep = nil;)
     push(OBJ_VAL((Obj*)function));
     ObjClosure* closure = newClosure(function);
     pop();
     push(OBJ_VAL((Obj*)closure));
-    call(closure, 0);
-    return run();
+
+    //* Нехватка памяти во время выполнения уже сообщена (heapLimitExceeded) и возвращается сюда
+    jmp_buf errorJump;
+    if (setjmp(errorJump) != 0) {
+        vm.errorJump = NULL;
+        return INTERPRET_RUNTIME_ERROR;
+    }
+    vm.errorJump = &errorJump;
+    vm.nativeStackBase = (char*)__builtin_frame_address(0);
+    InterpretResult result = execute(closure);
+    vm.errorJump = NULL;
+    return result;
 }
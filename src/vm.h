@@ -1,13 +1,102 @@
 #ifndef clox_vm_h
 #define clox_vm_h
 
+#include <setjmp.h>
+
 #include "chunk.h"
 #include "value.h"
 #include "table.h"
 #include "object.h"
+#include "memory.h"
+
+//* Стек значений и стек фреймов растут по мере надобности, до этих пределов по умолчанию.
+//* Пределы меняются флагами clox --max-frames и --max-stack
+#ifndef FRAMES_MAX
+#define FRAMES_MAX 10000
+#endif
+#ifndef STACK_MAX
+#define STACK_MAX (1 << 20)
+#endif
+#define STACK_INITIAL 256 // Начальная ёмкость стека значений
+
+/*
+ * Вызовы из машинного кода JIT вкладываются на стеке C, и --max-frames его не защищает.
+ * Когда interpret занял стек C больше чем на NATIVE_STACK_MAX байт (и не больше половины ulimit -s),
+ * новые фреймы выполняет интерпретатор: его вызовы стек C не углубляют
+ */
+#ifndef NATIVE_STACK_MAX
+#define NATIVE_STACK_MAX (4 * 1024 * 1024)
+#endif
+
+/*
+ * Предел кучи (clox --heap-limit): сколько байт может быть выделено через reallocate.
+ * Новый объект проверяет предел до выделения; если и после полной сборки куча больше предела,
+ * выполнение прерывается ошибкой времени выполнения "Out of memory" (см. heapLimitExceeded).
+ * Ошибка возвращает управление вызывающему interpret через vm.errorJump, процесс продолжает работу
+ */
+#ifndef HEAP_LIMIT
+#define HEAP_LIMIT SIZE_MAX
+#endif
+
+/*
+ * Конкатенация с результатом не короче BUILDER_MIN_LENGTH символов даёт неинтернированный срез
+ * общего буфера построителя (ObjSlice), и повторное s = s + piece дописывает в этот буфер.
+ * Короткие результаты — обычные ObjString, интернируемые только при сборке с -DNO_LAZY_INTERNING
+ */
+#ifndef BUILDER_MIN_LENGTH
+#define BUILDER_MIN_LENGTH 64
+#endif
 
-#define FRAMES_MAX 64
-#define STACK_MAX (FRAMES_MAX * UINT8_COUNT)
+/*
+ * Поколения. Новые объекты выделяются сдвигом указателя в питомнике — непрерывной области
+ * в NURSERY_SIZE байт. Когда он заполнится, малая сборка (collectNursery) переносит выжившие
+ * объекты в старую кучу (список vm.objects) и освобождает питомник целиком.
+ * Малая сборка перемещает объекты, поэтому запускается только в безопасных точках (safepoint),
+ * где на молодые объекты не ссылается ничего, кроме корней и запомненных старых объектов.
+ */
+#ifndef NURSERY_SIZE
+#define NURSERY_SIZE (256 * 1024)
+#endif
+
+/*
+ * Уплотнение старой кучи (clox --compact RATIO). Старые строки, замыкания и upvalue выделяются
+ * сдвигом указателя в непрерывной области vm.compactSpace, и освобождённые объекты оставляют в ней дыры.
+ * Когда дыры составят долю RATIO занятой части, в ближайшей безопасной точке живые объекты
+ * сдвигаются к началу области, а ссылки на них переписываются (compactHeap в memory.c).
+ * Функции и встроенные функции не перемещаются: на них ссылаются машинный код и кэш трасс
+ */
+#ifndef COMPACT_SPACE_SIZE
+#define COMPACT_SPACE_SIZE (1024 * 1024)
+#endif
+
+/*
+ * Инкрементальная полная сборка (clox --incremental): пометка и очистка идут короткими шагами
+ * при выделениях памяти, а не одной паузой. Темп задаёт выделение: считаются байты, выделенные
+ * в питомнике и в старой куче, в том числе при переносе из питомника (vm.gcDebt). Каждые GC_STEP_SIZE
+ * таких байт шаг просматривает в GC_STEP_RATIO раз больше байт кучи, так что за цикл сборки куча
+ * вырастает не больше чем на (живые + вся старая куча) / GC_STEP_RATIO.
+ * Шаг прерывается раньше, если длится дольше vm.maxPause микросекунд (clox --max-pause), а недоделанная
+ * работа остаётся долгом: следующий шаг начнётся при следующем же выделении.
+ * Повторная пометка корней в конце пометки тоже идёт шагами. Не ограничены --max-pause только пометка корней в начале цикла,
+ * переход к очистке (таблица строк, питомник) и малые сборки: они зависят от корней и размера питомника (NURSERY_SIZE),
+ * но не от размера старой кучи
+ */
+#ifndef GC_STEP_SIZE
+#define GC_STEP_SIZE (16 * 1024)
+#endif
+#ifndef GC_STEP_RATIO
+#define GC_STEP_RATIO 4
+#endif
+#define GC_MAX_PAUSE 1000
+//* Гистограмма пауз: корзина 0 — меньше 1 мкс, корзина k — от 2^(k-1) до 2^k мкс
+#define GC_PAUSE_BUCKETS 24
+
+typedef enum {
+    GC_IDLE, // Сборки нет
+    GC_MARKING, // Идёт пометка: новые объекты сразу чёрные, записи в кучу проходят барьер
+    GC_CONCURRENT_MARKING, // Старую кучу помечает отдельный поток (clox --concurrent), новые объекты чёрные
+    GC_SWEEPING, // Пометка закончена, старая куча очищается по частям (vm.sweepList)
+} GCPhase;
 
 //* один текущий вызов функции
 /*
@@ -15,22 +104,89 @@
 * который ещё не завершился — нам нужно отслеживать, 
 * где в стеке начинаются локальные переменные этой функции и где должен возобновиться вызов
 */
-typedef struct {
+typedef struct CallFrame {
     ObjClosure* closure; //* указатель на замыкание (функцию и состояние переменных во время выполнения)
     //* Когда мы возвращаемся из функции, виртуальная машина переходит к ip фрейма CallFrame вызывающего объекта и продолжает работу оттуда
     uint8_t* ip; //*  вызывающий объект сохраняет свой собственный ip. 
     Value* slots; //* указывает на стек значений виртуальной машины в первом слоте, который может использовать эта функция
+    //* Фрейм выполняется машинным кодом (jit.c), а не интерпретатором.
+    //* ip такого фрейма обновляется только перед вызовами и ошибками — для трассировки стека
+    bool native;
+    //* Фреймы связаны в список и не перемещаются в памяти, поэтому указатели на них
+    //* (в run(), в машинном коде) переживают рост стека фреймов.
+    //* Снятые фреймы остаются в списке и переиспользуются следующими вызовами
+    struct CallFrame* previous;
+    struct CallFrame* next;
 } CallFrame;
 
 typedef struct {
-    CallFrame frames[FRAMES_MAX];
+    CallFrame* frames; // Фрейм скрипта, начало списка фреймов
+    CallFrame* frame; // Текущий (верхний) фрейм; NULL — ни одного
     int frameCount;
-    Value stack[STACK_MAX];
+    int maxFrames; // Предел глубины вызовов
+    //* Стек значений перевыделяется при росте: frame->slots и открытые upvalue переносятся (growStack)
+    Value* stack;
     Value* stackTop;
-    Table globals; // Таблица глобальных переменных
+    int stackCapacity;
+    int maxStack; // Предел размера стека значений
+    char* nativeStackBase; // Стек C на входе в interpret
+    size_t nativeStackLimit; // Сколько стека C может занять вложенный машинный код
+    //* Глобальные переменные разрешаются в индексы ещё при компиляции:
+    //* инструкции OP_*_GLOBAL адресуют слот в globalValues напрямую, без поиска по хэш-таблице
+    Table globalSlots; // Имя глобальной переменной -> индекс её слота
+    ValueArray globalValues; // Значения глобальных переменных; UNDEFINED_VAL — ещё не определена
+    ValueArray globalNames; // Имена глобальных переменных по индексу слота (для ошибок и отладки)
     Table strings; // Таблица строк для выполнения Интернирования строк
     ObjUpvalue* openUpvalues; // Список открытых upvalue
     Obj* objects; // Указатель на первый объект интрузивного списка. Сборщик мусора
+    size_t bytesAllocated; // Сколько байт сейчас выделено через reallocate
+    size_t peakBytes; // Наибольшее значение bytesAllocated за время работы
+    size_t nextGC; // Порог bytesAllocated, при переходе которого запускается сборка мусора
+    size_t heapLimit; // Предел bytesAllocated для новых объектов
+    //* Точка возврата interpret на время выполнения: сюда уходит ошибка нехватки памяти.
+    //* NULL — идёт компиляция или сборка, и нехватка памяти по-прежнему завершает процесс
+    jmp_buf* errorJump;
+    size_t collections; // Сколько раз запускалась сборка мусора
+    //* Серые объекты: помечены, но их ссылки ещё не просмотрены.
+    //* Память под этот стек берётся у системы напрямую, мимо reallocate: иначе он запускал бы сборку сам
+    int grayCount;
+    int grayCapacity;
+    Obj** grayStack;
+    char* nursery; // Питомник молодых объектов (NURSERY_SIZE байт, не перемещается)
+    char* nurseryTop; // Граница занятой части питомника: сюда выделяется следующий объект
+    bool nurseryFull; // Объект не поместился в питомник: в ближайшей безопасной точке — малая сборка
+    bool pretenure; // Выделять объекты сразу в старой куче (на время компиляции)
+    //* Запомненное множество: старые объекты со ссылками в питомник (см. writeBarrier).
+    //* Как и серый стек, память под него берётся мимо reallocate
+    int rememberedCount;
+    int rememberedCapacity;
+    Obj** remembered;
+    size_t minorCollections; // Сколько раз запускалась малая сборка
+    size_t promotedBytes; // Сколько байт перенесено из питомника в старую кучу
+    bool incrementalGC; // Полная сборка идёт шагами (clox --incremental)
+    bool concurrentGC; // Пометка старой кучи идёт в отдельном потоке (clox --concurrent)
+    GCPhase gcPhase;
+    double maxPause; // Целевая длительность шага инкрементальной сборки, мкс
+    size_t gcDebt; // Байты, выделенные с прошлого шага инкрементальной сборки и ещё не оплаченные её работой
+    Obj* sweepList; // Старые объекты, которые ещё предстоит проверить фазе очистки
+    size_t pauseHistogram[GC_PAUSE_BUCKETS]; // Паузы сборщика мусора (шаги, малые и полные сборки)
+    double longestPause; // Самая длинная пауза, мкс
+    double totalPause; // Сколько всего программа простояла в паузах сборщика, мкс
+    double markerTime; // Сколько работал поток параллельной пометки, мкс
+    double compactRatio; // Доля дыр, при которой уплотняемая область уплотняется; 0 — уплотнение выключено
+    char* compactSpace; // Уплотняемая область старой кучи (выделяется при первом объекте)
+    char* compactTop; // Граница занятой части области
+    char* compactEnd;
+    size_t compactHoles; // Сколько байт занятой части приходится на освобождённые объекты
+    bool compactPending; // В ближайшей безопасной точке — уплотнение
+    size_t compactions; // Сколько раз область уплотнялась
+    size_t quickenedSites; // Сколько раз инструкция переписала себя в специализированный вариант
+    size_t deoptimizedSites; // Сколько раз специализированный вариант откатился к обобщённому
+    bool registerMode; // Исполнять регистровый код (clox --register) вместо стекового
+    size_t jitFunctions; // Сколько функций переведено в машинный код
+    size_t compiledTraces; // Сколько циклов переведено в машинный код трассирующим JIT
+    size_t traceExits; // Сколько раз машинный код трасс вернул управление интерпретатору
+    bool dumpTraces; // Печатать записанные трассы и счётчики выходов (clox --traces)
 } VM;
 
 typedef enum {
@@ -44,7 +200,99 @@ extern VM vm;
 void initVM();
 void freeVM();
 InterpretResult interpret(const char* source);
+int globalSlot(ObjString* name);
+void printVMStats();
 void push(Value value);
 Value pop();
+Value peek(int distance);
+
+//* Общие для стековой и регистровой машин части: вызовы, upvalue, ошибки времени выполнения
+void runtimeError(const char* format, ...);
+bool callValue(Value callee, int argCount);
+bool tailCallValue(Value callee, int argCount);
+bool growStack(int count);
+CallFrame* appendFrame();
+ObjUpvalue* captureUpvalue(Value* local);
+ObjUpvalue* copyUpvalue(Value* local);
+void closedUpvalues(Value* last);
+void collectNursery();
+void rememberObject(Obj* object);
+void rememberOverwritten(Obj* object);
+bool isFalsey(Value value);
+void concatenate();
+InterpretResult run();
+InterpretResult runRegisters();
+
+#ifdef JIT
+//* Можно ли запустить ещё один машинный фрейм, не выходя за vm.nativeStackLimit
+static inline bool nativeStackAvailable() {
+    char* here = (char*)__builtin_frame_address(0);
+    return vm.nativeStackBase == NULL || (size_t)(vm.nativeStackBase - here) < vm.nativeStackLimit;
+}
+#endif
+
+/*
+ * Гарантирует место ещё под count значений над vm.stackTop, при необходимости расширяя стек.
+ * Возвращает false, если для этого пришлось бы превысить vm.maxStack; ошибку сообщает вызывающий.
+ */
+static inline bool reserveStack(int count) {
+    if (vm.stackTop + count <= vm.stack + vm.stackCapacity) return true;
+    return growStack(count);
+}
+
+//* Заводит новый верхний фрейм; предел глубины vm.maxFrames проверяет вызывающий
+static inline CallFrame* pushFrame() {
+    CallFrame* frame = vm.frame == NULL ? vm.frames : vm.frame->next;
+    if (frame == NULL) frame = appendFrame();
+    vm.frame = frame;
+    vm.frameCount++;
+    return frame;
+}
+
+//* Объект лежит в питомнике
+static inline bool isYoung(Obj* object) {
+    return (uintptr_t)((char*)object - vm.nursery) < NURSERY_SIZE;
+}
+
+//* Объект лежит в уплотняемой области старой кучи
+static inline bool inCompactSpace(Obj* object) {
+    return (uintptr_t)((char*)object - vm.compactSpace) < (uintptr_t)(vm.compactEnd - vm.compactSpace);
+}
+
+/*
+ * Барьер записи: объект owner получил ссылку value. Если owner старый, а ссылка ведёт в питомник,
+ * owner попадает в запомненное множество — малая сборка просмотрит его как корень.
+ * Глобальные переменные и таблицы VM сами просматриваются как корни и барьера не требуют
+ */
+static inline void writeBarrier(Obj* owner, Value value) {
+    if (!IS_OBJ(value)) return;
+    //* Во время инкрементальной пометки записанный объект не должен остаться белым (барьер Дейкстры):
+    //* иначе чёрный owner, которого сборщик больше не просмотрит, сослался бы на непомеченный объект
+    if (vm.gcPhase == GC_MARKING) markObject(AS_OBJ(value));
+    if (isYoung(AS_OBJ(value)) && !isRemembered(owner) && !isYoung(owner)) rememberObject(owner);
+}
+
+/*
+ * Барьер удаления (snapshot-at-the-beginning) для параллельной пометки: ссылка value сейчас
+ * будет перезаписана. Всё, что было достижимо в начале пометки, должно быть помечено,
+ * поэтому старый объект, теряющий ссылку, откладывается до заключительной пометки
+ */
+static inline void deletionBarrier(Value value) {
+    if (vm.gcPhase == GC_CONCURRENT_MARKING && IS_OBJ(value)) rememberOverwritten(AS_OBJ(value));
+}
+
+//* Безопасная точка: питомник заполнен — переносим выживших.
+//* Уплотнению тоже нужна безопасная точка, поэтому оно выставляет nurseryFull и выполняется после малой сборки
+static inline void safepoint() {
+    if (vm.nurseryFull) collectNursery();
+}
+
+#if defined(COMPUTED_GOTO) && !defined(__clang__)
+//* Не даём GCC слить все "goto *" обратно в одну общую точку перехода:
+//* иначе шитый код вырождается в тот же единственный косвенный переход, что и у switch
+#define DISPATCH_ATTRIBUTES __attribute__((optimize("no-gcse", "no-crossjumping")))
+#else
+#define DISPATCH_ATTRIBUTES
+#endif
 
 #endif
\ No newline at end of file